@@ -0,0 +1,870 @@
+//
+// Benchmarks for the memory pool.
+//
+// Usage: msl-clang-003-bench [name] [max_gaps]
+//   name      - run only the benchmark with this name (default: all)
+//   max_gaps  - upper end of the gap count sweep (default: 1000000)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mem_pool.h"
+
+
+/*****            constants            *****/
+
+static const unsigned BENCH_MIN_GAPS      = 1000;
+static const unsigned BENCH_MAX_GAPS      = 1000000;
+static const unsigned BENCH_GAP_ROUNDS    = 200000;
+static const unsigned BENCH_ALLOC_UNIT    = 16;
+
+static const unsigned BENCH_STRESS_ALLOCS = 1000;
+static const unsigned BENCH_STRESS_MIN    = 10;
+static const unsigned BENCH_CHURN_ROUNDS  = 200000;
+
+static const unsigned BENCH_SCAN_MIN_ALLOCS = 1000;
+static const unsigned BENCH_SCAN_MAX_ALLOCS = 100000;
+static const unsigned BENCH_SCAN_ROUNDS   = 20000;
+
+static const unsigned BENCH_BATCH_SIZE    = 32;
+static const unsigned BENCH_BATCH_ROUNDS  = 20000;
+
+static const unsigned BENCH_SMALL_OBJECTS = 10000;
+static const unsigned BENCH_SMALL_ROUNDS  = 20;
+
+static const unsigned BENCH_MAX_THREADS   = 16;
+static const unsigned BENCH_THREAD_OPS    = 200000;
+static const unsigned BENCH_THREAD_WINDOW = 64;
+
+static const unsigned BENCH_REMOTE_ALLOCS = 4096;
+static const unsigned BENCH_REMOTE_ROUNDS = 20;
+
+static const size_t   BENCH_BACKING_SIZE  = (size_t) 512 << 20;
+static const unsigned BENCH_BACKING_READS = 20000000;
+
+
+/*****         helper routines         *****/
+
+static double bench_now() {
+    struct timespec ts;
+
+    timespec_get(&ts, TIME_UTC);
+
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// xorshift, so that runs are repeatable across platforms
+static unsigned bench_rand(unsigned *seed) {
+    unsigned x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return *seed = x;
+}
+
+
+static const char *bench_policy_name(alloc_policy policy) {
+    switch (policy) {
+        case FIRST_FIT: return "FIRST_FIT";
+        case BEST_FIT:  return "BEST_FIT";
+        case NEXT_FIT:  return "NEXT_FIT";
+        case SEGREGATED_FIT: return "SEGREGATED_FIT";
+        case BUDDY:     return "BUDDY";
+        case TLSF:      return "TLSF";
+        case FIXED_SIZE: return "FIXED_SIZE";
+        case BITMAP_FIT: return "BITMAP_FIT";
+        case LINEAR:    return "LINEAR";
+    }
+    return "?";
+}
+
+// 1 - largest gap / free bytes: 0 when all free memory is one gap
+static double bench_fragmentation(pool_pt pool) {
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+    size_t free_bytes = 0, largest = 0;
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    for (unsigned u = 0; u < num_segs; ++u) {
+        if (!segs[u].allocated) {
+            free_bytes += segs[u].size;
+            if (segs[u].size > largest) largest = segs[u].size;
+        }
+    }
+    free(segs);
+
+    return free_bytes ? 1.0 - (double) largest / (double) free_bytes : 0.0;
+}
+
+static int bench_cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+// sorts the samples
+static void bench_print_percentiles(const char *policy, const char *op, double *samples, unsigned n) {
+    qsort(samples, n, sizeof(double), bench_cmp_double);
+
+    printf("%-24s %16s %6s %10.0f %10.0f %10.0f %10.0f\n", "", policy, op,
+           samples[n / 2], samples[(unsigned) (n * 0.99)],
+           samples[(unsigned) (n * 0.999)], samples[n - 1]);
+}
+
+
+/*******************************************/
+/***      1. BEST_FIT GAP INDEX          ***/
+/*******************************************/
+
+/*
+ * Fill a BEST_FIT pool with 2 * num_gaps allocations of assorted sizes
+ * and free every other one, which leaves num_gaps gaps that cannot
+ * coalesce. Then time allocate/free pairs of random sizes: every pair
+ * searches the gap index, splits a gap, and merges it back.
+ */
+static void bench_best_fit_gaps(unsigned max_gaps) {
+    printf("%-24s %12s %14s\n", "best_fit_gaps", "gaps", "ns/(alloc+free)");
+
+    for (unsigned num_gaps = BENCH_MIN_GAPS; num_gaps <= max_gaps; num_gaps *= 10) {
+        unsigned num_allocs = 2 * num_gaps;
+        unsigned seed = 2463534242u;
+        size_t pool_size = 0;
+
+        size_t *sizes = malloc(num_allocs * sizeof(size_t));
+        void **allocs = malloc(num_allocs * sizeof(void *));
+        if (!sizes || !allocs) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        for (unsigned i = 0; i < num_allocs; ++i) {
+            sizes[i] = BENCH_ALLOC_UNIT * (1 + bench_rand(&seed) % 64);
+            pool_size += sizes[i];
+        }
+        // room for the timed allocations at the end of the pool
+        pool_size += 64 * BENCH_ALLOC_UNIT;
+
+        mem_init();
+        pool_pt pool = mem_pool_open(pool_size, BEST_FIT);
+        for (unsigned i = 0; i < num_allocs; ++i) {
+            allocs[i] = mem_new_alloc(pool, sizes[i]);
+        }
+        for (unsigned i = 1; i < num_allocs; i += 2) {
+            mem_del_alloc(pool, allocs[i]);
+            allocs[i] = NULL;
+        }
+
+        double start = bench_now();
+        for (unsigned r = 0; r < BENCH_GAP_ROUNDS; ++r) {
+            void *alloc = mem_new_alloc(pool, BENCH_ALLOC_UNIT * (1 + bench_rand(&seed) % 64));
+            mem_del_alloc(pool, alloc);
+        }
+        double elapsed = bench_now() - start;
+
+        printf("%-24s %12u %14.1f\n", "", pool->num_gaps,
+               elapsed * 1e9 / BENCH_GAP_ROUNDS);
+
+        for (unsigned i = 0; i < num_allocs; i += 2) {
+            mem_del_alloc(pool, allocs[i]);
+        }
+        mem_pool_close(pool);
+        mem_free();
+
+        free(allocs);
+        free(sizes);
+    }
+}
+
+
+/*******************************************/
+/***      2. PLACEMENT POLICIES          ***/
+/*******************************************/
+
+/*
+ * The shape of test_pool_stresstest0: 1000 allocations of 10, 20, ...
+ * 10000 bytes fill the pool exactly and every other one is freed. Then
+ * churn: free a random live allocation and allocate a random size from
+ * the same range in its place. Reports churn throughput, how many
+ * allocations did not fit, and the fragmentation left at the end.
+ */
+static void bench_policies() {
+    const alloc_policy policies[] = { FIRST_FIT, NEXT_FIT, BEST_FIT, SEGREGATED_FIT, TLSF };
+    const size_t pool_size =
+            (BENCH_STRESS_ALLOCS / 2) *
+            (2 * BENCH_STRESS_MIN + (BENCH_STRESS_ALLOCS - 1) * BENCH_STRESS_MIN);
+
+    printf("%-24s %16s %14s %10s %10s\n", "policies", "policy", "kops/s", "failed", "frag");
+
+    for (unsigned p = 0; p < sizeof(policies) / sizeof(policies[0]); ++p) {
+        void **allocs = calloc(BENCH_STRESS_ALLOCS, sizeof(void *));
+        unsigned seed = 88172645u;
+        unsigned failed = 0;
+
+        mem_init();
+        pool_pt pool = mem_pool_open(pool_size, policies[p]);
+
+        double start = bench_now();
+        for (unsigned aix = 0; aix < BENCH_STRESS_ALLOCS; ++aix) {
+            allocs[aix] = mem_new_alloc(pool, (aix + 1) * BENCH_STRESS_MIN);
+        }
+        for (unsigned aix = 1; aix < BENCH_STRESS_ALLOCS; aix += 2) {
+            mem_del_alloc(pool, allocs[aix]);
+            allocs[aix] = NULL;
+        }
+        for (unsigned r = 0; r < BENCH_CHURN_ROUNDS; ++r) {
+            unsigned aix = bench_rand(&seed) % BENCH_STRESS_ALLOCS;
+            if (allocs[aix]) {
+                mem_del_alloc(pool, allocs[aix]);
+            }
+            allocs[aix] = mem_new_alloc(pool, (1 + bench_rand(&seed) % BENCH_STRESS_ALLOCS) * BENCH_STRESS_MIN);
+            if (!allocs[aix]) {
+                ++failed;
+            }
+        }
+        double elapsed = bench_now() - start;
+
+        printf("%-24s %16s %14.1f %10u %10.3f\n", "", bench_policy_name(policies[p]),
+               (BENCH_STRESS_ALLOCS * 1.5 + BENCH_CHURN_ROUNDS * 2) / elapsed / 1e3,
+               failed, bench_fragmentation(pool));
+
+        for (unsigned aix = 0; aix < BENCH_STRESS_ALLOCS; ++aix) {
+            if (allocs[aix]) mem_del_alloc(pool, allocs[aix]);
+        }
+        mem_pool_close(pool);
+        mem_free();
+        free(allocs);
+    }
+}
+
+
+/*******************************************/
+/***      3. PER-OPERATION LATENCY       ***/
+/*******************************************/
+
+/*
+ * The churn of the policies benchmark, with every mem_new_alloc and
+ * mem_del_alloc timed on its own. Reports the latency distribution in
+ * nanoseconds (timer overhead included).
+ */
+static void bench_latency() {
+    const alloc_policy policies[] = { FIRST_FIT, BEST_FIT, TLSF };
+    const size_t pool_size =
+            (BENCH_STRESS_ALLOCS / 2) *
+            (2 * BENCH_STRESS_MIN + (BENCH_STRESS_ALLOCS - 1) * BENCH_STRESS_MIN);
+
+    printf("%-24s %16s %6s %10s %10s %10s %10s\n", "latency (ns)", "policy", "op", "p50", "p99", "p99.9", "max");
+
+    for (unsigned p = 0; p < sizeof(policies) / sizeof(policies[0]); ++p) {
+        void **allocs = calloc(BENCH_STRESS_ALLOCS, sizeof(void *));
+        double *alloc_ns = malloc(BENCH_CHURN_ROUNDS * sizeof(double));
+        double *free_ns = malloc(BENCH_CHURN_ROUNDS * sizeof(double));
+        unsigned num_alloc = 0, num_free = 0;
+        unsigned seed = 88172645u;
+
+        mem_init();
+        pool_pt pool = mem_pool_open(pool_size, policies[p]);
+        for (unsigned aix = 0; aix < BENCH_STRESS_ALLOCS; ++aix) {
+            allocs[aix] = mem_new_alloc(pool, (aix + 1) * BENCH_STRESS_MIN);
+        }
+        for (unsigned aix = 1; aix < BENCH_STRESS_ALLOCS; aix += 2) {
+            mem_del_alloc(pool, allocs[aix]);
+            allocs[aix] = NULL;
+        }
+
+        for (unsigned r = 0; r < BENCH_CHURN_ROUNDS; ++r) {
+            unsigned aix = bench_rand(&seed) % BENCH_STRESS_ALLOCS;
+            size_t size = (1 + bench_rand(&seed) % BENCH_STRESS_ALLOCS) * BENCH_STRESS_MIN;
+            double start;
+
+            if (allocs[aix]) {
+                start = bench_now();
+                mem_del_alloc(pool, allocs[aix]);
+                free_ns[num_free++] = (bench_now() - start) * 1e9;
+            }
+            start = bench_now();
+            allocs[aix] = mem_new_alloc(pool, size);
+            alloc_ns[num_alloc++] = (bench_now() - start) * 1e9;
+        }
+
+        bench_print_percentiles(bench_policy_name(policies[p]), "alloc", alloc_ns, num_alloc);
+        bench_print_percentiles(bench_policy_name(policies[p]), "free", free_ns, num_free);
+
+        for (unsigned aix = 0; aix < BENCH_STRESS_ALLOCS; ++aix) {
+            if (allocs[aix]) mem_del_alloc(pool, allocs[aix]);
+        }
+        mem_pool_close(pool);
+        mem_free();
+        free(free_ns);
+        free(alloc_ns);
+        free(allocs);
+    }
+}
+
+
+/*******************************************/
+/***      4. BITMAP SCAN                 ***/
+/*******************************************/
+
+/*
+ * Fill a pool with num_allocs allocations of 16 to 128 bytes and free
+ * every other one, then time allocate/free pairs of 16 to 256 bytes.
+ * About half of the requests are larger than any hole, so FIRST_FIT
+ * walks the whole segment list while BITMAP_FIT scans the granule
+ * bitmap, in each of its scan modes.
+ */
+static void bench_bitmap_scan() {
+    const char *modes[] = { "FIRST_FIT", "BITMAP_SCAN_BIT", "BITMAP_SCAN_WORD", "BITMAP_SCAN_SIMD" };
+
+    printf("%-24s %16s %12s %14s\n", "bitmap_scan", "engine", "allocs", "ns/(alloc+free)");
+
+    for (unsigned num_allocs = BENCH_SCAN_MIN_ALLOCS; num_allocs <= BENCH_SCAN_MAX_ALLOCS; num_allocs *= 10) {
+        for (unsigned m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+            void **allocs = malloc(num_allocs * sizeof(void *));
+            unsigned seed = 2463534242u;
+            // room for the largest fill, and for the timed allocations at the end
+            size_t pool_size = (8 * (size_t) num_allocs + 16) * BENCH_ALLOC_UNIT;
+
+            if (m > 0) {
+                mem_bitmap_scan_mode((bitmap_scan) (BITMAP_SCAN_BIT + m - 1));
+            }
+
+            mem_init();
+            pool_pt pool = mem_pool_open(pool_size, (m == 0) ? FIRST_FIT : BITMAP_FIT);
+            for (unsigned i = 0; i < num_allocs; ++i) {
+                allocs[i] = mem_new_alloc(pool, BENCH_ALLOC_UNIT * (1 + bench_rand(&seed) % 8));
+            }
+            for (unsigned i = 1; i < num_allocs; i += 2) {
+                mem_del_alloc(pool, allocs[i]);
+                allocs[i] = NULL;
+            }
+
+            double start = bench_now();
+            for (unsigned r = 0; r < BENCH_SCAN_ROUNDS; ++r) {
+                void *alloc = mem_new_alloc(pool, BENCH_ALLOC_UNIT * (1 + bench_rand(&seed) % 16));
+                mem_del_alloc(pool, alloc);
+            }
+            double elapsed = bench_now() - start;
+
+            printf("%-24s %16s %12u %14.1f\n", "", modes[m], num_allocs,
+                   elapsed * 1e9 / BENCH_SCAN_ROUNDS);
+
+            for (unsigned i = 0; i < num_allocs; i += 2) {
+                mem_del_alloc(pool, allocs[i]);
+            }
+            mem_pool_close(pool);
+            mem_free();
+            free(allocs);
+        }
+    }
+    mem_bitmap_scan_mode(BITMAP_SCAN_SIMD);
+}
+
+
+/*******************************************/
+/***      5. BATCHES                     ***/
+/*******************************************/
+
+/*
+ * The pool of the policies benchmark, every other allocation freed.
+ * Then, repeatedly, allocate 32 objects of 16 to 256 bytes and free
+ * them again, one call at a time or as one batch each way. Reports the
+ * time per object of each side.
+ */
+static void bench_batches() {
+    const alloc_policy policies[] = { FIRST_FIT, BEST_FIT, TLSF };
+    const size_t pool_size =
+            (BENCH_STRESS_ALLOCS / 2) *
+            (2 * BENCH_STRESS_MIN + (BENCH_STRESS_ALLOCS - 1) * BENCH_STRESS_MIN);
+
+    printf("%-24s %16s %8s %10s %10s\n", "batches (ns/object)", "policy", "mode", "alloc", "free");
+
+    for (unsigned p = 0; p < sizeof(policies) / sizeof(policies[0]); ++p) {
+        for (int batched = 0; batched < 2; ++batched) {
+            void **allocs = calloc(BENCH_STRESS_ALLOCS, sizeof(void *));
+            size_t sizes[BENCH_BATCH_SIZE];
+            void *objs[BENCH_BATCH_SIZE];
+            unsigned seed = 88172645u;
+            double alloc_time = 0, free_time = 0;
+
+            mem_init();
+            pool_pt pool = mem_pool_open(pool_size, policies[p]);
+            for (unsigned aix = 0; aix < BENCH_STRESS_ALLOCS; ++aix) {
+                allocs[aix] = mem_new_alloc(pool, (aix + 1) * BENCH_STRESS_MIN);
+            }
+            for (unsigned aix = 1; aix < BENCH_STRESS_ALLOCS; aix += 2) {
+                mem_del_alloc(pool, allocs[aix]);
+                allocs[aix] = NULL;
+            }
+
+            for (unsigned r = 0; r < BENCH_BATCH_ROUNDS; ++r) {
+                for (unsigned i = 0; i < BENCH_BATCH_SIZE; ++i) {
+                    sizes[i] = BENCH_ALLOC_UNIT * (1 + bench_rand(&seed) % 16);
+                }
+
+                double start = bench_now();
+                if (batched) {
+                    mem_new_alloc_batch(pool, sizes, BENCH_BATCH_SIZE, objs);
+                } else {
+                    for (unsigned i = 0; i < BENCH_BATCH_SIZE; ++i) {
+                        objs[i] = mem_new_alloc(pool, sizes[i]);
+                    }
+                }
+                alloc_time += bench_now() - start;
+
+                start = bench_now();
+                if (batched) {
+                    mem_del_alloc_batch(pool, objs, BENCH_BATCH_SIZE);
+                } else {
+                    for (unsigned i = 0; i < BENCH_BATCH_SIZE; ++i) {
+                        mem_del_alloc(pool, objs[i]);
+                    }
+                }
+                free_time += bench_now() - start;
+            }
+
+            printf("%-24s %16s %8s %10.1f %10.1f\n", "", bench_policy_name(policies[p]),
+                   batched ? "batch" : "single",
+                   alloc_time * 1e9 / BENCH_BATCH_ROUNDS / BENCH_BATCH_SIZE,
+                   free_time * 1e9 / BENCH_BATCH_ROUNDS / BENCH_BATCH_SIZE);
+
+            for (unsigned aix = 0; aix < BENCH_STRESS_ALLOCS; ++aix) {
+                if (allocs[aix]) mem_del_alloc(pool, allocs[aix]);
+            }
+            mem_pool_close(pool);
+            mem_free();
+            free(allocs);
+        }
+    }
+}
+
+
+/*******************************************/
+/***      6. SMALL OBJECTS               ***/
+/*******************************************/
+
+/*
+ * Parse-then-discard: allocate 10000 objects of 8 to 64 bytes, then
+ * throw them all away, 20 times over. FIRST_FIT frees each object (in
+ * allocation order, so every free merges into the gap before it);
+ * LINEAR releases to a mark taken at the start.
+ */
+static void bench_small_objects() {
+    const alloc_policy policies[] = { FIRST_FIT, TLSF, LINEAR };
+    const size_t pool_size = (size_t) BENCH_SMALL_OBJECTS * 64;
+
+    printf("%-24s %16s %10s %10s\n", "small_objects (ns/obj)", "policy", "alloc", "free");
+
+    for (unsigned p = 0; p < sizeof(policies) / sizeof(policies[0]); ++p) {
+        void **objs = malloc(BENCH_SMALL_OBJECTS * sizeof(void *));
+        double alloc_time = 0, free_time = 0;
+        unsigned seed = 88172645u;
+
+        mem_init();
+        pool_pt pool = mem_pool_open(pool_size, policies[p]);
+        for (unsigned r = 0; r < BENCH_SMALL_ROUNDS; ++r) {
+            pool_mark_t mark = mem_pool_mark(pool);
+
+            double start = bench_now();
+            if (policies[p] == LINEAR) {
+                for (unsigned i = 0; i < BENCH_SMALL_OBJECTS; ++i) {
+                    objs[i] = mem_linear_alloc(pool, 8 * (1 + bench_rand(&seed) % 8));
+                }
+            } else {
+                for (unsigned i = 0; i < BENCH_SMALL_OBJECTS; ++i) {
+                    objs[i] = mem_new_alloc(pool, 8 * (1 + bench_rand(&seed) % 8));
+                }
+            }
+            alloc_time += bench_now() - start;
+
+            start = bench_now();
+            if (policies[p] == LINEAR) {
+                mem_pool_release_to(pool, mark);
+            } else {
+                for (unsigned i = 0; i < BENCH_SMALL_OBJECTS; ++i) {
+                    mem_del_alloc(pool, objs[i]);
+                }
+            }
+            free_time += bench_now() - start;
+        }
+
+        printf("%-24s %16s %10.1f %10.1f\n", "", bench_policy_name(policies[p]),
+               alloc_time * 1e9 / BENCH_SMALL_ROUNDS / BENCH_SMALL_OBJECTS,
+               free_time * 1e9 / BENCH_SMALL_ROUNDS / BENCH_SMALL_OBJECTS);
+
+        mem_pool_close(pool);
+        mem_free();
+        free(objs);
+    }
+}
+
+
+/*******************************************/
+/***      7. THREADS                     ***/
+/*******************************************/
+
+/*
+ * Throughput of one shared TLSF pool at 1 to 16 threads: each thread
+ * allocates 16 to 256 bytes and frees its oldest allocation from a
+ * window of 64, 200000 times. A single stripe is a pool behind one lock;
+ * with 16, each thread starts in a stripe of its own. A sharded pool has
+ * a stripe per CPU and starts at the CPU's. With a cache, most of it
+ * stays in the thread.
+ *
+ * So far this has only run on a single CPU, where the threads take turns
+ * and the numbers show the cost of the locking alone: how the stripes
+ * scale across cores has not been measured.
+ */
+typedef struct _bench_thread_config {
+    unsigned stripes; // 0 for sharded
+    int cached;
+    const char *name;
+} bench_thread_config_t;
+
+static pool_pt bench_thread_pool;
+static int bench_thread_cached;
+static int bench_thread_fixed;
+
+static void *bench_thread_worker(void *arg) {
+    (void) arg; /* unused */
+    pool_pt pool = bench_thread_pool;
+    void *window[BENCH_THREAD_WINDOW];
+    unsigned seed = 2463534242u;
+
+    memset(window, 0, sizeof(window));
+    for (unsigned i = 0; i < BENCH_THREAD_OPS; ++i) {
+        void **slot = &window[i % BENCH_THREAD_WINDOW];
+        size_t size = 16 * (1 + bench_rand(&seed) % 16);
+        if (bench_thread_cached) {
+            if (*slot) {
+                mem_cache_free(pool, *slot);
+            }
+            *slot = mem_cache_alloc(pool, size);
+        } else {
+            if (*slot) {
+                mem_del_alloc(pool, *slot);
+            }
+            *slot = mem_new_alloc(pool, size);
+        }
+    }
+    for (unsigned i = 0; i < BENCH_THREAD_WINDOW; ++i) {
+        if (window[i] && bench_thread_cached) {
+            mem_cache_free(pool, window[i]);
+        } else if (window[i]) {
+            mem_del_alloc(pool, window[i]);
+        }
+    }
+
+    return NULL;
+}
+
+static void bench_threads() {
+    const bench_thread_config_t configs[] = {
+            { 1,  0, "1 stripe" },
+            { 16, 0, "16 stripes" },
+            { 0,  0, "sharded" },
+            { 16, 1, "16 + cache" }
+    };
+    pthread_t threads[BENCH_MAX_THREADS];
+
+    printf("%-24s %16s %8s %10s\n", "threads (Mops/s)", "pool", "threads", "ops");
+
+    mem_init();
+    for (unsigned c = 0; c < sizeof(configs) / sizeof(configs[0]); ++c) {
+        for (unsigned n = 1; n <= BENCH_MAX_THREADS; n *= 2) {
+            pool_options_t options = { .stripes = configs[c].stripes };
+            pool_pt pool = configs[c].stripes ? mem_pool_open_ex((size_t) 64 << 20, TLSF, &options)
+                                              : mem_pool_open_sharded((size_t) 64 << 20, TLSF);
+            bench_thread_pool = pool;
+            bench_thread_cached = configs[c].cached;
+
+            double start = bench_now();
+            for (unsigned t = 0; t < n; ++t) {
+                pthread_create(&threads[t], NULL, bench_thread_worker, NULL);
+            }
+            for (unsigned t = 0; t < n; ++t) {
+                pthread_join(threads[t], NULL);
+            }
+            double elapsed = bench_now() - start;
+
+            printf("%-24s %16s %8u %10.2f\n", "", configs[c].name, n,
+                   2.0 * n * BENCH_THREAD_OPS / elapsed * 1e-6);
+            mem_pool_close(pool);
+        }
+    }
+    mem_free();
+}
+
+
+/*******************************************/
+/***      8. LOCK-FREE FIXED             ***/
+/*******************************************/
+
+/*
+ * Contention on 64-byte objects at 1 to 16 threads, with the workload of
+ * THREADS: a lock-free FIXED_SIZE pool against mem_new_alloc on a TLSF
+ * pool behind a single lock.
+ */
+static void *bench_fixed_worker(void *arg) {
+    (void) arg; /* unused */
+    pool_pt pool = bench_thread_pool;
+    void *window[BENCH_THREAD_WINDOW];
+
+    memset(window, 0, sizeof(window));
+    for (unsigned i = 0; i < BENCH_THREAD_OPS; ++i) {
+        void **slot = &window[i % BENCH_THREAD_WINDOW];
+        if (*slot && bench_thread_fixed) {
+            mem_fixed_free(pool, *slot);
+        } else if (*slot) {
+            mem_del_alloc(pool, *slot);
+        }
+        *slot = bench_thread_fixed ? mem_fixed_alloc(pool) : mem_new_alloc(pool, 64);
+    }
+    for (unsigned i = 0; i < BENCH_THREAD_WINDOW; ++i) {
+        if (window[i] && bench_thread_fixed) {
+            mem_fixed_free(pool, window[i]);
+        } else if (window[i]) {
+            mem_del_alloc(pool, window[i]);
+        }
+    }
+
+    return NULL;
+}
+
+static void bench_lock_free_fixed() {
+    const char *names[] = { "TLSF + lock", "lock-free fixed" };
+    pthread_t threads[BENCH_MAX_THREADS];
+
+    printf("%-24s %16s %8s %10s\n", "lock_free (Mops/s)", "pool", "threads", "ops");
+
+    mem_init();
+    for (unsigned c = 0; c < 2; ++c) {
+        for (unsigned n = 1; n <= BENCH_MAX_THREADS; n *= 2) {
+            pool_options_t options = { .stripes = c ? 0 : 1, .lock_free = c };
+            bench_thread_pool = c ? mem_pool_open_fixed_ex(64, BENCH_MAX_THREADS * BENCH_THREAD_WINDOW, &options)
+                                  : mem_pool_open_ex((size_t) 64 << 20, TLSF, &options);
+            bench_thread_fixed = (int) c;
+
+            double start = bench_now();
+            for (unsigned t = 0; t < n; ++t) {
+                pthread_create(&threads[t], NULL, bench_fixed_worker, NULL);
+            }
+            for (unsigned t = 0; t < n; ++t) {
+                pthread_join(threads[t], NULL);
+            }
+            double elapsed = bench_now() - start;
+
+            printf("%-24s %16s %8u %10.2f\n", "", names[c], n,
+                   2.0 * n * BENCH_THREAD_OPS / elapsed * 1e-6);
+            mem_pool_close(bench_thread_pool);
+        }
+    }
+    mem_free();
+}
+
+
+/*******************************************/
+/***      9. REMOTE FREES                ***/
+/*******************************************/
+
+/*
+ * Producer-consumer traffic on a TLSF pool of 16 stripes at 1 to 16
+ * threads: each round, every thread allocates 4096 blocks of 64 bytes,
+ * then frees those of the next thread over, 20 rounds. Freed locally,
+ * each thread frees its own. Remote frees queue up at the owning stripe
+ * and are drained at the owner's next allocation; the queue depth and
+ * drain time come from mem_pool_stats.
+ */
+static void ***bench_remote_slabs; // a slab of BENCH_REMOTE_ALLOCS per thread
+static unsigned bench_remote_threads;
+static int bench_remote_peer;
+static pthread_mutex_t bench_remote_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_remote_cond = PTHREAD_COND_INITIALIZER;
+static unsigned bench_remote_waiting;
+static unsigned bench_remote_phase;
+
+static void bench_remote_wait() {
+    pthread_mutex_lock(&bench_remote_lock);
+    unsigned phase = bench_remote_phase;
+    if (++bench_remote_waiting == bench_remote_threads) {
+        bench_remote_waiting = 0;
+        bench_remote_phase++;
+        pthread_cond_broadcast(&bench_remote_cond);
+    } else {
+        while (phase == bench_remote_phase) {
+            pthread_cond_wait(&bench_remote_cond, &bench_remote_lock);
+        }
+    }
+    pthread_mutex_unlock(&bench_remote_lock);
+}
+
+static void *bench_remote_worker(void *arg) {
+    unsigned t = (unsigned) (size_t) arg;
+    unsigned peer = bench_remote_peer ? (t + 1) % bench_remote_threads : t;
+    pool_pt pool = bench_thread_pool;
+
+    for (unsigned r = 0; r < BENCH_REMOTE_ROUNDS; ++r) {
+        for (unsigned i = 0; i < BENCH_REMOTE_ALLOCS; ++i) {
+            bench_remote_slabs[t][i] = mem_new_alloc(pool, 64);
+        }
+        bench_remote_wait();
+        for (unsigned i = 0; i < BENCH_REMOTE_ALLOCS; ++i) {
+            if (bench_remote_slabs[peer][i]) {
+                mem_del_alloc(pool, bench_remote_slabs[peer][i]);
+            }
+        }
+        bench_remote_wait();
+    }
+
+    return NULL;
+}
+
+static void bench_remote_frees() {
+    const char *names[] = { "local", "remote" };
+    pthread_t threads[BENCH_MAX_THREADS];
+
+    printf("%-24s %16s %8s %10s %10s %10s %12s\n", "remote (Mops/s)", "frees", "threads", "ops",
+           "drains", "max drain", "ns/drained");
+
+    bench_remote_slabs = calloc(BENCH_MAX_THREADS, sizeof(void **));
+    for (unsigned t = 0; t < BENCH_MAX_THREADS; ++t) {
+        bench_remote_slabs[t] = calloc(BENCH_REMOTE_ALLOCS, sizeof(void *));
+    }
+    mem_init();
+    for (unsigned c = 0; c < 2; ++c) {
+        for (unsigned n = 1; n <= BENCH_MAX_THREADS; n *= 2) {
+            pool_options_t options = { .stripes = 16 };
+            bench_thread_pool = mem_pool_open_ex((size_t) 64 << 20, TLSF, &options);
+            bench_remote_threads = n;
+            bench_remote_peer = (int) c;
+
+            double start = bench_now();
+            for (unsigned t = 0; t < n; ++t) {
+                pthread_create(&threads[t], NULL, bench_remote_worker, (void *) (size_t) t);
+            }
+            for (unsigned t = 0; t < n; ++t) {
+                pthread_join(threads[t], NULL);
+            }
+            double elapsed = bench_now() - start;
+
+            mem_pool_drain(bench_thread_pool);
+            pool_stats_t stats;
+            mem_pool_stats(bench_thread_pool, &stats);
+            printf("%-24s %16s %8u %10.2f %10lu %10u %12.1f\n", "", names[c], n,
+                   2.0 * n * BENCH_REMOTE_ROUNDS * BENCH_REMOTE_ALLOCS / elapsed * 1e-6,
+                   stats.remote_drains, stats.remote_max_drain,
+                   stats.remote_frees ? (double) stats.remote_drain_ns / stats.remote_frees : 0.0);
+            mem_pool_close(bench_thread_pool);
+        }
+    }
+    mem_free();
+    for (unsigned t = 0; t < BENCH_MAX_THREADS; ++t) {
+        free(bench_remote_slabs[t]);
+    }
+    free(bench_remote_slabs);
+}
+
+
+/*******************************************/
+/***     10. BACKING                     ***/
+/*******************************************/
+
+/*
+ * Random access into a 512M pool for each backing: first touch of every
+ * page, then 20000000 dependent reads at random 8-byte offsets, so that
+ * nearly every one misses the TLB on 4K pages. Huge page backings fall
+ * back where the system has none; the backing column is what the pool
+ * got.
+ */
+static volatile size_t bench_backing_sink; // keeps the chase from being optimized out
+
+static void bench_backing() {
+    const char *names[] = { "malloc", "mmap 4K", "THP", "hugetlb" };
+
+    printf("%-24s %16s %10s %12s %12s\n", "backing (ns)", "asked", "got", "touch/page", "read");
+
+    mem_init();
+    for (pool_backing backing = BACKING_MALLOC; backing <= BACKING_HUGETLB; ++backing) {
+        pool_options_t options = { .backing = backing };
+        pool_pt pool = mem_pool_open_ex(BENCH_BACKING_SIZE, FIRST_FIT, &options);
+        if (pool == NULL) {
+            printf("%-24s %16s %10s\n", "", names[backing], "-");
+            continue;
+        }
+        pool_stats_t stats;
+        mem_pool_stats(pool, &stats);
+        size_t words = pool->total_size / sizeof(size_t);
+        size_t *mem = (size_t *) pool->mem;
+
+        // each word names another, so that the reads cannot overlap
+        double start = bench_now();
+        for (size_t i = 0; i < words; i += 4096 / sizeof(size_t)) {
+            mem[i] = 0;
+        }
+        double touch = bench_now() - start;
+        unsigned seed = 2463534242u;
+        for (size_t i = 0; i < words; ++i) {
+            mem[i] = (((size_t) bench_rand(&seed) << 16) ^ bench_rand(&seed)) % words;
+        }
+
+        size_t next = 0;
+        start = bench_now();
+        for (unsigned i = 0; i < BENCH_BACKING_READS; ++i) {
+            next = mem[next];
+        }
+        double read = bench_now() - start;
+        bench_backing_sink = next;
+
+        printf("%-24s %16s %10s %12.1f %12.1f\n", "", names[backing], names[stats.backing],
+               touch / (pool->total_size / 4096) * 1e9, read / BENCH_BACKING_READS * 1e9);
+        mem_pool_close(pool);
+    }
+    mem_free();
+}
+
+
+/*******************************************/
+/***         DRIVER ROUTINE              ***/
+/*******************************************/
+
+int main(int argc, char *argv[]) {
+    const char *name = (argc > 1) ? argv[1] : NULL;
+    unsigned max_gaps = (argc > 2) ? (unsigned) strtoul(argv[2], NULL, 10) : BENCH_MAX_GAPS;
+
+    if (!name || !strcmp(name, "best_fit_gaps")) {
+        bench_best_fit_gaps(max_gaps);
+    }
+    if (!name || !strcmp(name, "policies")) {
+        bench_policies();
+    }
+    if (!name || !strcmp(name, "latency")) {
+        bench_latency();
+    }
+    if (!name || !strcmp(name, "bitmap_scan")) {
+        bench_bitmap_scan();
+    }
+    if (!name || !strcmp(name, "batches")) {
+        bench_batches();
+    }
+    if (!name || !strcmp(name, "small_objects")) {
+        bench_small_objects();
+    }
+    if (!name || !strcmp(name, "threads")) {
+        bench_threads();
+    }
+    if (!name || !strcmp(name, "lock_free")) {
+        bench_lock_free_fixed();
+    }
+    if (!name || !strcmp(name, "remote")) {
+        bench_remote_frees();
+    }
+    if (!name || !strcmp(name, "backing")) {
+        bench_backing();
+    }
+
+    return 0;
+}
@@ -2,12 +2,71 @@
  * Created by Ivo Georgiev on 2/9/16.
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE // for sched_getcpu()
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#endif
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <stdio.h> // for perror()
+#include <string.h> // for memcpy()
+#include <time.h> // for timespec_get()
+#include <stdatomic.h>
+#include <pthread.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "mem_pool.h"
 
+/**********/
+/*        */
+/* Macros */
+/*        */
+/**********/
+#define MEM_MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+#define MEM_SIZE_CLASSES 64 // one per bit of a size, class k holds [2^k, 2^(k+1))
+
+#define MEM_TLSF_SL_LOG2 4 // TLSF: each power of two is split into 16 lists
+#define MEM_TLSF_SL_COUNT (1 << MEM_TLSF_SL_LOG2)
+#define MEM_TLSF_FL_COUNT 64
+
+#define MEM_POOL_STORE_SEGMENTS 32 // the pool store grows by whole segments, never moving one
+
+
+
+/********************/
+/*                  */
+/* Bit manipulation */
+/*                  */
+/********************/
+#if defined(__GNUC__) || defined(__clang__)
+static inline unsigned _mem_clz64(uint64_t x) { return (unsigned) __builtin_clzll(x); }
+static inline unsigned _mem_ctz64(uint64_t x) { return (unsigned) __builtin_ctzll(x); }
+#else
+static inline unsigned _mem_clz64(uint64_t x) {
+    unsigned n = 0;
+    for (uint64_t bit = (uint64_t) 1 << 63; !(x & bit); bit >>= 1) ++n;
+    return n;
+}
+static inline unsigned _mem_ctz64(uint64_t x) {
+    unsigned n = 0;
+    for (; !(x & 1); x >>= 1) ++n;
+    return n;
+}
+#endif
+
+
+
 /*************/
 /*           */
 /* Constants */
@@ -16,17 +75,57 @@
 static const float MEM_FILL_FACTOR = 0.75;
 static const unsigned MEM_EXPAND_FACTOR = 2;
 
-static const unsigned MEM_POOL_STORE_INIT_CAPACITY = 20;
-static const float MEM_POOL_STORE_FILL_FACTOR = 0.75;
-static const unsigned MEM_POOL_STORE_EXPAND_FACTOR = 2;
+static const unsigned MEM_POOL_STORE_INIT_CAPACITY = 20; // slots in the first segment
+static const unsigned MEM_POOL_STORE_EXPAND_FACTOR = 2; // each segment is this much larger than the last
+
+static const unsigned MEM_NODE_CHUNK_CAPACITY = 256; // nodes per chunk, chunks never move
+static const unsigned MEM_NODE_DIR_INIT_CAPACITY = 8;
+static const unsigned MEM_NODE_DIR_EXPAND_FACTOR = 2;
+#define MEM_NODE_DIR_OUTGROWN 16 // directories a heap outgrows, up to the most nodes handles allow
+
+static const unsigned MEM_NODE_NONE = (unsigned) -1; // end of the unused node list
+
+static const unsigned MEM_NODE_FREEING = 2; // node_t::allocated while a batch free is under way
+static const unsigned MEM_NODE_CACHED = 3; // freed into a thread cache, until it hands the block out again
+static const unsigned MEM_NODE_QUEUED = 4; // freed from another thread, on its stripe's queue until drained
+
+static const unsigned MEM_HANDLE_INDEX_BITS = 26; // a handle is its node's index plus one, with the stripe above
+static const unsigned MEM_HANDLE_STRIPE_BITS = 6; // enough for MEM_MAX_STRIPES, all 32 bits of the generation above that
+
+static const size_t MEM_PAGE_SIZE = 4096; // pool memory alignment, and the largest allocation alignment
+static const size_t MEM_HUGE_PAGE_SIZE = (size_t) 2 << 20; // huge page pools: their memory and large allocations
 
-static const unsigned MEM_NODE_HEAP_INIT_CAPACITY = 40;
-static const float MEM_NODE_HEAP_FILL_FACTOR = 0.75;
-static const unsigned MEM_NODE_HEAP_EXPAND_FACTOR = 2;
+static const unsigned MEM_MAX_STRIPES = 64; // locks in a thread-safe pool, each stripe at least a page
+static const unsigned MEM_DEFAULT_SHARDS = 8; // stripes of a sharded pool where the CPUs cannot be counted
+static const unsigned MEM_REMOTE_MAX_DEPTH = 1024; // a remote free drains the queue itself past this
 
-static const unsigned MEM_GAP_IX_INIT_CAPACITY = 40;
-static const float MEM_GAP_IX_FILL_FACTOR = 0.75;
-static const unsigned MEM_GAP_IX_EXPAND_FACTOR = 2;
+#define MEM_REMOTE_BATCH 64 // remote frees handed to mem_del_alloc_batch at once
+
+#define MEM_LINEAR_RELEASES 16 // LINEAR: releases kept to check marks against, older marks are refused
+
+#define MEM_CACHE_POOLS 8 // pools a thread caches for at once, others go straight to the pool
+#define MEM_CACHE_BUCKETS 16 // one per 16 bytes of size, up to 256
+#define MEM_CACHE_BUCKET_CAP 64 // blocks per bucket
+static const unsigned MEM_CACHE_CLASS_SHIFT = 4;
+static const unsigned MEM_CACHE_BATCH = 16; // blocks per refill and per flush
+static const size_t MEM_CACHE_MAX_BYTES = 64 * 1024; // per thread and pool, across buckets
+
+static const unsigned MEM_BUDDY_MIN_ORDER = 4; // smallest block is 16 bytes, room for the links
+static const unsigned char MEM_BUDDY_FREE = 0x40; // block map: free block head, order in the low bits
+static const unsigned char MEM_BUDDY_ALLOC = 0x80; // block map: allocated block head
+static const unsigned char MEM_BUDDY_ORDER_MASK = 0x3f;
+
+static const char MEM_FILE_MAGIC[8] = "MEMPOOL"; // file-backed pools: each header slot starts with it
+static const uint32_t MEM_FILE_VERSION = 2;
+static const size_t MEM_FILE_SLOT_SIZE = 2048; // the header page holds two snapshots' headers, written in turn
+static const unsigned MEM_FILE_LOG_RECORDS = 1024; // journal records between snapshots
+static const uint64_t MEM_FILE_ALLOC = 1; // journal record: an allocation at offset of size
+static const uint64_t MEM_FILE_FREE = 2; // of the allocation at offset
+static const uint64_t MEM_FILE_RESIZE = 3; // the allocation at offset resized in place to size
+
+static const unsigned MEM_GRANULE_SHIFT = 4; // BITMAP_FIT: 16-byte granules, one bit each
+static const size_t MEM_BITMAP_BLOCK_WORDS = 4; // the bitmap is padded to whole 256-bit blocks
+static const size_t MEM_BITMAP_NONE = (size_t) -1; // no run of free granules long enough
 
 
 
@@ -43,24 +142,165 @@ typedef struct _alloc {
 typedef struct _node {
     alloc_t alloc_record;
     unsigned used;
-    unsigned allocated;
+    atomic_uint allocated; // changed from 1 only by _mem_node_claim, which another thread may do
     struct _node *next, *prev; // doubly-linked list for gap deletion
+    union { // gap index links, gaps only
+        struct { // AVL tree (FIRST_FIT, NEXT_FIT, BEST_FIT)
+            struct _node *gap_left, *gap_right;
+            int gap_height;
+        };
+        struct { // size class list (SEGREGATED_FIT, TLSF)
+            struct _node *class_next, *class_prev;
+        };
+    };
+    struct _node *remote_next; // remote free queue (thread-safe pools), apart from the gap links
+    unsigned index; // position in the node heap, fixed for the node's life
+    unsigned next_unused; // unused node list, by node heap index
+    atomic_uint generation; // one more each time the node becomes an allocation, and in its handles
 } node_t, *node_pt;
 
-typedef struct _gap {
-    size_t size;
-    node_pt node;
-} gap_t, *gap_pt;
+// handles keep the whole generation, in their upper half
+_Static_assert(sizeof(uintptr_t) == 8, "allocation handles need 64-bit pointers");
+
+// links kept in the first bytes of a free buddy block
+typedef struct _buddy_link {
+    struct _buddy_link *next, *prev;
+} buddy_link_t, *buddy_link_pt;
+
+// LINEAR: a release to offset, the epoch it started
+typedef struct _linear_release {
+    unsigned long epoch;
+    size_t offset;
+} linear_release_t;
+
+// TLSF gap index: first level is the power of two of the size, second
+// level splits that range linearly; a bitmap per level finds the first
+// non-empty list with find-first-set
+typedef struct _tlsf_index {
+    uint64_t fl_map; // bit f set if any list of first level f has gaps
+    uint32_t sl_map[MEM_TLSF_FL_COUNT]; // bit s set if list [f][s] has gaps
+    node_pt lists[MEM_TLSF_FL_COUNT][MEM_TLSF_SL_COUNT];
+} tlsf_index_t, *tlsf_index_pt;
 
 typedef struct _pool_mgr {
     pool_t pool;
-    node_pt node_heap;
-    unsigned total_nodes;
+    atomic_ulong epoch; // unique to this pool until it is reset or closed, see pool_cache_t
+    node_pt node_heap; // first node of the first chunk, head of the segment list
+    _Atomic(node_pt *) node_chunks; // chunk directory, node i is node_chunks[i / cap][i % cap]
+    node_pt *outgrown_dirs[MEM_NODE_DIR_OUTGROWN]; // kept for other threads' frees, which read without the lock
+    unsigned num_outgrown_dirs;
+    unsigned num_chunks;
+    unsigned node_dir_capacity;
+    atomic_uint total_nodes; // grows once the nodes are ready, for the same frees
     unsigned used_nodes;
-    gap_pt gap_ix;
-    unsigned gap_ix_capacity;
+    unsigned unused_head; // first node of the unused node list
+    unsigned handle_salt; // added to the generation in handles, so that another pool's do not match
+    unsigned long unused_hits; // nodes taken from the unused node list
+    unsigned long heap_grows; // node heap expansions
+    node_pt gap_ix; // root of the gap index, ordered by size then node index
+    node_pt size_classes[MEM_SIZE_CLASSES]; // SEGREGATED_FIT gap index instead
+    uint64_t size_class_mask; // bit k set if size class k has gaps
+    unsigned long class_hits; // served from the request's own size class
+    unsigned long class_splits; // served by splitting a gap of a larger class
+    unsigned long class_misses; // no gap large enough
+    buddy_link_pt buddy_free[MEM_SIZE_CLASSES]; // BUDDY: free blocks by order
+    uint64_t buddy_free_mask; // bit k set if there is a free block of order k
+    unsigned char *buddy_map; // BUDDY: state of the block starting at each 16-byte unit
+    unsigned buddy_max_order; // the whole pool
+    tlsf_index_pt tlsf; // TLSF gap index instead
+    node_pt next_fit_cursor; // where the next NEXT_FIT search starts
+    size_t fixed_slot; // FIXED_SIZE: object size, at least room for a free list link
+    unsigned fixed_count; // number of slots
+    unsigned fixed_free_head; // free slot list, linked by slot index through the free slots
+    unsigned fixed_fresh; // slots from here up have never been handed out
+    _Atomic uint64_t *fixed_map; // bit i set if slot i is allocated
+    int fixed_lock_free; // the fields below instead of the free list and the pool_t counters
+    _Atomic uint64_t fixed_lf_head; // free slot stack: a tag in the high 32 bits against ABA, slot below
+    _Atomic unsigned *fixed_lf_next; // the stack links, outside the slots, which their owners may write
+    atomic_uint fixed_lf_fresh; // as fixed_fresh
+    atomic_uint fixed_lf_live; // allocated slots, copied into pool_t by _mem_fixed_sync
+    uint64_t *bitmap_used; // BITMAP_FIT: bit i set if granule i is allocated, padding set too
+    uint64_t *bitmap_start; // BITMAP_FIT: bit i set if an allocation starts at granule i
+    size_t bitmap_words; // words per map, a whole number of blocks
+    size_t bitmap_granules;
+    size_t alignment; // of every allocation, 1 for none
+    size_t linear_offset; // LINEAR: the bump pointer, everything below it is taken
+    unsigned long linear_epoch; // releases so far, marks carry it
+    unsigned long linear_floor; // marks from before this epoch are refused, their releases forgotten
+    linear_release_t linear_releases[MEM_LINEAR_RELEASES]; // offsets rising, each the lowest since its epoch
+    unsigned linear_num_releases;
+    struct _pool_mgr **stripes; // thread-safe: a pool of its own per address range, each behind a lock
+    pthread_mutex_t *stripe_locks; // taken in index order when more than one is needed
+    pthread_mutex_t stats_lock; // the pool_t counters, which sum those of the stripes
+    unsigned num_stripes; // 0 for a single-threaded pool
+    unsigned stripe_index; // a stripe: its place in the pool, and in its handles; else 0
+    int stripe_per_cpu; // sharded: threads start at the stripe of the CPU they run on
+    _Atomic(node_pt) remote_head; // a stripe: frees from other threads, claimed and pushed lock-free, taken whole
+    atomic_uint remote_depth;
+    atomic_ulong remote_frees;
+    unsigned long remote_drains; // these under the stripe's lock
+    unsigned long remote_drain_ns;
+    unsigned remote_max_drain;
+    size_t stripe_size; // the last stripe also takes the remainder
+    pool_backing backing; // what pool.mem came from, after any fallback
+    char *map_base; // mmap backings: the whole mapping, which pool.mem is aligned within
+    size_t map_size;
+    int file_fd; // BACKING_FILE: the pool file, else -1
+    int file_journal; // changes go to the journal; not while attaching
+    uint64_t file_generation; // of the last snapshot on disk
+    uint64_t file_table_offset; // and its segment table, which the next one must not overwrite
+    uint64_t file_table_size;
+    unsigned file_log_next; // journal records since the snapshot
 } pool_mgr_t, *pool_mgr_pt;
 
+// a file-backed pool: the header page, then the pool memory, the journal
+// and the segment tables; tables and records go by offset into the pool
+// memory, so that the file can be mapped anywhere. A snapshot is a table
+// and a header, committed by writing the header into the slot the last
+// one is not in; the journal has the changes since, for a killed process
+typedef struct _pool_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t policy;
+    uint64_t generation; // one more than the snapshot before; the slot is this mod 2
+    uint64_t total_size;
+    uint64_t alloc_size;
+    uint64_t num_allocs;
+    uint64_t num_gaps;
+    uint64_t data_offset; // of the pool memory, a page
+    uint64_t log_offset; // of the journal, the page after the pool memory
+    uint64_t log_records;
+    uint64_t table_offset; // of the segment table, past the journal
+    uint64_t num_segments;
+    uint64_t checksum; // of the header, with this 0, and of the table
+} pool_file_header_t, *pool_file_header_pt;
+
+typedef struct _pool_file_record {
+    uint64_t generation; // of the snapshot it follows, else it is stale
+    uint64_t seq; // its place in the journal
+    uint64_t remaining; // records left in the operation, this one included: a batch is all or nothing
+    uint64_t op; // MEM_FILE_ALLOC, MEM_FILE_FREE or MEM_FILE_RESIZE
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum; // of the record, with this 0
+} pool_file_record_t, *pool_file_record_pt;
+
+typedef struct _pool_file_segment {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t allocated;
+} pool_file_segment_t, *pool_file_segment_pt;
+
+// a thread's cache of freed blocks for one pool, by size class: bucket k
+// holds allocations of exactly (k + 1) * 16 bytes, most recent last
+typedef struct _pool_cache {
+    pool_mgr_pt pool;
+    unsigned long epoch; // the pool's when the cache was filled, else the blocks are stale
+    size_t bytes; // held across the buckets
+    unsigned count[MEM_CACHE_BUCKETS];
+    void *blocks[MEM_CACHE_BUCKETS][MEM_CACHE_BUCKET_CAP];
+} pool_cache_t, *pool_cache_pt;
+
 
 
 /***************************/
@@ -68,9 +308,21 @@ typedef struct _pool_mgr {
 /* Static global variables */
 /*                         */
 /***************************/
-static pool_mgr_pt *pool_store = NULL; // an array of pointers, only expand
-static unsigned pool_store_size = 0;
-static unsigned pool_store_capacity = 0;
+// the pool store: segments of slots, published once and never moved or
+// shrunk while the store is up, so lookups walk them without a lock;
+// slots are claimed and cleared with compare-and-swap
+static _Atomic(pool_mgr_pt) *_Atomic pool_store[MEM_POOL_STORE_SEGMENTS];
+static atomic_int pool_store_ready = 0; // between mem_init and mem_free
+static atomic_uint stripe_threads = 0; // threads that have used a thread-safe pool
+static _Thread_local unsigned stripe_home = 0; // this thread's first stripe to try, plus one
+static atomic_ulong pool_epochs = 0; // the last pool_mgr_t::epoch handed out
+static atomic_uint handle_salts = 0; // pools given a pool_mgr_t::handle_salt
+static _Thread_local pool_cache_pt thread_caches[MEM_CACHE_POOLS]; // this thread's, by pool
+static unsigned long file_crash_step = 0; // mem_pool_crash_at: the pool file write to be killed in, 0 for none
+static unsigned long file_steps = 0; // pool file writes since
+static pthread_key_t thread_cache_key; // to flush a thread's caches when it exits
+static pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
+static bitmap_scan bitmap_scan_mode = BITMAP_SCAN_SIMD; // how BITMAP_FIT looks for free granules
 
 
 
@@ -79,11 +331,123 @@ static unsigned pool_store_capacity = 0;
 /* Forward declarations of static functions */
 /*                                          */
 /********************************************/
-static alloc_status _mem_resize_pool_store();
+static alloc_status _mem_pool_store_add(pool_mgr_pt pool_mgr);
+
+static _Atomic(pool_mgr_pt) *_mem_pool_store_find(pool_mgr_pt pool_mgr);
+
+static void _mem_free_pool_mgr(pool_mgr_pt pool_mgr);
+
+static alloc_status _mem_pool_init(pool_mgr_pt pool_mgr, size_t size, alloc_policy policy, size_t alignment);
+
+static alloc_status
+_mem_stripes_init(pool_mgr_pt pool_mgr, size_t size, alloc_policy policy, size_t alignment, unsigned stripes);
+
+static void _mem_stripes_free(pool_mgr_pt pool_mgr);
+
+static pool_mgr_pt _mem_stripe_of(pool_mgr_pt pool_mgr, void *alloc, unsigned *stripe);
+
+static void _mem_stripe_sync(pool_mgr_pt pool_mgr, const pool_t *before, const pool_t *after);
+
+static void _mem_stripes_lock(pool_mgr_pt pool_mgr);
+
+static void _mem_stripes_unlock(pool_mgr_pt pool_mgr);
+
+static void *_mem_striped_alloc(pool_mgr_pt pool_mgr, size_t size, size_t alignment);
+
+static alloc_status _mem_striped_free(pool_mgr_pt pool_mgr, void *alloc);
+
+static alloc_status _mem_striped_alloc_batch(pool_mgr_pt pool_mgr, const size_t sizes[], unsigned n, void *out[]);
+
+static alloc_status _mem_striped_free_batch(pool_mgr_pt pool_mgr, void *allocs[], unsigned n);
+
+static void *_mem_striped_realloc(pool_mgr_pt pool_mgr, void *alloc, size_t new_size);
+
+static void _mem_striped_reset(pool_mgr_pt pool_mgr);
+
+static void _mem_striped_inspect(pool_mgr_pt pool_mgr, pool_segment_pt *segments, unsigned *num_segments);
+
+static unsigned _mem_stripe_home(pool_mgr_pt pool_mgr);
+
+static void _mem_stripe_drain(pool_mgr_pt pool_mgr, unsigned stripe);
+
+static void *_mem_new_alloc(pool_mgr_pt pool_mgr, size_t size, size_t alignment);
+
+static alloc_status _mem_pool_map(pool_mgr_pt pool_mgr, size_t size, pool_backing backing);
+
+static void _mem_pool_unmap(pool_mgr_pt pool_mgr);
+
+static int _mem_file_policy(alloc_policy policy);
+
+static alloc_status _mem_file_map(pool_mgr_pt pool_mgr, int fd, size_t size, int create);
+
+static alloc_status _mem_file_write(pool_mgr_pt pool_mgr);
+
+static pool_file_segment_pt _mem_file_read(int fd, pool_file_header_pt header);
+
+static pool_file_segment_pt _mem_file_read_slot(int fd, unsigned slot, pool_file_header_pt header);
+
+static alloc_status _mem_file_rebuild(pool_mgr_pt pool_mgr, const pool_file_segment_t *segments, size_t n);
+
+static void _mem_file_log(pool_mgr_pt pool_mgr, uint64_t op, void *const allocs[], unsigned n);
+
+static pool_file_record_pt _mem_file_records(pool_mgr_pt pool_mgr, uint64_t op, void *const allocs[], unsigned n);
+
+static void _mem_file_append(pool_mgr_pt pool_mgr, pool_file_record_pt records, unsigned n);
+
+static void _mem_file_replay(pool_mgr_pt pool_mgr);
+
+static int _mem_file_record_ok(pool_mgr_pt pool_mgr, const pool_file_record_t records[], unsigned i,
+                               uint64_t remaining);
+
+static alloc_status _mem_file_apply(pool_mgr_pt pool_mgr, const pool_file_record_t *record);
+
+static int _mem_file_step(void);
+
+static int _mem_file_pwrite(int fd, const void *buf, size_t size, uint64_t offset);
+
+static uint64_t _mem_file_tables(size_t pages);
+
+static uint64_t _mem_file_hash(uint64_t hash, const void *data, size_t size);
+
+static uint64_t _mem_file_checksum(const pool_file_header_t *header, const pool_file_segment_t *segments);
+
+static pool_cache_pt _mem_thread_cache(pool_mgr_pt pool_mgr, int create);
+
+static void _mem_cache_drain(pool_cache_pt cache, unsigned bucket, unsigned count);
+
+static alloc_status _mem_cache_mark(pool_mgr_pt pool_mgr, void *alloc, size_t *size);
+
+static void _mem_cache_unmark(pool_mgr_pt pool_mgr, void *alloc);
+
+static void _mem_cache_release(unsigned slot);
+
+static void _mem_thread_cache_key();
+
+static void _mem_thread_cache_exit(void *caches);
 
 static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr);
 
-static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr);
+static alloc_status _mem_reserve_nodes(pool_mgr_pt pool_mgr, unsigned count);
+
+static alloc_status _mem_add_node_chunk(pool_mgr_pt pool_mgr);
+
+static node_pt _mem_node_at(pool_mgr_pt pool_mgr, unsigned index);
+
+static node_pt _mem_get_unused_node(pool_mgr_pt pool_mgr);
+
+static void _mem_reset_node_heap(pool_mgr_pt pool_mgr);
+
+static void *_mem_handle(pool_mgr_pt pool_mgr, node_pt node);
+
+static node_pt _mem_handle_node(pool_mgr_pt pool_mgr, const void *alloc);
+
+static node_pt _mem_node_from_handle(pool_mgr_pt pool_mgr, void *alloc);
+
+static node_pt _mem_node_claim(pool_mgr_pt pool_mgr, void *alloc, unsigned to);
+
+static void _mem_free_claimed(pool_mgr_pt pool_mgr, void *allocs[], unsigned n);
+
+static void _mem_release_node(pool_mgr_pt pool_mgr, node_pt node);
 
 static alloc_status
 _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
@@ -95,9 +459,103 @@ _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
                         size_t size,
                         node_pt node);
 
-static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr);
+static node_pt _mem_find_in_gap_ix(pool_mgr_pt pool_mgr, size_t size);
+
+static node_pt _mem_find_next_fit(pool_mgr_pt pool_mgr, size_t size, size_t alignment);
+
+static node_pt _mem_find_gap(pool_mgr_pt pool_mgr, size_t size, size_t alignment);
+
+static size_t _mem_align_pad(const char *mem, size_t alignment);
+
+static void _mem_carve_batch(pool_mgr_pt pool_mgr, node_pt gap, const size_t sizes[], unsigned n, void *out[]);
+
+static void _mem_linear_release(pool_mgr_pt pool_mgr, size_t offset);
+
+static int _mem_node_is_free(node_pt node);
+
+static void _mem_coalesce_run(pool_mgr_pt pool_mgr, node_pt node);
+
+static node_pt _mem_split_padding(pool_mgr_pt pool_mgr, node_pt gap, size_t pad);
+
+static node_pt _mem_carve_gap(pool_mgr_pt pool_mgr, node_pt gap, size_t size);
+
+static alloc_status _mem_resize_in_place(pool_mgr_pt pool_mgr, node_pt node, size_t new_size);
+
+static alloc_status _mem_bitmap_resize(pool_mgr_pt pool_mgr, node_pt node, size_t new_size);
+
+static node_pt _mem_find_in_size_classes(pool_mgr_pt pool_mgr, size_t size);
+
+static unsigned _mem_size_class(size_t size);
+
+static void _mem_gap_list_push(node_pt *head, node_pt node);
+
+static void _mem_gap_list_unlink(node_pt *head, node_pt node);
+
+static node_pt _mem_find_in_tlsf(pool_mgr_pt pool_mgr, size_t size);
+
+static void _mem_tlsf_mapping(size_t size, unsigned *fl, unsigned *sl);
 
-static alloc_status _mem_invalidate_gap_ix(pool_mgr_pt pool_mgr);
+static alloc_status _mem_buddy_init(pool_mgr_pt pool_mgr);
+
+static void *_mem_buddy_alloc(pool_mgr_pt pool_mgr, size_t size);
+
+static void _mem_buddy_free(pool_mgr_pt pool_mgr, node_pt node);
+
+static void _mem_buddy_push(pool_mgr_pt pool_mgr, char *block, unsigned order);
+
+static void _mem_buddy_unlink(pool_mgr_pt pool_mgr, char *block, unsigned order);
+
+static void _mem_buddy_inspect(pool_mgr_pt pool_mgr, pool_segment_pt *segments, unsigned *num_segments);
+
+static int _mem_fixed_is_free(pool_mgr_pt pool_mgr, unsigned slot);
+
+static void _mem_fixed_mark(pool_mgr_pt pool_mgr, unsigned slot, int allocated);
+
+static void *_mem_fixed_alloc_lock_free(pool_mgr_pt pool_mgr);
+
+static alloc_status _mem_fixed_free_lock_free(pool_mgr_pt pool_mgr, unsigned slot);
+
+static void _mem_fixed_sync(pool_mgr_pt pool_mgr);
+
+static alloc_status _mem_bitmap_init(pool_mgr_pt pool_mgr);
+
+static void *_mem_bitmap_alloc(pool_mgr_pt pool_mgr, size_t size);
+
+static void _mem_bitmap_free(pool_mgr_pt pool_mgr, node_pt node);
+
+static int _mem_bitmap_is_free(pool_mgr_pt pool_mgr, size_t granule);
+
+static void _mem_bitmap_set(uint64_t *map, size_t first, size_t count, int value);
+
+static size_t _mem_bitmap_find(const uint64_t *map, size_t words, size_t run);
+
+static size_t _mem_bitmap_find_bit(const uint64_t *map, size_t words, size_t run);
+
+static size_t _mem_bitmap_find_word(const uint64_t *map, size_t words, size_t run);
+
+static size_t _mem_bitmap_find_simd(const uint64_t *map, size_t words, size_t run);
+
+static int _mem_bitmap_scan_word(uint64_t free_bits, size_t base, size_t run, size_t *run_start, size_t *run_len);
+
+static void _mem_bitmap_inspect(pool_mgr_pt pool_mgr, pool_segment_pt *segments, unsigned *num_segments);
+
+static void _mem_fixed_inspect(pool_mgr_pt pool_mgr, pool_segment_pt *segments, unsigned *num_segments);
+
+static int _mem_gap_cmp(node_pt a, node_pt b);
+
+static int _mem_gap_height(node_pt node);
+
+static node_pt _mem_gap_rotate_right(node_pt node);
+
+static node_pt _mem_gap_rotate_left(node_pt node);
+
+static node_pt _mem_gap_rebalance(node_pt node);
+
+static node_pt _mem_gap_insert(node_pt root, node_pt node);
+
+static node_pt _mem_gap_remove_min(node_pt root, node_pt *min);
+
+static node_pt _mem_gap_remove(node_pt root, node_pt node);
 
 
 
@@ -109,59 +567,77 @@ static alloc_status _mem_invalidate_gap_ix(pool_mgr_pt pool_mgr);
 alloc_status mem_init() {
 
     // ensure that it's called only once until mem_free
-    // allocate the pool store with initial capacity
+    // allocate the first segment of the pool store, the rest come on demand
     // note: holds pointers only, other functions to allocate/deallocate
-    if (pool_store == NULL) {
-        pool_store = malloc(MEM_POOL_STORE_INIT_CAPACITY * sizeof(pool_mgr_pt));
-        pool_store_capacity = MEM_POOL_STORE_INIT_CAPACITY;
-        pool_store_size = 0;
-        for (int i = 0; i < MEM_POOL_STORE_INIT_CAPACITY; ++i) {
-            pool_store[i] = NULL;
-        }
-        if (pool_store == NULL) {
-            return ALLOC_FAIL;
-        }
-        return ALLOC_OK;
-    } else {
+    int ready = 0;
+    if (!atomic_compare_exchange_strong(&pool_store_ready, &ready, 1)) {
         return ALLOC_CALLED_AGAIN;
     }
+    _Atomic(pool_mgr_pt) *segment = calloc(MEM_POOL_STORE_INIT_CAPACITY, sizeof(*segment));
+    if (segment == NULL) {
+        atomic_store(&pool_store_ready, 0);
+        return ALLOC_FAIL;
+    }
+    atomic_store(&pool_store[0], segment);
+    return ALLOC_OK;
 
 }
 
 alloc_status mem_free() {
     // ensure that it's called only once for each mem_init
-    // make sure all pool managers have been deallocated
-    // can free the pool store array
-    // update static variables
-    if (pool_store == NULL) {
+    // free the pool store segments
+    // note: pools still open are not closed, and no thread may be opening
+    // or closing a pool while the store goes away
+    int ready = 1;
+    if (!atomic_compare_exchange_strong(&pool_store_ready, &ready, 0)) {
         return ALLOC_CALLED_AGAIN;
     }
-    for (int i = 0; i < MEM_POOL_STORE_INIT_CAPACITY; ++i) {
-        if (pool_store[i]) {
-            //We ill call mem_pool_close() here
-
-            //mem_pool_close((pool_pt)pool_store[i]);
-        }
+    for (unsigned s = 0; s < MEM_POOL_STORE_SEGMENTS; ++s) {
+        free(atomic_exchange(&pool_store[s], NULL));
     }
-    free(pool_store);
-    pool_store = NULL;
-    pool_store_size = 0;
     return ALLOC_OK;
 }
 
 pool_pt mem_pool_open(size_t size, alloc_policy policy) {
+    return mem_pool_open_ex(size, policy, NULL);
+}
+
+pool_pt mem_pool_open_ex(size_t size, alloc_policy policy, const pool_options_t *options) {
+    size_t alignment = (options && options->alignment) ? options->alignment : 1;
+    unsigned stripes = options ? options->stripes : 0;
+    pool_backing backing = options ? options->backing : BACKING_MALLOC;
+
     // make sure there the pool store is allocated
-    if (pool_store == NULL) {
+    if (!atomic_load(&pool_store_ready) | (size == 0)) {
         return NULL;
     }
-    alloc_status return_status = _mem_resize_pool_store();
-    int store_size = pool_store_size;
-    //assert(return_status ==ALLOC_OK);
-    if (return_status != ALLOC_OK) {
+    // a power of two no larger than a page; bitmap granules cannot move
+    if (((alignment & (alignment - 1)) != 0) || (alignment > MEM_PAGE_SIZE) ||
+        ((policy == BITMAP_FIT) && (alignment > ((size_t) 1 << MEM_GRANULE_SHIFT)))) {
+        return NULL;
+    }
+    // fixed-size pools need an object size, see mem_pool_open_fixed
+    if (policy == FIXED_SIZE) {
+        return NULL;
+    }
+    // a buddy pool is a single block: a power of two, at least the minimum
+    if ((policy == BUDDY) && (((size & (size - 1)) != 0) || (size >> MEM_BUDDY_MIN_ORDER) == 0)) {
+        return NULL;
+    }
+    // a bitmap pool is a whole number of granules
+    if ((policy == BITMAP_FIT) && ((size & (((size_t) 1 << MEM_GRANULE_SHIFT) - 1)) != 0)) {
+        return NULL;
+    }
+    // stripes of whole pages, so that each is a valid pool of the policy in
+    // turn; a linear pool has a single bump pointer to lock
+    if ((stripes > 0) &&
+        (((stripes & (stripes - 1)) != 0) || (stripes > MEM_MAX_STRIPES) ||
+         (size / stripes < MEM_PAGE_SIZE) || (policy == LINEAR))) {
+        return NULL;
+    }
+    if ((backing < BACKING_MALLOC) || (backing > BACKING_HUGETLB)) {
         return NULL;
     }
-    // expand the pool store, if necessary
-
 
     // allocate a new mem pool mgr
     pool_mgr_pt newMGR = malloc(sizeof(struct _pool_mgr));
@@ -170,271 +646,506 @@ pool_pt mem_pool_open(size_t size, alloc_policy policy) {
     if (!newMGR) {
         return NULL;
     }
-    // allocate a new memory pool
-
-    newMGR->pool.mem = malloc(size);
+    // allocate a new memory pool, at least page-aligned, so that alignment
+    // padding is the same from run to run
     // check success, on error deallocate mgr and return null
-    if (!newMGR->pool.mem) {
-        free(newMGR);
-        return NULL;
-    }
-    // allocate a new node heap
-    newMGR->node_heap = malloc(sizeof(struct _node) * MEM_NODE_HEAP_INIT_CAPACITY);
-    // check success, on error deallocate mgr/pool and return null
-    if (!newMGR->node_heap) {
-        free(newMGR->pool.mem);
+    if (_mem_pool_map(newMGR, size, backing) != ALLOC_OK) {
         free(newMGR);
         return NULL;
     }
-    // allocate a new gap index
-    newMGR->gap_ix = malloc(sizeof(struct _gap) * MEM_GAP_IX_INIT_CAPACITY);
-    // check success, on error deallocate mgr/pool/heap and return null
-    if (!newMGR->gap_ix) {
-        free(newMGR->pool.mem);
-        free(newMGR->node_heap);
+    // set up a single pool over the memory, or one per stripe
+    alloc_status init_status = (stripes > 0) ?
+                               _mem_stripes_init(newMGR, size, policy, alignment, stripes) :
+                               _mem_pool_init(newMGR, size, policy, alignment);
+    if (init_status != ALLOC_OK) {
+        _mem_pool_unmap(newMGR);
         free(newMGR);
         return NULL;
     }
-    // assign all the pointers and update meta data:
-    newMGR->total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
-    newMGR->pool.policy = policy;
-    newMGR->pool.total_size = size;
-    newMGR->pool.alloc_size = 0;
-    newMGR->pool.num_allocs = 0;
-    newMGR->pool.num_gaps = 1;
-    newMGR->used_nodes = 1;
-
-    newMGR->gap_ix_capacity = MEM_GAP_IX_INIT_CAPACITY;
-    //   initialize top node of node heap
-
-    newMGR->node_heap->allocated = 0;
-    newMGR->node_heap->used = 1;
-    newMGR->node_heap->alloc_record.mem = newMGR->pool.mem;
-    newMGR->node_heap->alloc_record.size = size;
-    newMGR->node_heap->prev = NULL;
-    newMGR->node_heap->next = NULL;
-    for (int i = 1; i < newMGR->total_nodes; ++i) {
-        newMGR->node_heap[i].used = 0;
-        newMGR->node_heap[i].allocated = 0;
-        newMGR->node_heap[i].prev = NULL;
-        newMGR->node_heap[i].next = NULL;
-        newMGR->node_heap[i].alloc_record.size = 0;
-        newMGR->node_heap[i].alloc_record.mem = NULL;
-
-    }
-    //   initialize top node of gap index
-    newMGR->gap_ix[0].size = size;
-    newMGR->gap_ix[0].node = newMGR->node_heap;
-    for (int i = 1; i < newMGR->gap_ix_capacity; ++i) {
-        newMGR->gap_ix[i].size = 0;
-        newMGR->gap_ix[i].node = NULL;
-    }
     //   initialize pool mgr
     //   link pool mgr to pool store
     // return the address of the mgr, cast to (pool_pt)
 
-    pool_store[store_size] = (pool_mgr_pt) newMGR;
+    atomic_init(&newMGR->epoch, atomic_fetch_add(&pool_epochs, 1) + 1);
+    if (_mem_pool_store_add(newMGR) != ALLOC_OK) {
+        _mem_free_pool_mgr(newMGR);
+        return NULL;
+    }
 
 
     return (pool_pt) newMGR;
 
 }
 
-alloc_status mem_pool_close(pool_pt pool) {
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    pool_mgr_pt mgr = (pool_mgr_pt) pool;
-    // check if this pool is allocated
-    if (!mgr) {
-        return ALLOC_FAIL;
+pool_pt mem_pool_open_sharded(size_t size, alloc_policy policy) {
+    // a stripe per CPU, rounded up to a power of two, as many as the size
+    // allows; the stripes are the shards
+    unsigned cpus = MEM_DEFAULT_SHARDS;
+#if defined(__linux__)
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online > 0) {
+        cpus = (unsigned) online;
     }
-    // check if pool has only one gap
-    if (mgr->pool.num_gaps != 1) {
-        return ALLOC_NOT_FREED;
+#endif
+    unsigned shards = 1;
+    while ((shards < cpus) && (shards < MEM_MAX_STRIPES) && (size / (shards * 2) >= MEM_PAGE_SIZE)) {
+        shards *= 2;
     }
-    // check if it has zero allocations
-    if (mgr->pool.num_allocs != 0) {
-        return ALLOC_NOT_FREED;
+    pool_options_t options = { .stripes = shards };
+    pool_mgr_pt mgr = (pool_mgr_pt) mem_pool_open_ex(size, policy, &options);
+    if (mgr == NULL) {
+        return NULL;
     }
-    // free memory pool
-    free(mgr->pool.mem);
-    // free node heap
-    free(mgr->node_heap);
-    // free gap index
+    mgr->stripe_per_cpu = 1;
 
-    free(mgr->gap_ix);
+    return (pool_pt) mgr;
+}
 
-    // find mgr in pool store and set to null
-    for (int i = 0; i < pool_store_size; ++i) {
-        if (pool_store[i] == mgr) {
-            pool_store[i] = NULL;
-        }
+pool_pt mem_pool_open_file(const char *path, size_t size, alloc_policy policy) {
+#if defined(__linux__)
+    // make sure there the pool store is allocated; only the policies kept
+    // entirely in the node list can be written out as segments
+    if (!atomic_load(&pool_store_ready) | (size == 0) | (path == NULL) || !_mem_file_policy(policy)) {
+        return NULL;
+    }
+    // a new file only, an existing one is for mem_pool_attach_file
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    pool_mgr_pt mgr = malloc(sizeof(struct _pool_mgr));
+    if ((mgr == NULL) || (_mem_file_map(mgr, fd, size, 1) != ALLOC_OK)) {
+        free(mgr);
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    if (_mem_pool_init(mgr, size, policy, 1) != ALLOC_OK) {
+        _mem_pool_unmap(mgr);
+        free(mgr);
+        unlink(path);
+        return NULL;
+    }
+    if (_mem_file_write(mgr) != ALLOC_OK) {
+        _mem_free_pool_mgr(mgr);
+        unlink(path);
+        return NULL;
+    }
+    mgr->file_journal = 1;
+    atomic_init(&mgr->epoch, atomic_fetch_add(&pool_epochs, 1) + 1);
+    if (_mem_pool_store_add(mgr) != ALLOC_OK) {
+        _mem_free_pool_mgr(mgr);
+        unlink(path);
+        return NULL;
     }
-    // note: don't decrement pool_store_size, because it only grows
-    // free mgr
-    free(mgr);
 
-    return ALLOC_OK;
+    return (pool_pt) mgr;
+#else
+    (void) path;
+    (void) size;
+    (void) policy;
+    return NULL;
+#endif
 }
 
-void *mem_new_alloc(pool_pt pool, size_t size) {
-    // printf("Inserting segment %lu",(unsigned long)size);
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    pool_mgr_pt mgr = (pool_mgr_pt) pool;
-    // check if any gaps, return null if none
-    if (mgr->pool.num_gaps == 0) {
+pool_pt mem_pool_attach_file(const char *path) {
+#if defined(__linux__)
+    if (!atomic_load(&pool_store_ready) || (path == NULL)) {
         return NULL;
     }
-    if ((mgr->pool.total_size <= size) | ((mgr->pool.total_size - mgr->pool.alloc_size) <= size)) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
+    // the header and the table are checked before anything is mapped
+    pool_file_header_t header;
+    pool_file_segment_pt segments = _mem_file_read(fd, &header);
+    if (segments == NULL) {
+        close(fd);
+        return NULL;
+    }
+    pool_mgr_pt mgr = malloc(sizeof(struct _pool_mgr));
+    if ((mgr == NULL) || (_mem_file_map(mgr, fd, header.total_size, 0) != ALLOC_OK)) {
+        free(segments);
+        free(mgr);
+        close(fd);
+        return NULL;
+    }
+    // the pool as it was opened, then the allocations again, in place
+    if (_mem_pool_init(mgr, header.total_size, (alloc_policy) header.policy, 1) != ALLOC_OK) {
+        free(segments);
+        _mem_pool_unmap(mgr);
+        free(mgr);
+        return NULL;
+    }
+    if (_mem_file_rebuild(mgr, segments, header.num_segments) != ALLOC_OK) {
+        free(segments);
+        _mem_free_pool_mgr(mgr);
+        return NULL;
+    }
+    free(segments);
+    // and the changes journaled since, then a snapshot of it all, so that
+    // the journal starts over
+    mgr->file_generation = header.generation;
+    mgr->file_table_offset = header.table_offset;
+    mgr->file_table_size = sizeof(pool_file_segment_t) * header.num_segments;
+    _mem_file_replay(mgr);
+    if (_mem_file_write(mgr) != ALLOC_OK) {
+        _mem_free_pool_mgr(mgr);
+        return NULL;
+    }
+    mgr->file_journal = 1;
+    atomic_init(&mgr->epoch, atomic_fetch_add(&pool_epochs, 1) + 1);
+    if (_mem_pool_store_add(mgr) != ALLOC_OK) {
+        _mem_free_pool_mgr(mgr);
         return NULL;
     }
-    // expand heap node, if necessary, quit on error
-    assert(ALLOC_OK == _mem_resize_node_heap(mgr));
-    node_pt heap = mgr->node_heap;
-
-    assert(heap != NULL);
 
-//1000000
-//1000000
+    return (pool_pt) mgr;
+#else
+    (void) path;
+    return NULL;
+#endif
+}
 
-    // check used nodes fewer than total nodes, quit on error
-    assert(mgr->used_nodes <= mgr->total_nodes);
-    // get a node for allocation:
-    node_pt node_to_alloc = heap;
+alloc_status mem_pool_sync(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    if (!mgr || (mgr->file_fd < 0)) {
+        return ALLOC_FAIL;
+    }
 
-    // if FIRST_FIT, then find the first sufficient node in the node heap
-    if (pool->policy == FIRST_FIT) {
+    return _mem_file_write(mgr);
+}
 
-        while (node_to_alloc->next != NULL) {
-            if (node_to_alloc->allocated == 0 & node_to_alloc->alloc_record.size >= size & node_to_alloc->used == 1) {
-                break;
-            } else {
-                node_to_alloc = node_to_alloc->next;
-            }
+void mem_pool_crash_at(unsigned long step) {
+    file_crash_step = step;
+    file_steps = 0;
+}
 
+void *mem_alloc_at(pool_pt pool, size_t offset) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    // the pools that keep every allocation on the node list
+    if (!mgr || (mgr->num_stripes > 0) || !_mem_file_policy(mgr->pool.policy) || (offset >= mgr->pool.total_size)) {
+        return NULL;
+    }
+    for (node_pt node = mgr->node_heap; node != NULL; node = node->next) {
+        if (node->alloc_record.mem == mgr->pool.mem + offset) {
+            return (node->allocated == 1) ? _mem_handle(mgr, node) : NULL;
+        }
+        if (node->alloc_record.mem > mgr->pool.mem + offset) {
+            break;
         }
+    }
 
+    return NULL;
+}
 
+alloc_status mem_pool_reset(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    if (!mgr) {
+        return ALLOC_FAIL;
+    }
+    // blocks in thread caches are gone too: a new epoch tells the caches
+    atomic_store(&mgr->epoch, atomic_fetch_add(&pool_epochs, 1) + 1);
+    if (mgr->num_stripes > 0) {
+        _mem_striped_reset(mgr);
+        return ALLOC_OK;
     }
-        // if BEST_FIT, then find the first sufficient node in the gap index
-    else {
-        for (int i = 0; i < mgr->gap_ix_capacity; ++i) {
-            if (mgr->gap_ix[i].node != NULL) {
-                assert(mgr->gap_ix[i].node->allocated != 1);
+
+    // every allocation goes at once, with no merging
+    mgr->pool.alloc_size = 0;
+    mgr->pool.num_allocs = 0;
+    mgr->pool.num_gaps = 0;
+
+    switch (pool->policy) {
+        case FIXED_SIZE:
+            for (unsigned w = 0; w < (mgr->fixed_count + 63) / 64; ++w) {
+                atomic_store_explicit(&mgr->fixed_map[w], 0, memory_order_relaxed);
             }
-            if (mgr->gap_ix[i].size >= size) {
-                node_to_alloc = mgr->gap_ix[i].node;
-                break;
+            mgr->fixed_free_head = MEM_NODE_NONE;
+            mgr->fixed_fresh = 0;
+            atomic_store(&mgr->fixed_lf_head, MEM_NODE_NONE);
+            atomic_store(&mgr->fixed_lf_fresh, 0);
+            atomic_store(&mgr->fixed_lf_live, 0);
+            mgr->pool.num_gaps = 1;
+            break;
+        case LINEAR:
+            // a release to the start, as far as marks go
+            mgr->linear_offset = 0;
+            _mem_linear_release(mgr, 0);
+            mgr->pool.num_gaps = 1;
+            break;
+        case BUDDY:
+            _mem_reset_node_heap(mgr);
+            memset(mgr->buddy_map, 0, pool->total_size >> MEM_BUDDY_MIN_ORDER);
+            for (int i = 0; i < MEM_SIZE_CLASSES; ++i) {
+                mgr->buddy_free[i] = NULL;
             }
-        }
-
-    }
-    assert(node_to_alloc != NULL);
-    //check if the size is larger then the largest gap
-    int size_check = 0;
-    for (int i = 0; i < mgr->gap_ix_capacity; ++i) {
-        if (mgr->gap_ix[i].node != NULL) {
-            assert(mgr->gap_ix[i].node->allocated != 1);
-        }
-        if (mgr->gap_ix[i].size >= size) {
-            size_check = 1;
+            mgr->buddy_free_mask = 0;
+            _mem_buddy_push(mgr, pool->mem, mgr->buddy_max_order);
+            break;
+        case BITMAP_FIT:
+            _mem_reset_node_heap(mgr);
+            memset(mgr->bitmap_used, 0, mgr->bitmap_words * sizeof(uint64_t));
+            memset(mgr->bitmap_start, 0, mgr->bitmap_words * sizeof(uint64_t));
+            _mem_bitmap_set(mgr->bitmap_used, mgr->bitmap_granules,
+                            mgr->bitmap_words * 64 - mgr->bitmap_granules, 1);
+            mgr->pool.num_gaps = 1;
+            break;
+        default:
+            // back to the single gap of mem_pool_open, in the same node
+            _mem_reset_node_heap(mgr);
+            mgr->gap_ix = NULL;
+            for (int i = 0; i < MEM_SIZE_CLASSES; ++i) {
+                mgr->size_classes[i] = NULL;
+            }
+            mgr->size_class_mask = 0;
+            if (mgr->tlsf != NULL) {
+                memset(mgr->tlsf, 0, sizeof(tlsf_index_t));
+            }
+            node_pt head = _mem_node_at(mgr, mgr->unused_head);
+            mgr->unused_head = head->next_unused;
+            head->next_unused = MEM_NODE_NONE;
+            head->used = 1;
+            mgr->used_nodes = 1;
+            head->alloc_record.mem = pool->mem;
+            head->alloc_record.size = pool->total_size;
+            mgr->node_heap = head;
+            mgr->next_fit_cursor = head;
+            _mem_add_to_gap_ix(mgr, pool->total_size, head);
             break;
-        }
     }
-    if (!size_check) {
-        return NULL;
+    // a file-backed pool has no journal record for it, but a snapshot
+    if ((mgr->file_fd >= 0) && mgr->file_journal) {
+        return _mem_file_write(mgr);
     }
-    // check if node found
-    // update metadata (num_allocs, alloc_size)
-    mgr->pool.num_allocs++;
-    size_t old_size = mgr->pool.alloc_size;
-    mgr->pool.alloc_size += size;
-
-
-    size_t remaining_gap_size = 0;
-    // calculate the size of the remaining gap, if any
 
-    remaining_gap_size = node_to_alloc->alloc_record.size - size;
+    return ALLOC_OK;
+}
 
+alloc_status mem_pool_close_force(pool_pt pool) {
+    // drop whatever is still allocated, then close as usual
+    if (mem_pool_reset(pool) != ALLOC_OK) {
+        return ALLOC_FAIL;
+    }
+    return mem_pool_close(pool);
+}
 
-    size_t old_remaining_gap_size = mgr->pool.total_size - old_size;
-    // remove node from gap index
-    size_t old_gap_size = node_to_alloc->alloc_record.size;
-    assert(ALLOC_OK == _mem_remove_from_gap_ix(mgr, old_gap_size, node_to_alloc));
+alloc_status mem_pool_close(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    // check if this pool is allocated and still in the pool store
+    if (!mgr) {
+        return ALLOC_FAIL;
+    }
+    _Atomic(pool_mgr_pt) *slot = _mem_pool_store_find(mgr);
+    if (slot == NULL) {
+        return ALLOC_FAIL;
+    }
+    if (mgr->pool.policy == FIXED_SIZE) {
+        _mem_fixed_sync(mgr);
+    }
+    mem_pool_drain(pool);
+    // a file-backed pool keeps its allocations in the file for the next
+    // mem_pool_attach_file, and closes once they are written out
+    if (mgr->file_fd >= 0) {
+        if (_mem_file_write(mgr) != ALLOC_OK) {
+            return ALLOC_FAIL;
+        }
+    } else if ((mgr->pool.num_gaps != (mgr->num_stripes ? mgr->num_stripes : 1)) ||
+               (mgr->pool.num_allocs != 0)) {
+        // check if pool has only one gap (one per stripe: they never merge)
+        // and if it has zero allocations
+        return ALLOC_NOT_FREED;
+    }
+    // take mgr out of the pool store; if another thread got there first,
+    // the pool is theirs to free
+    pool_mgr_pt expected = mgr;
+    if (!atomic_compare_exchange_strong(slot, &expected, NULL)) {
+        return ALLOC_FAIL;
+    }
+    // free the pool, its metadata and mgr
+    _mem_free_pool_mgr(mgr);
 
-    // convert gap_node to an allocation node of given size
+    return ALLOC_OK;
+}
 
-    node_to_alloc->alloc_record.size = size;
+// in a thread-safe pool each stripe is a pool of its own, size / stripes
+// rounded down to a page, the last with the remainder: an allocation
+// comes from one stripe, so one larger than that fails however much of
+// the pool is free
+void *mem_new_alloc(pool_pt pool, size_t size) {
+    return mem_new_alloc_aligned(pool, size, 1);
+}
 
-    node_to_alloc->allocated = 1;
-    // adjust node heap:
+void *mem_new_alloc_aligned(pool_pt pool, size_t size, size_t alignment) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    // a power of two no larger than a page, and no less than the pool's own
+    if ((alignment == 0) || ((alignment & (alignment - 1)) != 0) || (alignment > MEM_PAGE_SIZE)) {
+        return NULL;
+    }
+    alignment = MEM_MAX(alignment, mgr->alignment);
+    // FIXED_SIZE and LINEAR pools hand out memory through their own calls
+    if ((pool->policy == FIXED_SIZE) || (pool->policy == LINEAR)) {
+        return NULL;
+    }
+    // on huge pages, a large allocation starts on a huge page boundary if
+    // there is a gap to allow it, so that it spans as few pages as it can;
+    // buddy blocks are aligned to their size already
+    if (((mgr->backing == BACKING_THP) || (mgr->backing == BACKING_HUGETLB)) && (size >= MEM_HUGE_PAGE_SIZE) &&
+        (pool->policy != BUDDY) && (pool->policy != BITMAP_FIT)) {
+        void *alloc = _mem_new_alloc(mgr, size, MEM_HUGE_PAGE_SIZE);
+        if (alloc != NULL) {
+            return alloc;
+        }
+    }
 
-    //   if remaining gap, need a new node
-    if (remaining_gap_size > 0) {
-        node_pt new_gap_node = NULL;
-        //   find an unused one in the node heap
-        for (int i = 0; i < mgr->total_nodes; ++i) {
-            //We find the first node that does not have a previous or a next
-            if (mgr->node_heap[i].used == 0) {
+    return _mem_new_alloc(mgr, size, alignment);
+}
 
-                new_gap_node = &(mgr->node_heap[i]);
+static void *_mem_new_alloc(pool_mgr_pt mgr, size_t size, size_t alignment) {
+    pool_pt pool = &mgr->pool;
+    // a thread-safe pool leaves it to one of its stripes
+    if (mgr->num_stripes > 0) {
+        return _mem_striped_alloc(mgr, size, alignment);
+    }
+    // check if any gaps, return null if none
+    if (mgr->pool.num_gaps == 0) {
+        return NULL;
+    }
+    if ((mgr->pool.total_size < size) | ((mgr->pool.total_size - mgr->pool.alloc_size) < size)) {
+        return NULL;
+    }
+    // expand heap node, if necessary, quit on error
+    assert(ALLOC_OK == _mem_resize_node_heap(mgr));
 
-                break;
-            }
-        }
-        assert(new_gap_node != NULL);
-        //   make sure one was found
-        //   initialize it to a gap node
-        if (node_to_alloc->next != NULL) {
-            new_gap_node->next = node_to_alloc->next;
-            node_to_alloc->next->prev = new_gap_node;
+    // a BUDDY pool has its own engine; blocks are aligned to their size
+    if (pool->policy == BUDDY) {
+        return _mem_buddy_alloc(mgr, MEM_MAX(size, alignment));
+    }
+    // so does a BITMAP_FIT pool, aligned to its granules only
+    if (pool->policy == BITMAP_FIT) {
+        if (alignment > ((size_t) 1 << MEM_GRANULE_SHIFT)) {
+            return NULL;
         }
-        node_to_alloc->next = new_gap_node;
-        new_gap_node->prev = node_to_alloc;
+        return _mem_bitmap_alloc(mgr, size);
+    }
+    // padding may take a second node
+    if ((alignment > 1) && (_mem_reserve_nodes(mgr, 2) != ALLOC_OK)) {
+        return NULL;
+    }
+    assert(mgr->node_heap != NULL);
 
+    // check there is an unused node for the remaining gap, quit on error
+    assert(mgr->unused_head != MEM_NODE_NONE);
+    // get a node for allocation:
+    node_pt node_to_alloc = _mem_find_gap(mgr, size, alignment);
 
-        new_gap_node->alloc_record.size = old_gap_size - node_to_alloc->alloc_record.size;
-        new_gap_node->used = 1;
-        new_gap_node->allocated = 0;
-        new_gap_node->alloc_record.mem = node_to_alloc->alloc_record.mem + size * sizeof(char);
-        mgr->used_nodes++;
-        assert(_mem_add_to_gap_ix(mgr, new_gap_node->alloc_record.size, new_gap_node) == ALLOC_OK);
+    // the size is larger than the largest gap
+    if (node_to_alloc == NULL) {
+        return NULL;
+    }
+    // the padding in front of an aligned allocation stays a gap of its own
+    size_t pad = _mem_align_pad(node_to_alloc->alloc_record.mem, alignment);
+    if (pad > 0) {
+        node_to_alloc = _mem_split_padding(mgr, node_to_alloc, pad);
+    }
+    return _mem_handle(mgr, _mem_carve_gap(mgr, node_to_alloc, size));
+}
+
+alloc_status mem_new_alloc_batch(pool_pt pool, const size_t sizes[], unsigned n, void *out[]) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    size_t total = 0;
 
+    // one capacity check for the whole batch
+    for (unsigned i = 0; i < n; ++i) {
+        out[i] = NULL;
+        if (sizes[i] > (size_t) -1 - total) {
+            return ALLOC_FAIL;
+        }
+        total += sizes[i];
+    }
+    if (n == 0) {
+        return ALLOC_OK;
+    }
+    if (mgr->num_stripes > 0) {
+        return _mem_striped_alloc_batch(mgr, sizes, n, out);
+    }
+    if ((pool->policy == FIXED_SIZE) || (pool->policy == LINEAR) ||
+        (mgr->pool.total_size - mgr->pool.alloc_size < total)) {
+        return ALLOC_FAIL;
+    }
+    // and one node reservation, a node per allocation covers any split
+    if (_mem_reserve_nodes(mgr, n) != ALLOC_OK) {
+        return ALLOC_FAIL;
+    }
 
+    // carve the whole batch out of a single gap, back to back: one search,
+    // one gap index removal and one insertion
+    if ((pool->policy != BUDDY) && (pool->policy != BITMAP_FIT) && (mgr->alignment == 1) &&
+        (mgr->pool.num_gaps > 0)) {
+        node_pt gap = _mem_find_gap(mgr, total, 1);
+        if (gap != NULL) {
+            _mem_carve_batch(mgr, gap, sizes, n, out);
+            return ALLOC_OK;
+        }
     }
 
-    //   make sure one was found
-    //   initialize it to a gap node
-    //   update metadata (used_nodes)
-    //   update linked list (new node right after the node for allocation)
+    // else one at a time, all or nothing
+    for (unsigned i = 0; i < n; ++i) {
+        out[i] = mem_new_alloc(pool, sizes[i]);
+        if (out[i] == NULL) {
+            for (unsigned j = 0; j < i; ++j) {
+                mem_del_alloc(pool, out[j]);
+                out[j] = NULL;
+            }
+            return ALLOC_FAIL;
+        }
+    }
 
-    //   add to gap index
-    //   check if successful
-    // return allocation record by casting the node to (alloc_pt)
-    // printf("   DONE\n");
-    return (alloc_pt) node_to_alloc;
+    return ALLOC_OK;
 }
 
 alloc_status mem_del_alloc(pool_pt pool, void *alloc) {
 
-    assert(alloc != NULL);
     // get mgr from pool by casting the pointer to (pool_mgr_pt)
     pool_mgr_pt mgr = (pool_mgr_pt) pool;
-
-    // get node from alloc by casting the pointer to (node_pt)
-    node_pt node_to_find = (node_pt) alloc;
-    // printf("removing segment with size %lu\n",(unsigned long)node_to_find->alloc_record.size);
-    assert(node_to_find->allocated == 1);
-    // find the node in the node heap
-    node_pt node_to_remove = mgr->node_heap;
-    while (node_to_remove != node_to_find & node_to_remove->next != NULL) {
-        node_to_remove = node_to_remove->next;
+    // FIXED_SIZE and LINEAR pools have no allocation records
+    if ((pool->policy == FIXED_SIZE) || (pool->policy == LINEAR)) {
+        return ALLOC_FAIL;
     }
+    if (mgr->num_stripes > 0) {
+        return _mem_striped_free(mgr, alloc);
+    }
+
+    // get node from alloc: the handle names the node, so resolve it
+    // directly instead of walking the list, and take it from any other
+    // thread freeing it at the same time
+    node_pt node_to_remove = _mem_node_claim(mgr, alloc, MEM_NODE_FREEING);
+
+    // this is node-to-delete
+    // make sure it's a live allocation of this pool
     if (node_to_remove == NULL) {
         return ALLOC_FAIL;
     }
 
-    // this is node-to-delete
-    // make sure it's found
+    // a BUDDY pool has its own engine
+    if (pool->policy == BUDDY) {
+        _mem_buddy_free(mgr, node_to_remove);
+        return ALLOC_OK;
+    }
+    if (pool->policy == BITMAP_FIT) {
+        _mem_bitmap_free(mgr, node_to_remove);
+        return ALLOC_OK;
+    }
+    // journaled once done, so that a snapshot in its place has it; the
+    // record is made now, while the node is still the allocation
+    pool_file_record_pt records = _mem_file_records(mgr, MEM_FILE_FREE, (void *[]) { _mem_handle(mgr, node_to_remove) }, 1);
     // convert to gap node
     node_to_remove->allocated = 0;
     // update metadata (num_allocs, alloc_size)
@@ -448,11 +1159,6 @@ alloc_status mem_del_alloc(pool_pt pool, void *alloc) {
 
 
             node_pt next = node_to_remove->next;
-            if (next->used) {
-                mgr->used_nodes--;
-
-            }
-            next->used = 0;
 
             if (next->next) {
                 next->next->prev = node_to_remove;
@@ -460,8 +1166,6 @@ alloc_status mem_del_alloc(pool_pt pool, void *alloc) {
             } else {
                 node_to_remove->next = NULL;
             }
-            next->next = NULL;
-            next->prev = NULL;
 
 
             //   remove the next node from gap index
@@ -470,10 +1174,8 @@ alloc_status mem_del_alloc(pool_pt pool, void *alloc) {
             //   check success
             //   add the size to the node-to-delete
             node_to_remove->alloc_record.size += next->alloc_record.size;
-            //   update node as unused
-            //   update metadata (used nodes)
-
-            //   update linked list:
+            //   update node as unused and return it to the unused node list
+            _mem_release_node(mgr, next);
 
         }
     }
@@ -501,10 +1203,7 @@ alloc_status mem_del_alloc(pool_pt pool, void *alloc) {
             } else {
                 prev->next = NULL;
             }
-            node_to_remove->next = NULL;
-            node_to_remove->prev = NULL;
-            node_to_remove->used = 0;
-            mgr->used_nodes--;
+            _mem_release_node(mgr, node_to_remove);
         }
     }
     if (node_to_remove->used) {
@@ -517,200 +1216,3172 @@ alloc_status mem_del_alloc(pool_pt pool, void *alloc) {
     // add the resulting node to the gap index
     // check success
     //printf("   DONE\n");
+    _mem_file_append(mgr, records, 1);
     return ALLOC_OK;
 }
 
-void mem_inspect_pool(pool_pt pool,
-                      pool_segment_pt *segments,
-                      unsigned *num_segments) {
-    // get the mgr from the pool
-    pool_mgr_pt mgr = (pool_mgr_pt) pool;
-
-    pool_segment_pt segs = malloc(sizeof(struct _pool_segment) * mgr->used_nodes);
-    assert(segs != NULL);
-    // allocate the segments array with size == used_nodes
-    // check successful
-    // loop through the node heap and the segments array
-    node_pt cur_node = mgr->node_heap;
-    int index = 0;
+pool_pt mem_pool_open_fixed(size_t obj_size, unsigned count) {
+    return mem_pool_open_fixed_ex(obj_size, count, NULL);
+}
 
-    while (cur_node->used) {
-        segs[index].size = cur_node->alloc_record.size;
-        segs[index].allocated = cur_node->allocated;
-        if (cur_node->next == NULL) { break; }
-        cur_node = cur_node->next;
-        index++;
+pool_pt mem_pool_open_fixed_ex(size_t obj_size, unsigned count, const pool_options_t *options) {
+    int lock_free = options ? options->lock_free : 0;
+    pool_backing backing = options ? options->backing : BACKING_MALLOC;
 
+    // make sure there the pool store is allocated
+    if (!atomic_load(&pool_store_ready) | (obj_size == 0) | (count == 0)) {
+        return NULL;
+    }
+    // slots are neither aligned beyond malloc nor striped, lock-free is the
+    // thread-safe mode of a fixed-size pool
+    if (options && ((options->alignment > 1) || (options->stripes > 0))) {
+        return NULL;
+    }
+    if ((backing < BACKING_MALLOC) || (backing > BACKING_HUGETLB)) {
+        return NULL;
+    }
+    // the stack needs a slot index that is not MEM_NODE_NONE
+    if (count >= MEM_NODE_NONE) {
+        return NULL;
+    }
+    // a free slot holds the index of the next free slot
+    size_t slot = MEM_MAX(obj_size, sizeof(unsigned));
+    if (slot > (size_t) -1 / count) {
+        return NULL;
+    }
+    // allocate a new mem pool mgr, the pool and one bit per slot
+    pool_mgr_pt mgr = malloc(sizeof(struct _pool_mgr));
+    if (!mgr) {
+        return NULL;
+    }
+    _mem_pool_map(mgr, slot * count, backing);
+    mgr->fixed_map = calloc((count + 63) / 64, sizeof(uint64_t));
+    mgr->fixed_lf_next = lock_free ? calloc(count, sizeof(unsigned)) : NULL;
+    if (!mgr->pool.mem || !mgr->fixed_map || (lock_free && !mgr->fixed_lf_next)) {
+        free(mgr->fixed_lf_next);
+        free(mgr->fixed_map);
+        _mem_pool_unmap(mgr);
+        free(mgr);
+        return NULL;
     }
-    //    for each node, write the size and allocated in the segment
-    // "return" the values:
 
-    *segments = segs;
-    *num_segments = mgr->used_nodes;
+    // no node heap and no gap index: the slots are the metadata
+    mgr->pool.policy = FIXED_SIZE;
+    mgr->pool.total_size = slot * count;
+    mgr->pool.alloc_size = 0;
+    mgr->pool.num_allocs = 0;
+    mgr->pool.num_gaps = 1;
+    mgr->node_heap = NULL;
+    mgr->node_chunks = NULL;
+    mgr->num_chunks = 0;
+    mgr->node_dir_capacity = 0;
+    mgr->num_outgrown_dirs = 0;
+    mgr->total_nodes = 0;
+    mgr->used_nodes = 0;
+    mgr->unused_head = MEM_NODE_NONE;
+    mgr->unused_hits = 0;
+    mgr->heap_grows = 0;
+    mgr->gap_ix = NULL;
+    mgr->next_fit_cursor = NULL;
+    for (int i = 0; i < MEM_SIZE_CLASSES; ++i) {
+        mgr->size_classes[i] = NULL;
+    }
+    mgr->size_class_mask = 0;
+    mgr->class_hits = 0;
+    mgr->class_splits = 0;
+    mgr->class_misses = 0;
+    mgr->buddy_map = NULL;
+    mgr->tlsf = NULL;
+    mgr->bitmap_used = NULL;
+    mgr->bitmap_start = NULL;
+    mgr->alignment = 1;
+    mgr->linear_offset = 0;
+    mgr->linear_epoch = 0;
+    mgr->linear_floor = 0;
+    mgr->linear_num_releases = 0;
+    mgr->stripes = NULL;
+    mgr->stripe_locks = NULL;
+    mgr->num_stripes = 0;
+    mgr->stripe_index = 0;
+    mgr->stripe_size = 0;
+    atomic_init(&mgr->remote_head, NULL);
+    atomic_init(&mgr->remote_depth, 0);
+    atomic_init(&mgr->remote_frees, 0);
+    mgr->remote_drains = 0;
+    mgr->remote_drain_ns = 0;
+    mgr->remote_max_drain = 0;
+    mgr->fixed_slot = slot;
+    mgr->fixed_count = count;
+    // the free list starts empty, slots are handed out in address order
+    // until the first free, so opening is O(1) whatever the count
+    mgr->fixed_free_head = MEM_NODE_NONE;
+    mgr->fixed_fresh = 0;
+    mgr->fixed_lock_free = lock_free;
+    atomic_init(&mgr->fixed_lf_head, MEM_NODE_NONE);
+    atomic_init(&mgr->fixed_lf_fresh, 0);
+    atomic_init(&mgr->fixed_lf_live, 0);
+
+    // link pool mgr to pool store
+    atomic_init(&mgr->epoch, atomic_fetch_add(&pool_epochs, 1) + 1);
+    if (_mem_pool_store_add(mgr) != ALLOC_OK) {
+        _mem_free_pool_mgr(mgr);
+        return NULL;
+    }
 
+    return (pool_pt) mgr;
 }
 
+void *mem_fixed_alloc(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    if (pool->policy != FIXED_SIZE) {
+        return NULL;
+    }
+    if (mgr->fixed_lock_free) {
+        return _mem_fixed_alloc_lock_free(mgr);
+    }
 
+    // take a freed slot first, then a fresh one
+    unsigned slot;
+    if (mgr->fixed_free_head != MEM_NODE_NONE) {
+        slot = mgr->fixed_free_head;
+        memcpy(&mgr->fixed_free_head, pool->mem + slot * mgr->fixed_slot, sizeof(unsigned));
+    } else if (mgr->fixed_fresh < mgr->fixed_count) {
+        slot = mgr->fixed_fresh++;
+    } else {
+        return NULL;
+    }
 
-/***********************************/
-/*                                 */
-/* Definitions of static functions */
-/*                                 */
-/***********************************/
-static alloc_status _mem_resize_pool_store() {
-    // check if necessary
-
-    if (((float) pool_store_size / pool_store_capacity)
-        > MEM_POOL_STORE_FILL_FACTOR) {
-        printf("RESISING POOL\n");
-        pool_store_capacity *= MEM_POOL_STORE_EXPAND_FACTOR;
-        pool_store = realloc(pool_store, pool_store_capacity * sizeof(pool_mgr_pt));
-        if (pool_store == NULL) {
-            return ALLOC_FAIL;
-        }
+    // a gap splits in two, shrinks, or disappears, depending on the neighbours
+    int left = _mem_fixed_is_free(mgr, slot - 1);
+    int right = _mem_fixed_is_free(mgr, slot + 1);
+    mgr->pool.num_gaps = mgr->pool.num_gaps + (left & right) - (!left & !right);
+
+    _mem_fixed_mark(mgr, slot, 1);
+    mgr->pool.num_allocs++;
+    mgr->pool.alloc_size += mgr->fixed_slot;
+
+    return pool->mem + slot * mgr->fixed_slot;
+}
 
+alloc_status mem_fixed_free(pool_pt pool, void *obj) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    if ((pool->policy != FIXED_SIZE) || (obj == NULL)) {
+        return ALLOC_FAIL;
+    }
+
+    // make sure it's the start of an allocated slot of this pool
+    char *mem = obj;
+    if ((mem < pool->mem) || (mem >= pool->mem + pool->total_size)) {
+        return ALLOC_FAIL;
+    }
+    size_t offset = (size_t) (mem - pool->mem);
+    unsigned slot = (unsigned) (offset / mgr->fixed_slot);
+    if (offset % mgr->fixed_slot != 0) {
+        return ALLOC_FAIL;
     }
+    if (mgr->fixed_lock_free) {
+        return _mem_fixed_free_lock_free(mgr, slot);
+    }
+    if (_mem_fixed_is_free(mgr, slot)) {
+        return ALLOC_FAIL;
+    }
+
+    _mem_fixed_mark(mgr, slot, 0);
+    mgr->pool.num_allocs--;
+    mgr->pool.alloc_size -= mgr->fixed_slot;
 
+    // the opposite of mem_fixed_alloc: gaps merge, grow, or appear
+    int left = _mem_fixed_is_free(mgr, slot - 1);
+    int right = _mem_fixed_is_free(mgr, slot + 1);
+    mgr->pool.num_gaps = mgr->pool.num_gaps - (left & right) + (!left & !right);
 
-    // don't forget to update capacity variables
+    // push the slot on the free list
+    memcpy(mem, &mgr->fixed_free_head, sizeof(unsigned));
+    mgr->fixed_free_head = slot;
 
     return ALLOC_OK;
 }
 
-static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr) {
-    // see above
-    if (((float) pool_mgr->used_nodes / pool_mgr->total_nodes)
-        > MEM_NODE_HEAP_FILL_FACTOR) {
-        printf("RESISING HEAP\n");
-        pool_mgr->total_nodes = pool_mgr->total_nodes * MEM_NODE_HEAP_EXPAND_FACTOR;
-
-        pool_mgr->node_heap = realloc(pool_mgr->node_heap, pool_mgr->total_nodes * sizeof(struct _node));
-        if (pool_mgr->node_heap == NULL) {
+alloc_status mem_del_alloc_batch(pool_pt pool, void *allocs[], unsigned n) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    if ((pool->policy == FIXED_SIZE) || (pool->policy == LINEAR)) {
+        return ALLOC_FAIL;
+    }
+    if (mgr->num_stripes > 0) {
+        return _mem_striped_free_batch(mgr, allocs, n);
+    }
+
+    // validate the whole batch first, claiming each node as it passes so
+    // that a handle given twice fails the second time; nothing is freed
+    // unless every handle is good
+    for (unsigned i = 0; i < n; ++i) {
+        if (_mem_node_claim(mgr, allocs[i], MEM_NODE_FREEING) == NULL) {
+            for (unsigned j = 0; j < i; ++j) {
+                _mem_handle_node(mgr, allocs[j])->allocated = 1;
+            }
             return ALLOC_FAIL;
         }
-
     }
+    _mem_free_claimed(mgr, allocs, n);
 
     return ALLOC_OK;
 }
 
-static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr) {
-    // see above
-    if (((float) pool_mgr->pool.num_gaps / pool_mgr->gap_ix_capacity)
-        > MEM_GAP_IX_FILL_FACTOR) {
-        printf("RESISING GAP_IX\n");
-        pool_mgr->gap_ix_capacity = pool_mgr->gap_ix_capacity * MEM_GAP_IX_EXPAND_FACTOR;
-        pool_mgr->gap_ix = realloc(pool_mgr->gap_ix, pool_mgr->gap_ix_capacity * sizeof(struct _gap));
-        if (pool_mgr->gap_ix == NULL) {
-            return ALLOC_FAIL;
+// free allocations claimed for MEM_NODE_FREEING, all at once
+static void _mem_free_claimed(pool_mgr_pt mgr, void *allocs[], unsigned n) {
+    // BUDDY and BITMAP_FIT free as they go anyway
+    if ((mgr->pool.policy == BUDDY) || (mgr->pool.policy == BITMAP_FIT)) {
+        for (unsigned i = 0; i < n; ++i) {
+            node_pt node = _mem_handle_node(mgr, allocs[i]);
+            if (mgr->pool.policy == BUDDY) {
+                _mem_buddy_free(mgr, node);
+            } else {
+                _mem_bitmap_free(mgr, node);
+            }
         }
+        return;
+    }
 
+    pool_file_record_pt records = _mem_file_records(mgr, MEM_FILE_FREE, allocs, n);
+    // update metadata (num_allocs, alloc_size) for the whole batch
+    for (unsigned i = 0; i < n; ++i) {
+        mgr->pool.num_allocs--;
+        mgr->pool.alloc_size -= _mem_handle_node(mgr, allocs[i])->alloc_record.size;
     }
-    return ALLOC_OK;
+    // then merge each run of free nodes once, whichever of its nodes
+    // comes first in the batch
+    for (unsigned i = 0; i < n; ++i) {
+        node_pt node = _mem_handle_node(mgr, allocs[i]);
+        if (node->used && (node->allocated == MEM_NODE_FREEING)) {
+            _mem_coalesce_run(mgr, node);
+        }
+    }
+    _mem_file_append(mgr, records, n);
 }
 
-static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
-                                       size_t size,
-                                       node_pt node) {
-
-    // expand the gap index, if necessary (call the function)
-    assert(_mem_resize_gap_ix(pool_mgr) == ALLOC_OK);
-    assert(node->allocated == 0);
-    assert(size > 0);
+alloc_status mem_pool_drain(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    if (!mgr) {
+        return ALLOC_FAIL;
+    }
+    // carry out the frees other threads left queued, so that the pool_t
+    // counters are up to date; nothing to do for other pools
+    for (unsigned k = 0; k < mgr->num_stripes; ++k) {
+        pthread_mutex_lock(&mgr->stripe_locks[k]);
+        _mem_stripe_drain(mgr, k);
+        pthread_mutex_unlock(&mgr->stripe_locks[k]);
+    }
 
+    return ALLOC_OK;
+}
 
-    // add the entry at the end
+void *mem_realloc(pool_pt pool, void *alloc, size_t new_size) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    if ((pool->policy == FIXED_SIZE) || (pool->policy == LINEAR)) {
+        return NULL;
+    }
+    if (mgr->num_stripes > 0) {
+        return _mem_striped_realloc(mgr, alloc, new_size);
+    }
+    node_pt node = _mem_node_from_handle(mgr, alloc);
+    if (node == NULL) {
+        return NULL;
+    }
 
+    // grow into or shrink back to the next gap, keeping the handle
+    if (_mem_resize_in_place(mgr, node, new_size) == ALLOC_OK) {
+        _mem_file_log(mgr, MEM_FILE_RESIZE, (void *[]) { alloc }, 1);
+        return alloc;
+    }
 
+    // else move: the old allocation stays put if there is no room
+    void *moved = mem_new_alloc(pool, new_size);
+    if (moved == NULL) {
+        return NULL;
+    }
+    size_t keep = (new_size < node->alloc_record.size) ? new_size : node->alloc_record.size;
+    memcpy(_mem_handle_node(mgr, moved)->alloc_record.mem, node->alloc_record.mem, keep);
+    alloc_status status = mem_del_alloc(pool, alloc);
+    assert(status == ALLOC_OK);
+    (void) status;
 
+    return moved;
+}
 
+void *mem_linear_alloc(pool_pt pool, size_t size) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    if (pool->policy != LINEAR) {
+        return NULL;
+    }
 
-    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].size = size;
-    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = node;
-    pool_mgr->pool.num_gaps++;
-    // update metadata (num_gaps)
+    // no search: bump the pointer past the padding and the allocation
+    size_t offset = mgr->linear_offset + _mem_align_pad(pool->mem + mgr->linear_offset, mgr->alignment);
+    if ((offset > pool->total_size) || (pool->total_size - offset < size)) {
+        return NULL;
+    }
+    mgr->linear_offset = offset + size;
 
+    // update metadata (num_allocs, alloc_size, num_gaps)
+    mgr->pool.num_allocs++;
+    mgr->pool.alloc_size += size;
+    mgr->pool.num_gaps = (mgr->linear_offset < pool->total_size) ? 1 : 0;
 
-    // sort the gap index (call the function)
+    return pool->mem + offset;
+}
 
-    // check success
+pool_mark_t mem_pool_mark(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    pool_mark_t mark = { mgr->linear_offset, pool->alloc_size, pool->num_allocs, mgr->linear_epoch };
 
-    //printf("Inserting node with size %lu\n",(unsigned long)size);
-    return _mem_sort_gap_ix(pool_mgr);
-    //return ALLOC_OK;
+    return mark;
 }
 
-static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
-                                            size_t size,
-                                            node_pt node) {
-    assert(size > 0);
-    int num_gaps = pool_mgr->pool.num_gaps;
-    int chosen_node = num_gaps;
-    for (int i = 0; i < num_gaps; ++i) {
-        if (pool_mgr->gap_ix[i].node == node) {
-            chosen_node = i;
+alloc_status mem_pool_release_to(pool_pt pool, pool_mark_t mark) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    // a mark from before the current point, not one already released past
+    if ((pool->policy != LINEAR) || (mark.offset > mgr->linear_offset) ||
+        (mark.num_allocs > pool->num_allocs) || (mark.alloc_size > pool->alloc_size) ||
+        (mark.epoch < mgr->linear_floor) || (mark.epoch > mgr->linear_epoch)) {
+        return ALLOC_FAIL;
+    }
+    // nor one that a release since it was taken went below, whatever has
+    // been allocated over it again
+    for (unsigned i = 0; i < mgr->linear_num_releases; ++i) {
+        if (mgr->linear_releases[i].epoch > mark.epoch) {
+            if (mgr->linear_releases[i].offset < mark.offset) {
+                return ALLOC_FAIL;
+            }
             break;
         }
     }
-    for (int i = chosen_node; i < num_gaps; ++i) {
-        pool_mgr->gap_ix[i].size = pool_mgr->gap_ix[i + 1].size;
-        //pool_mgr->gap_ix[i]=pool_mgr->gap_ix[i+1];
-        pool_mgr->gap_ix[i].node = pool_mgr->gap_ix[i + 1].node;
-
-    }
-    pool_mgr->gap_ix[num_gaps].node = NULL;
-    pool_mgr->gap_ix[num_gaps].size = 0;
-    pool_mgr->pool.num_gaps--;
-    // find the position of the node in the gap index
-    // loop from there to the end of the array:
-    //    pull the entries (i.e. copy over) one position up
-    //    this effectively deletes the chosen node
-    // update metadata (num_gaps)
-    // zero out the element at position num_gaps!
-    // printf("Removing node with size %lu\n",(unsigned long)size);
-    return ALLOC_OK;
-}
 
-// note: only called by _mem_add_to_gap_ix, which appends a single entry
-static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr) {
-
-    // the new entry is at the end, so "bubble it up"
-    int num_gaps = pool_mgr->pool.num_gaps;
-    size_t size = pool_mgr->gap_ix[num_gaps].size;
-
-    for (int i = (num_gaps - 1); i > 0; --i) {
-        int next_size_smaller = pool_mgr->gap_ix[i].size < pool_mgr->gap_ix[i - 1].size;
-        int next_address_smaller = pool_mgr->gap_ix[i].node < pool_mgr->gap_ix[i - 1].node;
-        int next_size_equal = pool_mgr->gap_ix[i].size == pool_mgr->gap_ix[i - 1].size;
-        int next_non_empty = pool_mgr->gap_ix[i].size != 0;
-        int current_empty = pool_mgr->gap_ix[i].size == 0;
-
-        if ((current_empty & next_non_empty) | (next_size_smaller & next_non_empty) |
-            (next_size_equal & next_address_smaller & next_non_empty)) {
-            /*
-            printf("Swaping node [i-1] with size ");
-            unsigned long s1=(unsigned long)pool_mgr->gap_ix[i-1].size;
-            unsigned long s2=(unsigned long)pool_mgr->gap_ix[i].size;
-            printf("%lu",s1);
-            printf("and node [i] with size ");
-            printf("%lu",s2);
-            printf("\n");
-             */
-            struct _gap temp = pool_mgr->gap_ix[i - 1];
-            pool_mgr->gap_ix[i - 1] = pool_mgr->gap_ix[i];
-            pool_mgr->gap_ix[i] = temp;
-        }
-    }
-    // loop from num_gaps - 1 until but not including 0:
-    //    if the size of the current entry is less than the previous (u - 1)
-    //    or if the sizes are the same but the current entry points to a
-    //    node with a lower address of pool allocation address (mem)
-    //       swap them (by copying) (remember to use a temporary variable)
+    // everything allocated since the mark goes at once
+    mgr->linear_offset = mark.offset;
+    _mem_linear_release(mgr, mark.offset);
+    mgr->pool.alloc_size = mark.alloc_size;
+    mgr->pool.num_allocs = mark.num_allocs;
+    mgr->pool.num_gaps = (mgr->linear_offset < pool->total_size) ? 1 : 0;
 
     return ALLOC_OK;
 }
 
-static alloc_status _mem_invalidate_gap_ix(pool_mgr_pt pool_mgr) {
-    return ALLOC_FAIL;
-}
-
+void *mem_cache_alloc(pool_pt pool, size_t size) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    // small sizes only, rounded up to their size class
+    unsigned bucket = (unsigned) ((size - 1) >> MEM_CACHE_CLASS_SHIFT);
+    if ((size == 0) || (bucket >= MEM_CACHE_BUCKETS)) {
+        return mem_new_alloc(pool, size);
+    }
+    size_t class_size = (size_t) (bucket + 1) << MEM_CACHE_CLASS_SHIFT;
+    pool_cache_pt cache = _mem_thread_cache(mgr, 1);
+    if (cache == NULL) {
+        return mem_new_alloc(pool, class_size);
+    }
+
+    // refill an empty bucket with a batch, as far as the byte cap allows
+    if (cache->count[bucket] == 0) {
+        size_t sizes[MEM_CACHE_BATCH];
+        unsigned n = (unsigned) MEM_MAX((MEM_CACHE_MAX_BYTES - cache->bytes) / class_size, 1);
+        n = (n < MEM_CACHE_BATCH) ? n : MEM_CACHE_BATCH;
+        for (unsigned i = 0; i < n; ++i) {
+            sizes[i] = class_size;
+        }
+        if (mem_new_alloc_batch(pool, sizes, n, cache->blocks[bucket]) != ALLOC_OK) {
+            // not room for a batch, maybe for one
+            return mem_new_alloc(pool, class_size);
+        }
+        cache->count[bucket] = n;
+        cache->bytes += n * class_size;
+    }
+
+    cache->bytes -= class_size;
+    void *alloc = cache->blocks[bucket][--cache->count[bucket]];
+    _mem_cache_unmark(mgr, alloc);
+
+    return alloc;
+}
+
+alloc_status mem_cache_free(pool_pt pool, void *alloc) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+    // the handle is checked as the pool would, and the block marked cached
+    // at once, so that freeing it again fails until it is handed out again
+    size_t size;
+    if (_mem_cache_mark(mgr, alloc, &size) != ALLOC_OK) {
+        return ALLOC_FAIL;
+    }
+    unsigned bucket = (unsigned) ((size - 1) >> MEM_CACHE_CLASS_SHIFT);
+    pool_cache_pt cache = NULL;
+    if ((size > 0) && !(size & (((size_t) 1 << MEM_CACHE_CLASS_SHIFT) - 1)) && (bucket < MEM_CACHE_BUCKETS)) {
+        cache = _mem_thread_cache(mgr, 1);
+    }
+
+    // flush the oldest batch of a full bucket, or of one that would take
+    // the cache over its byte cap
+    if ((cache != NULL) &&
+        ((cache->count[bucket] == MEM_CACHE_BUCKET_CAP) || (cache->bytes + size > MEM_CACHE_MAX_BYTES))) {
+        _mem_cache_drain(cache, bucket, MEM_CACHE_BATCH);
+    }
+    if ((cache == NULL) || (cache->bytes + size > MEM_CACHE_MAX_BYTES)) {
+        _mem_cache_unmark(mgr, alloc);
+        return mem_del_alloc(pool, alloc);
+    }
+    cache->blocks[bucket][cache->count[bucket]++] = alloc;
+    cache->bytes += size;
+
+    return ALLOC_OK;
+}
+
+alloc_status mem_cache_flush(pool_pt pool) {
+    // give back everything this thread holds for the pool, e.g. before it
+    // goes idle; a pool cannot be closed while any thread holds blocks
+    pool_cache_pt cache = _mem_thread_cache((pool_mgr_pt) pool, 0);
+    if (cache == NULL) {
+        return ALLOC_OK;
+    }
+    for (unsigned k = 0; k < MEM_CACHE_BUCKETS; ++k) {
+        _mem_cache_drain(cache, k, cache->count[k]);
+    }
+    for (unsigned i = 0; i < MEM_CACHE_POOLS; ++i) {
+        if (thread_caches[i] == cache) {
+            _mem_cache_release(i);
+        }
+    }
+
+    return ALLOC_OK;
+}
+
+void mem_bitmap_scan_mode(bitmap_scan mode) {
+    bitmap_scan_mode = mode;
+}
+
+void mem_pool_stats(pool_pt pool, pool_stats_pt stats) {
+    // get the mgr from the pool
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    // a thread-safe pool sums its stripes, one at a time
+    if (mgr->num_stripes > 0) {
+        pool_stats_t stripe;
+        memset(stats, 0, sizeof(pool_stats_t));
+        for (unsigned k = 0; k < mgr->num_stripes; ++k) {
+            pthread_mutex_lock(&mgr->stripe_locks[k]);
+            mem_pool_stats((pool_pt) mgr->stripes[k], &stripe);
+            pthread_mutex_unlock(&mgr->stripe_locks[k]);
+            stats->total_nodes += stripe.total_nodes;
+            stats->used_nodes += stripe.used_nodes;
+            stats->unused_node_hits += stripe.unused_node_hits;
+            stats->node_heap_grows += stripe.node_heap_grows;
+            stats->size_class_hits += stripe.size_class_hits;
+            stats->size_class_splits += stripe.size_class_splits;
+            stats->size_class_misses += stripe.size_class_misses;
+            stats->remote_frees += stripe.remote_frees;
+            stats->remote_drains += stripe.remote_drains;
+            stats->remote_drain_ns += stripe.remote_drain_ns;
+            stats->remote_depth += stripe.remote_depth;
+            stats->remote_max_drain = MEM_MAX(stats->remote_max_drain, stripe.remote_max_drain);
+        }
+        stats->backing = mgr->backing;
+        return;
+    }
+
+    stats->total_nodes = mgr->total_nodes;
+    stats->used_nodes = mgr->used_nodes;
+    stats->unused_node_hits = mgr->unused_hits;
+    stats->node_heap_grows = mgr->heap_grows;
+    stats->size_class_hits = mgr->class_hits;
+    stats->size_class_splits = mgr->class_splits;
+    stats->size_class_misses = mgr->class_misses;
+    stats->remote_frees = atomic_load(&mgr->remote_frees);
+    stats->remote_drains = mgr->remote_drains;
+    stats->remote_drain_ns = mgr->remote_drain_ns;
+    stats->remote_depth = atomic_load(&mgr->remote_depth);
+    stats->remote_max_drain = mgr->remote_max_drain;
+    stats->backing = mgr->backing;
+}
+
+void mem_inspect_pool(pool_pt pool,
+                      pool_segment_pt *segments,
+                      unsigned *num_segments) {
+    // get the mgr from the pool
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    // a thread-safe pool reports its stripes one after the other
+    if (mgr->num_stripes > 0) {
+        _mem_striped_inspect(mgr, segments, num_segments);
+        return;
+    }
+    // a BUDDY pool reports its blocks in address order
+    if (pool->policy == BUDDY) {
+        _mem_buddy_inspect(mgr, segments, num_segments);
+        return;
+    }
+    // a FIXED_SIZE pool reports each object, with runs of free slots merged
+    if (pool->policy == FIXED_SIZE) {
+        _mem_fixed_inspect(mgr, segments, num_segments);
+        return;
+    }
+    // a LINEAR pool cannot tell its allocations apart: one segment for
+    // all of them, and the gap after the bump pointer
+    if (pool->policy == LINEAR) {
+        pool_segment_pt segs = malloc(sizeof(struct _pool_segment) * 2);
+        unsigned count = 0;
+        assert(segs != NULL);
+        if (mgr->linear_offset > 0) {
+            segs[count].size = mgr->linear_offset;
+            segs[count++].allocated = 1;
+        }
+        if (mgr->linear_offset < pool->total_size) {
+            segs[count].size = pool->total_size - mgr->linear_offset;
+            segs[count++].allocated = 0;
+        }
+        *segments = segs;
+        *num_segments = count;
+        return;
+    }
+    // and a BITMAP_FIT pool each allocation, with runs of free granules merged
+    if (pool->policy == BITMAP_FIT) {
+        _mem_bitmap_inspect(mgr, segments, num_segments);
+        return;
+    }
+
+    pool_segment_pt segs = malloc(sizeof(struct _pool_segment) * mgr->used_nodes);
+    assert(segs != NULL);
+    // allocate the segments array with size == used_nodes
+    // check successful
+    // loop through the node heap and the segments array
+    node_pt cur_node = mgr->node_heap;
+    int index = 0;
+
+    while (cur_node->used) {
+        segs[index].size = cur_node->alloc_record.size;
+        segs[index].allocated = (cur_node->allocated != 0);
+        if (cur_node->next == NULL) { break; }
+        cur_node = cur_node->next;
+        index++;
+
+    }
+    //    for each node, write the size and allocated in the segment
+    // "return" the values:
+
+    *segments = segs;
+    *num_segments = mgr->used_nodes;
+
+}
+
+
+
+/***********************************/
+/*                                 */
+/* Definitions of static functions */
+/*                                 */
+/***********************************/
+static alloc_status _mem_pool_init(pool_mgr_pt pool_mgr, size_t size, alloc_policy policy, size_t alignment) {
+    // everything but the memory itself, which pool_mgr->pool.mem holds already
+    // allocate a new node heap: the chunk directory and the first chunk
+    pool_mgr->node_chunks = malloc(sizeof(node_pt) * MEM_NODE_DIR_INIT_CAPACITY);
+    pool_mgr->node_dir_capacity = MEM_NODE_DIR_INIT_CAPACITY;
+    pool_mgr->num_outgrown_dirs = 0;
+    pool_mgr->num_chunks = 0;
+    pool_mgr->total_nodes = 0;
+    pool_mgr->used_nodes = 0;
+    pool_mgr->unused_head = MEM_NODE_NONE;
+    // the salts of pools opened one after another are far apart, by the
+    // golden ratio, so that their handles differ however the generations go
+    pool_mgr->handle_salt = (atomic_fetch_add(&handle_salts, 1) + 1) * 2654435769u;
+    // check success, on error deallocate mgr/pool and return null
+    if (!pool_mgr->node_chunks || _mem_add_node_chunk(pool_mgr) != ALLOC_OK) {
+        free(pool_mgr->node_chunks);
+        return ALLOC_FAIL;
+    }
+    // assign all the pointers and update meta data:
+    pool_mgr->pool.policy = policy;
+    pool_mgr->pool.total_size = size;
+    pool_mgr->pool.alloc_size = 0;
+    pool_mgr->pool.num_allocs = 0;
+    pool_mgr->pool.num_gaps = 0;
+    pool_mgr->gap_ix = NULL;
+    for (int i = 0; i < MEM_SIZE_CLASSES; ++i) {
+        pool_mgr->size_classes[i] = NULL;
+    }
+    pool_mgr->size_class_mask = 0;
+    pool_mgr->class_hits = 0;
+    pool_mgr->class_splits = 0;
+    pool_mgr->class_misses = 0;
+    pool_mgr->buddy_map = NULL;
+    pool_mgr->tlsf = NULL;
+    pool_mgr->fixed_map = NULL;
+    pool_mgr->fixed_lf_next = NULL;
+    pool_mgr->fixed_lock_free = 0;
+    pool_mgr->bitmap_used = NULL;
+    pool_mgr->bitmap_start = NULL;
+    pool_mgr->alignment = alignment;
+    pool_mgr->stripes = NULL;
+    pool_mgr->stripe_locks = NULL;
+    pool_mgr->num_stripes = 0;
+    pool_mgr->stripe_index = 0;
+    pool_mgr->stripe_size = 0;
+    atomic_init(&pool_mgr->remote_head, NULL);
+    atomic_init(&pool_mgr->remote_depth, 0);
+    atomic_init(&pool_mgr->remote_frees, 0);
+    pool_mgr->remote_drains = 0;
+    pool_mgr->remote_drain_ns = 0;
+    pool_mgr->remote_max_drain = 0;
+    pool_mgr->linear_offset = 0;
+    pool_mgr->linear_epoch = 0;
+    pool_mgr->linear_floor = 0;
+    pool_mgr->linear_num_releases = 0;
+    if (policy == TLSF) {
+        pool_mgr->tlsf = calloc(1, sizeof(tlsf_index_t));
+        if (pool_mgr->tlsf == NULL) {
+            free(pool_mgr->node_chunks[0]);
+            free(pool_mgr->node_chunks);
+            return ALLOC_FAIL;
+        }
+    }
+
+    if (policy == BUDDY) {
+        // a buddy pool has no segment list, nodes only hold allocation records
+        pool_mgr->node_heap = NULL;
+        pool_mgr->next_fit_cursor = NULL;
+        if (_mem_buddy_init(pool_mgr) != ALLOC_OK) {
+            free(pool_mgr->node_chunks[0]);
+            free(pool_mgr->node_chunks);
+            return ALLOC_FAIL;
+        }
+    } else if (policy == LINEAR) {
+        // a linear pool keeps no nodes at all, only the bump pointer
+        pool_mgr->node_heap = NULL;
+        pool_mgr->next_fit_cursor = NULL;
+        pool_mgr->pool.num_gaps = 1;
+    } else if (policy == BITMAP_FIT) {
+        // same for a bitmap pool, the bitmap is the segment list
+        pool_mgr->node_heap = NULL;
+        pool_mgr->next_fit_cursor = NULL;
+        if (_mem_bitmap_init(pool_mgr) != ALLOC_OK) {
+            free(pool_mgr->node_chunks[0]);
+            free(pool_mgr->node_chunks);
+            return ALLOC_FAIL;
+        }
+    } else {
+        //   initialize top node of node heap (the first unused node)
+        pool_mgr->node_heap = _mem_get_unused_node(pool_mgr);
+        pool_mgr->node_heap->allocated = 0;
+        pool_mgr->node_heap->alloc_record.mem = pool_mgr->pool.mem;
+        pool_mgr->node_heap->alloc_record.size = size;
+        pool_mgr->node_heap->prev = NULL;
+        pool_mgr->node_heap->next = NULL;
+        pool_mgr->next_fit_cursor = pool_mgr->node_heap;
+        //   initialize the gap index with the top node as its only entry
+        _mem_add_to_gap_ix(pool_mgr, size, pool_mgr->node_heap);
+    }
+    pool_mgr->unused_hits = 0;
+    pool_mgr->heap_grows = 0;
+
+    return ALLOC_OK;
+}
+
+static alloc_status
+_mem_stripes_init(pool_mgr_pt pool_mgr, size_t size, alloc_policy policy, size_t alignment, unsigned stripes) {
+    // no node heap and no engine of its own: only the pool_t counters, the
+    // stripes and their locks; _mem_free_pool_mgr must find nothing else
+    pool_mgr->pool.policy = policy;
+    pool_mgr->pool.total_size = size;
+    pool_mgr->pool.alloc_size = 0;
+    pool_mgr->pool.num_allocs = 0;
+    pool_mgr->pool.num_gaps = 0;
+    pool_mgr->node_heap = NULL;
+    pool_mgr->node_chunks = NULL;
+    pool_mgr->num_chunks = 0;
+    pool_mgr->num_outgrown_dirs = 0;
+    pool_mgr->total_nodes = 0;
+    pool_mgr->used_nodes = 0;
+    pool_mgr->buddy_map = NULL;
+    pool_mgr->tlsf = NULL;
+    pool_mgr->fixed_map = NULL;
+    pool_mgr->fixed_lf_next = NULL;
+    pool_mgr->fixed_lock_free = 0;
+    pool_mgr->bitmap_used = NULL;
+    pool_mgr->bitmap_start = NULL;
+    pool_mgr->alignment = alignment;
+    pool_mgr->linear_offset = 0;
+    pool_mgr->linear_epoch = 0;
+    pool_mgr->linear_floor = 0;
+    pool_mgr->linear_num_releases = 0;
+    pool_mgr->num_stripes = 0;
+    pool_mgr->stripe_index = 0;
+    pool_mgr->stripe_size = (size / stripes) & ~(MEM_PAGE_SIZE - 1);
+    pool_mgr->stripe_per_cpu = 0;
+    pool_mgr->stripes = calloc(stripes, sizeof(pool_mgr_pt));
+    pool_mgr->stripe_locks = malloc(stripes * sizeof(pthread_mutex_t));
+    if (!pool_mgr->stripes || !pool_mgr->stripe_locks ||
+        (pthread_mutex_init(&pool_mgr->stats_lock, NULL) != 0)) {
+        free(pool_mgr->stripes);
+        free(pool_mgr->stripe_locks);
+        return ALLOC_FAIL;
+    }
+
+    // each stripe is an ordinary pool over its own slice of the memory
+    for (unsigned k = 0; k < stripes; ++k) {
+        size_t stripe_size = (k + 1 < stripes) ? pool_mgr->stripe_size : size - k * pool_mgr->stripe_size;
+        pool_mgr_pt stripe = malloc(sizeof(struct _pool_mgr));
+        if (stripe != NULL) {
+            stripe->pool.mem = pool_mgr->pool.mem + k * pool_mgr->stripe_size;
+            stripe->backing = pool_mgr->backing;
+            stripe->map_base = NULL;
+            stripe->map_size = 0;
+            stripe->file_fd = -1;
+        }
+        if ((stripe == NULL) || (_mem_pool_init(stripe, stripe_size, policy, alignment) != ALLOC_OK)) {
+            free(stripe);
+            _mem_stripes_free(pool_mgr);
+            return ALLOC_FAIL;
+        }
+        if (pthread_mutex_init(&pool_mgr->stripe_locks[k], NULL) != 0) {
+            stripe->pool.mem = NULL;
+            _mem_free_pool_mgr(stripe);
+            _mem_stripes_free(pool_mgr);
+            return ALLOC_FAIL;
+        }
+        stripe->stripe_index = k;
+        pool_mgr->stripes[k] = stripe;
+        pool_mgr->num_stripes++;
+        pool_mgr->pool.num_gaps += stripe->pool.num_gaps;
+    }
+
+    return ALLOC_OK;
+}
+
+static void _mem_stripes_free(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->stripes == NULL) {
+        return;
+    }
+    // the memory belongs to the whole pool, not to the stripe
+    for (unsigned k = 0; k < pool_mgr->num_stripes; ++k) {
+        pool_mgr->stripes[k]->pool.mem = NULL;
+        _mem_free_pool_mgr(pool_mgr->stripes[k]);
+        pthread_mutex_destroy(&pool_mgr->stripe_locks[k]);
+    }
+    pthread_mutex_destroy(&pool_mgr->stats_lock);
+    free(pool_mgr->stripes);
+    free(pool_mgr->stripe_locks);
+    pool_mgr->stripes = NULL;
+    pool_mgr->stripe_locks = NULL;
+    pool_mgr->num_stripes = 0;
+}
+
+static pool_mgr_pt _mem_stripe_of(pool_mgr_pt pool_mgr, void *alloc, unsigned *stripe) {
+    // by the stripe the handle says, without reading the node; whether the
+    // handle really belongs to that stripe is for the stripe to say, under
+    // its lock
+    unsigned k = (unsigned) ((uintptr_t) alloc >> MEM_HANDLE_INDEX_BITS) & ((1u << MEM_HANDLE_STRIPE_BITS) - 1);
+    if ((alloc == NULL) || (k >= pool_mgr->num_stripes)) {
+        return NULL;
+    }
+    *stripe = k;
+
+    return pool_mgr->stripes[k];
+}
+
+static void _mem_stripe_sync(pool_mgr_pt pool_mgr, const pool_t *before, const pool_t *after) {
+    // add what an operation did to a stripe to the whole pool; unsigned
+    // arithmetic makes a decrease come out right too
+    pthread_mutex_lock(&pool_mgr->stats_lock);
+    pool_mgr->pool.alloc_size += after->alloc_size - before->alloc_size;
+    pool_mgr->pool.num_allocs += after->num_allocs - before->num_allocs;
+    pool_mgr->pool.num_gaps += after->num_gaps - before->num_gaps;
+    pthread_mutex_unlock(&pool_mgr->stats_lock);
+}
+
+static void _mem_stripes_lock(pool_mgr_pt pool_mgr) {
+    for (unsigned k = 0; k < pool_mgr->num_stripes; ++k) {
+        pthread_mutex_lock(&pool_mgr->stripe_locks[k]);
+    }
+}
+
+static void _mem_stripes_unlock(pool_mgr_pt pool_mgr) {
+    for (unsigned k = pool_mgr->num_stripes; k-- > 0;) {
+        pthread_mutex_unlock(&pool_mgr->stripe_locks[k]);
+    }
+}
+
+static unsigned _mem_stripe_home(pool_mgr_pt pool_mgr) {
+    // the CPU's own shard for a sharded pool, where the CPU is known, else
+    // a stripe per thread, so that threads spread out over the pool
+#if defined(__linux__)
+    if (pool_mgr->stripe_per_cpu) {
+        int cpu = sched_getcpu();
+        if (cpu >= 0) {
+            return (unsigned) cpu;
+        }
+    }
+#endif
+    if (stripe_home == 0) {
+        stripe_home = atomic_fetch_add(&stripe_threads, 1) + 1;
+    }
+    return stripe_home - 1;
+}
+
+static void _mem_stripe_drain(pool_mgr_pt pool_mgr, unsigned stripe) {
+    // under the stripe's lock: take the whole queue at once, so there is
+    // no ABA to guard against, and free it in batches
+    pool_mgr_pt owner = pool_mgr->stripes[stripe];
+    node_pt node = atomic_exchange_explicit(&owner->remote_head, NULL, memory_order_acquire);
+    if (node == NULL) {
+        return;
+    }
+    struct timespec start, end;
+    timespec_get(&start, TIME_UTC);
+    pool_t before = owner->pool;
+    void *batch[MEM_REMOTE_BATCH];
+    unsigned drained = 0;
+    while (node != NULL) {
+        // each was claimed when queued, and nothing else takes a queued
+        // node, so the batch is good
+        unsigned n = 0;
+        while ((node != NULL) && (n < MEM_REMOTE_BATCH)) {
+            node->allocated = MEM_NODE_FREEING;
+            batch[n++] = _mem_handle(owner, node);
+            node = node->remote_next;
+        }
+        _mem_free_claimed(owner, batch, n);
+        drained += n;
+    }
+    _mem_stripe_sync(pool_mgr, &before, &owner->pool);
+    atomic_fetch_sub(&owner->remote_depth, drained);
+    timespec_get(&end, TIME_UTC);
+
+    owner->remote_drains++;
+    owner->remote_drain_ns += (unsigned long) ((end.tv_sec - start.tv_sec) * 1000000000L +
+                                               (end.tv_nsec - start.tv_nsec));
+    owner->remote_max_drain = MEM_MAX(owner->remote_max_drain, drained);
+}
+
+static void *_mem_striped_alloc(pool_mgr_pt pool_mgr, size_t size, size_t alignment) {
+    // start at the home stripe and, while they are full, try its
+    // neighbours, nearest first: home, +1, -1, +2, -2, ...; stripes never
+    // merge, so a request larger than any of them fails in all
+    unsigned home = _mem_stripe_home(pool_mgr);
+    for (unsigned i = 0; i < pool_mgr->num_stripes; ++i) {
+        unsigned distance = (i + 1) / 2;
+        unsigned k = ((i % 2) ? home + distance : home - distance) & (pool_mgr->num_stripes - 1);
+        pool_mgr_pt stripe = pool_mgr->stripes[k];
+
+        pthread_mutex_lock(&pool_mgr->stripe_locks[k]);
+        _mem_stripe_drain(pool_mgr, k);
+        pool_t before = stripe->pool;
+        void *alloc = _mem_new_alloc(stripe, size, alignment);
+        pool_t after = stripe->pool;
+        pthread_mutex_unlock(&pool_mgr->stripe_locks[k]);
+
+        if (alloc != NULL) {
+            _mem_stripe_sync(pool_mgr, &before, &after);
+            return alloc;
+        }
+    }
+
+    return NULL;
+}
+
+static alloc_status _mem_striped_free(pool_mgr_pt pool_mgr, void *alloc) {
+    unsigned k;
+    pool_mgr_pt stripe = _mem_stripe_of(pool_mgr, alloc, &k);
+    if (stripe == NULL) {
+        return ALLOC_FAIL;
+    }
+
+    // a free from a thread at home elsewhere goes on the stripe's queue,
+    // for whoever locks the stripe next to do the freeing, with no lock
+    // taken here; the handle is claimed first, so that a stale or repeated
+    // one is refused, and a queued node is not an allocation any more
+    if (k != (_mem_stripe_home(pool_mgr) & (pool_mgr->num_stripes - 1))) {
+        node_pt node = _mem_node_claim(stripe, alloc, MEM_NODE_QUEUED);
+        if (node == NULL) {
+            return ALLOC_FAIL;
+        }
+        node_pt head = atomic_load_explicit(&stripe->remote_head, memory_order_relaxed);
+        do {
+            node->remote_next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&stripe->remote_head, &head, node,
+                                                        memory_order_release, memory_order_relaxed));
+        atomic_fetch_add_explicit(&stripe->remote_frees, 1, memory_order_relaxed);
+        // and if the owner is slow to come back, drain it here, if free
+        if ((atomic_fetch_add(&stripe->remote_depth, 1) + 1 >= MEM_REMOTE_MAX_DEPTH) &&
+            (pthread_mutex_trylock(&pool_mgr->stripe_locks[k]) == 0)) {
+            _mem_stripe_drain(pool_mgr, k);
+            pthread_mutex_unlock(&pool_mgr->stripe_locks[k]);
+        }
+        return ALLOC_OK;
+    }
+
+    pthread_mutex_lock(&pool_mgr->stripe_locks[k]);
+    _mem_stripe_drain(pool_mgr, k);
+    pool_t before = stripe->pool;
+    alloc_status status = mem_del_alloc((pool_pt) stripe, alloc);
+    pool_t after = stripe->pool;
+    pthread_mutex_unlock(&pool_mgr->stripe_locks[k]);
+
+    if (status == ALLOC_OK) {
+        _mem_stripe_sync(pool_mgr, &before, &after);
+    }
+
+    return status;
+}
+
+static alloc_status _mem_striped_alloc_batch(pool_mgr_pt pool_mgr, const size_t sizes[], unsigned n, void *out[]) {
+    // one at a time, each from whichever stripe has room, all or nothing
+    for (unsigned i = 0; i < n; ++i) {
+        out[i] = _mem_striped_alloc(pool_mgr, sizes[i], 1);
+        if (out[i] == NULL) {
+            for (unsigned j = 0; j < i; ++j) {
+                _mem_striped_free(pool_mgr, out[j]);
+                out[j] = NULL;
+            }
+            return ALLOC_FAIL;
+        }
+    }
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_striped_free_batch(pool_mgr_pt pool_mgr, void *allocs[], unsigned n) {
+    // the handles of one stripe go to it as a batch of their own
+    void **group = malloc(sizeof(void *) * (n ? n : 1));
+    if (group == NULL) {
+        return ALLOC_FAIL;
+    }
+    _mem_stripes_lock(pool_mgr);
+    for (unsigned k = 0; k < pool_mgr->num_stripes; ++k) {
+        _mem_stripe_drain(pool_mgr, k);
+    }
+
+    // validate the whole batch across the stripes first, as for one pool
+    for (unsigned i = 0; i < n; ++i) {
+        unsigned k;
+        pool_mgr_pt stripe = _mem_stripe_of(pool_mgr, allocs[i], &k);
+        if ((stripe == NULL) || (_mem_node_claim(stripe, allocs[i], MEM_NODE_FREEING) == NULL)) {
+            for (unsigned j = 0; j < i; ++j) {
+                _mem_handle_node(pool_mgr, allocs[j])->allocated = 1;
+            }
+            _mem_stripes_unlock(pool_mgr);
+            free(group);
+            return ALLOC_FAIL;
+        }
+    }
+
+    for (unsigned k = 0; k < pool_mgr->num_stripes; ++k) {
+        pool_mgr_pt stripe = pool_mgr->stripes[k];
+        unsigned count = 0;
+        for (unsigned i = 0; i < n; ++i) {
+            unsigned owner;
+            _mem_stripe_of(pool_mgr, allocs[i], &owner);
+            if (owner == k) {
+                group[count++] = allocs[i];
+            }
+        }
+        if (count > 0) {
+            pool_t before = stripe->pool;
+            _mem_free_claimed(stripe, group, count);
+            _mem_stripe_sync(pool_mgr, &before, &stripe->pool);
+        }
+    }
+
+    _mem_stripes_unlock(pool_mgr);
+    free(group);
+
+    return ALLOC_OK;
+}
+
+static void *_mem_striped_realloc(pool_mgr_pt pool_mgr, void *alloc, size_t new_size) {
+    unsigned k;
+    pool_mgr_pt stripe = _mem_stripe_of(pool_mgr, alloc, &k);
+    if (stripe == NULL) {
+        return NULL;
+    }
+
+    // in place, within the stripe
+    pthread_mutex_lock(&pool_mgr->stripe_locks[k]);
+    _mem_stripe_drain(pool_mgr, k);
+    node_pt node = _mem_node_from_handle(stripe, alloc);
+    if (node == NULL) {
+        pthread_mutex_unlock(&pool_mgr->stripe_locks[k]);
+        return NULL;
+    }
+    pool_t before = stripe->pool;
+    if (_mem_resize_in_place(stripe, node, new_size) == ALLOC_OK) {
+        pool_t after = stripe->pool;
+        pthread_mutex_unlock(&pool_mgr->stripe_locks[k]);
+        _mem_stripe_sync(pool_mgr, &before, &after);
+        return alloc;
+    }
+    pthread_mutex_unlock(&pool_mgr->stripe_locks[k]);
+
+    // else move, to any stripe; the old allocation is still the caller's,
+    // so its record and contents hold still without the lock
+    void *moved = _mem_striped_alloc(pool_mgr, new_size, 1);
+    if (moved == NULL) {
+        return NULL;
+    }
+    size_t keep = (new_size < node->alloc_record.size) ? new_size : node->alloc_record.size;
+    memcpy(_mem_handle_node(pool_mgr, moved)->alloc_record.mem, node->alloc_record.mem, keep);
+    alloc_status status = _mem_striped_free(pool_mgr, alloc);
+    assert(status == ALLOC_OK);
+    (void) status;
+
+    return moved;
+}
+
+static void _mem_striped_reset(pool_mgr_pt pool_mgr) {
+    _mem_stripes_lock(pool_mgr);
+    pthread_mutex_lock(&pool_mgr->stats_lock);
+    pool_mgr->pool.alloc_size = 0;
+    pool_mgr->pool.num_allocs = 0;
+    pool_mgr->pool.num_gaps = 0;
+    for (unsigned k = 0; k < pool_mgr->num_stripes; ++k) {
+        // queued frees are of allocations the reset takes anyway
+        atomic_store(&pool_mgr->stripes[k]->remote_head, NULL);
+        atomic_store(&pool_mgr->stripes[k]->remote_depth, 0);
+        mem_pool_reset((pool_pt) pool_mgr->stripes[k]);
+        pool_mgr->pool.num_gaps += pool_mgr->stripes[k]->pool.num_gaps;
+    }
+    pthread_mutex_unlock(&pool_mgr->stats_lock);
+    _mem_stripes_unlock(pool_mgr);
+}
+
+static void _mem_striped_inspect(pool_mgr_pt pool_mgr, pool_segment_pt *segments, unsigned *num_segments) {
+    // a gap at the end of a stripe and one at the start of the next stay
+    // two segments, as they never merge
+    pool_segment_pt parts[MEM_MAX_STRIPES];
+    unsigned counts[MEM_MAX_STRIPES];
+    unsigned total = 0;
+
+    _mem_stripes_lock(pool_mgr);
+    for (unsigned k = 0; k < pool_mgr->num_stripes; ++k) {
+        _mem_stripe_drain(pool_mgr, k);
+        mem_inspect_pool((pool_pt) pool_mgr->stripes[k], &parts[k], &counts[k]);
+        total += counts[k];
+    }
+    _mem_stripes_unlock(pool_mgr);
+
+    pool_segment_pt segs = malloc(sizeof(struct _pool_segment) * (total ? total : 1));
+    assert(segs != NULL);
+    unsigned index = 0;
+    for (unsigned k = 0; k < pool_mgr->num_stripes; ++k) {
+        memcpy(segs + index, parts[k], sizeof(struct _pool_segment) * counts[k]);
+        index += counts[k];
+        free(parts[k]);
+    }
+
+    *segments = segs;
+    *num_segments = total;
+}
+
+static pool_cache_pt _mem_thread_cache(pool_mgr_pt pool_mgr, int create) {
+    // a cache whose pool has since been reset or closed holds nothing the
+    // pool knows about: drop it, with no need to touch the pool
+    unsigned long epoch = atomic_load_explicit(&pool_mgr->epoch, memory_order_acquire);
+    int empty = -1;
+    for (unsigned i = 0; i < MEM_CACHE_POOLS; ++i) {
+        pool_cache_pt cache = thread_caches[i];
+        if ((cache != NULL) && (cache->pool == pool_mgr)) {
+            if (cache->epoch == epoch) {
+                return cache;
+            }
+            _mem_cache_release(i);
+        }
+        if ((thread_caches[i] == NULL) && (empty < 0)) {
+            empty = (int) i;
+        }
+    }
+    // when all are taken, make room by dropping caches of pools since closed
+    for (unsigned i = 0; create && (empty < 0) && (i < MEM_CACHE_POOLS); ++i) {
+        if (_mem_pool_store_find(thread_caches[i]->pool) == NULL) {
+            _mem_cache_release(i);
+            empty = (int) i;
+        }
+    }
+    if (!create || (empty < 0)) {
+        return NULL;
+    }
+
+    // the thread's first cache also arranges for the caches to be flushed
+    // when the thread exits
+    pthread_once(&thread_cache_once, _mem_thread_cache_key);
+    pool_cache_pt cache = calloc(1, sizeof(pool_cache_t));
+    if ((cache == NULL) || (pthread_setspecific(thread_cache_key, thread_caches) != 0)) {
+        free(cache);
+        return NULL;
+    }
+    cache->pool = pool_mgr;
+    cache->epoch = epoch;
+    thread_caches[empty] = cache;
+
+    return cache;
+}
+
+static void _mem_cache_drain(pool_cache_pt cache, unsigned bucket, unsigned count) {
+    // the oldest blocks go back as one batch; if any handle is bad the
+    // batch frees nothing, so then each goes on its own and bad ones drop
+    void **blocks = cache->blocks[bucket];
+    unsigned n = (count < cache->count[bucket]) ? count : cache->count[bucket];
+    if (n == 0) {
+        return;
+    }
+    for (unsigned i = 0; i < n; ++i) {
+        _mem_cache_unmark(cache->pool, blocks[i]);
+    }
+    if (mem_del_alloc_batch((pool_pt) cache->pool, blocks, n) != ALLOC_OK) {
+        for (unsigned i = 0; i < n; ++i) {
+            mem_del_alloc((pool_pt) cache->pool, blocks[i]);
+        }
+    }
+    memmove(blocks, blocks + n, (cache->count[bucket] - n) * sizeof(void *));
+    cache->count[bucket] -= n;
+    cache->bytes -= n * ((size_t) (bucket + 1) << MEM_CACHE_CLASS_SHIFT);
+}
+
+// a block going into a cache: a live allocation of the pool, claimed as
+// cached with a CAS, so that no lock is taken on the way in
+static alloc_status _mem_cache_mark(pool_mgr_pt pool_mgr, void *alloc, size_t *size) {
+    unsigned k = 0;
+    pool_mgr_pt owner = (pool_mgr->num_stripes > 0) ? _mem_stripe_of(pool_mgr, alloc, &k) : pool_mgr;
+    node_pt node = (owner != NULL) ? _mem_node_claim(owner, alloc, MEM_NODE_CACHED) : NULL;
+    if (node == NULL) {
+        return ALLOC_FAIL;
+    }
+    *size = node->alloc_record.size;
+
+    return ALLOC_OK;
+}
+
+// a block coming out of a cache, to the caller or back to the pool: an
+// allocation again, by the same CAS the other way; blocks from a refill
+// were never marked, and are left as they are
+static void _mem_cache_unmark(pool_mgr_pt pool_mgr, void *alloc) {
+    node_pt node = _mem_handle_node(pool_mgr, alloc);
+    unsigned cached = MEM_NODE_CACHED;
+    atomic_compare_exchange_strong(&node->allocated, &cached, 1);
+}
+
+static void _mem_cache_release(unsigned slot) {
+    free(thread_caches[slot]);
+    thread_caches[slot] = NULL;
+}
+
+static void _mem_thread_cache_key() {
+    pthread_key_create(&thread_cache_key, _mem_thread_cache_exit);
+}
+
+static void _mem_thread_cache_exit(void *caches) {
+    // flush what the exiting thread holds to pools still open in the same
+    // epoch; the pool store says which are still open without touching them
+    (void) caches;
+    for (unsigned i = 0; i < MEM_CACHE_POOLS; ++i) {
+        pool_cache_pt cache = thread_caches[i];
+        if (cache == NULL) {
+            continue;
+        }
+        if (atomic_load(&pool_store_ready) && (_mem_pool_store_find(cache->pool) != NULL) &&
+            (atomic_load(&cache->pool->epoch) == cache->epoch)) {
+            for (unsigned k = 0; k < MEM_CACHE_BUCKETS; ++k) {
+                _mem_cache_drain(cache, k, cache->count[k]);
+            }
+        }
+        _mem_cache_release(i);
+    }
+}
+
+static alloc_status _mem_pool_store_add(pool_mgr_pt pool_mgr) {
+    // claim the first empty slot, publishing the next segment when all are
+    // taken; of two threads publishing the same segment, the loser frees its own
+    size_t capacity = MEM_POOL_STORE_INIT_CAPACITY;
+    for (unsigned s = 0; s < MEM_POOL_STORE_SEGMENTS; ++s, capacity *= MEM_POOL_STORE_EXPAND_FACTOR) {
+        _Atomic(pool_mgr_pt) *segment = atomic_load(&pool_store[s]);
+        if (segment == NULL) {
+            _Atomic(pool_mgr_pt) *fresh = calloc(capacity, sizeof(*fresh));
+            if (fresh == NULL) {
+                return ALLOC_FAIL;
+            }
+            if (atomic_compare_exchange_strong(&pool_store[s], &segment, fresh)) {
+                segment = fresh;
+            } else {
+                free(fresh);
+            }
+        }
+        for (size_t i = 0; i < capacity; ++i) {
+            pool_mgr_pt expected = NULL;
+            if ((atomic_load_explicit(&segment[i], memory_order_relaxed) == NULL) &&
+                atomic_compare_exchange_strong(&segment[i], &expected, pool_mgr)) {
+                return ALLOC_OK;
+            }
+        }
+    }
+
+    return ALLOC_FAIL;
+}
+
+static _Atomic(pool_mgr_pt) *_mem_pool_store_find(pool_mgr_pt pool_mgr) {
+    // segments are published in order, the first missing one ends the walk
+    size_t capacity = MEM_POOL_STORE_INIT_CAPACITY;
+    for (unsigned s = 0; s < MEM_POOL_STORE_SEGMENTS; ++s, capacity *= MEM_POOL_STORE_EXPAND_FACTOR) {
+        _Atomic(pool_mgr_pt) *segment = atomic_load(&pool_store[s]);
+        if (segment == NULL) {
+            break;
+        }
+        for (size_t i = 0; i < capacity; ++i) {
+            if (atomic_load(&segment[i]) == pool_mgr) {
+                return &segment[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static alloc_status _mem_pool_map(pool_mgr_pt pool_mgr, size_t size, pool_backing backing) {
+    size_t pages = (size + MEM_PAGE_SIZE - 1) & ~(MEM_PAGE_SIZE - 1);
+
+    pool_mgr->pool.mem = NULL;
+    pool_mgr->map_base = NULL;
+    pool_mgr->map_size = 0;
+    pool_mgr->file_fd = -1;
+#if defined(__linux__)
+    size_t huge_pages = (size + MEM_HUGE_PAGE_SIZE - 1) & ~(MEM_HUGE_PAGE_SIZE - 1);
+#if defined(MAP_HUGETLB)
+    // reserved huge pages, if the system has any to spare; else as THP
+    if (backing == BACKING_HUGETLB) {
+        char *base = mmap(NULL, huge_pages, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) {
+            pool_mgr->map_base = pool_mgr->pool.mem = base;
+            pool_mgr->map_size = huge_pages;
+            pool_mgr->backing = BACKING_HUGETLB;
+            return ALLOC_OK;
+        }
+        backing = BACKING_THP;
+    }
+#endif
+    // transparent huge pages: a huge page aligned range the kernel is
+    // asked to back with huge pages; without THP, plain pages
+    if (backing >= BACKING_THP) {
+        size_t map_size = huge_pages + MEM_HUGE_PAGE_SIZE;
+        char *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return ALLOC_FAIL;
+        }
+        pool_mgr->map_base = base;
+        pool_mgr->map_size = map_size;
+        pool_mgr->pool.mem = base + _mem_align_pad(base, MEM_HUGE_PAGE_SIZE);
+        pool_mgr->backing = BACKING_MMAP;
+#if defined(MADV_HUGEPAGE)
+        if (madvise(pool_mgr->pool.mem, huge_pages, MADV_HUGEPAGE) == 0) {
+            pool_mgr->backing = BACKING_THP;
+        }
+#endif
+        return ALLOC_OK;
+    }
+    if (backing == BACKING_MMAP) {
+        char *base = mmap(NULL, pages, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return ALLOC_FAIL;
+        }
+        pool_mgr->map_base = pool_mgr->pool.mem = base;
+        pool_mgr->map_size = pages;
+        pool_mgr->backing = BACKING_MMAP;
+        return ALLOC_OK;
+    }
+#endif
+    // malloc, and every backing where there is no mmap
+    pool_mgr->pool.mem = aligned_alloc(MEM_PAGE_SIZE, pages);
+    pool_mgr->backing = BACKING_MALLOC;
+
+    return (pool_mgr->pool.mem != NULL) ? ALLOC_OK : ALLOC_FAIL;
+}
+
+static void _mem_pool_unmap(pool_mgr_pt pool_mgr) {
+#if defined(__linux__)
+    if (pool_mgr->file_fd >= 0) {
+        close(pool_mgr->file_fd);
+    }
+    if (pool_mgr->map_base != NULL) {
+        munmap(pool_mgr->map_base, pool_mgr->map_size);
+        return;
+    }
+#endif
+    free(pool_mgr->pool.mem);
+}
+
+static int _mem_file_policy(alloc_policy policy) {
+    return (policy == FIRST_FIT) || (policy == BEST_FIT) || (policy == NEXT_FIT) ||
+           (policy == SEGREGATED_FIT) || (policy == TLSF);
+}
+
+#if defined(__linux__)
+static alloc_status _mem_file_map(pool_mgr_pt pool_mgr, int fd, size_t size, int create) {
+    size_t pages = (size + MEM_PAGE_SIZE - 1) & ~(MEM_PAGE_SIZE - 1);
+
+    // the pool memory, shared with the file, after the header page; the
+    // journal and the tables after it are read and written through the
+    // descriptor, and a new file is laid out up to the first table
+    if (pages < size) {
+        return ALLOC_FAIL;
+    }
+    if (create && (ftruncate(fd, (off_t) _mem_file_tables(pages)) != 0)) {
+        return ALLOC_FAIL;
+    }
+    char *base = mmap(NULL, pages, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t) MEM_PAGE_SIZE);
+    if (base == MAP_FAILED) {
+        return ALLOC_FAIL;
+    }
+    pool_mgr->pool.mem = pool_mgr->map_base = base;
+    pool_mgr->map_size = pages;
+    pool_mgr->backing = BACKING_FILE;
+    pool_mgr->file_fd = fd;
+    pool_mgr->file_journal = 0;
+    pool_mgr->file_generation = 0;
+    pool_mgr->file_table_offset = 0;
+    pool_mgr->file_table_size = 0;
+    pool_mgr->file_log_next = 0;
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_file_write(pool_mgr_pt pool_mgr) {
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+    mem_inspect_pool((pool_pt) pool_mgr, &segs, &num_segs);
+    pool_file_segment_pt segments = malloc(sizeof(pool_file_segment_t) * (num_segs ? num_segs : 1));
+    if ((segs == NULL) || (segments == NULL)) {
+        free(segs);
+        free(segments);
+        return ALLOC_FAIL;
+    }
+    uint64_t offset = 0;
+    for (unsigned i = 0; i < num_segs; ++i) {
+        segments[i].offset = offset;
+        segments[i].size = segs[i].size;
+        segments[i].allocated = segs[i].allocated;
+        offset += segs[i].size;
+    }
+    free(segs);
+
+    pool_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MEM_FILE_MAGIC, sizeof(header.magic));
+    header.version = MEM_FILE_VERSION;
+    header.policy = (uint32_t) pool_mgr->pool.policy;
+    header.generation = pool_mgr->file_generation + 1;
+    header.total_size = pool_mgr->pool.total_size;
+    header.alloc_size = pool_mgr->pool.alloc_size;
+    header.num_allocs = pool_mgr->pool.num_allocs;
+    header.num_gaps = pool_mgr->pool.num_gaps;
+    header.data_offset = MEM_PAGE_SIZE;
+    header.log_offset = MEM_PAGE_SIZE + pool_mgr->map_size;
+    header.log_records = MEM_FILE_LOG_RECORDS;
+    header.num_segments = num_segs;
+    // the table never goes over the one the last snapshot still points
+    // to: first thing after the journal if it fits in front, else behind
+    size_t table_size = sizeof(pool_file_segment_t) * num_segs;
+    header.table_offset = _mem_file_tables(pool_mgr->map_size);
+    if ((pool_mgr->file_generation > 0) && (header.table_offset + table_size > pool_mgr->file_table_offset)) {
+        header.table_offset = pool_mgr->file_table_offset + pool_mgr->file_table_size;
+    }
+    header.checksum = _mem_file_checksum(&header, segments);
+
+    // in order, each step on disk before the next starts: the data, the
+    // table, then the header in the slot the last snapshot is not in;
+    // until that is on disk, attaching finds the last snapshot whole
+    int fd = pool_mgr->file_fd;
+    alloc_status status = ALLOC_OK;
+    if (_mem_file_step() || (msync(pool_mgr->map_base, pool_mgr->map_size, MS_SYNC) != 0) ||
+        !_mem_file_pwrite(fd, segments, table_size, header.table_offset) ||
+        _mem_file_step() || (fsync(fd) != 0) ||
+        !_mem_file_pwrite(fd, &header, sizeof(header), (header.generation % 2) * MEM_FILE_SLOT_SIZE) ||
+        _mem_file_step() || (fsync(fd) != 0)) {
+        status = ALLOC_FAIL;
+    }
+    free(segments);
+    if (status != ALLOC_OK) {
+        return status;
+    }
+    // committed: the journal starts over, and whatever is past the table
+    // is an older one
+    pool_mgr->file_generation = header.generation;
+    pool_mgr->file_table_offset = header.table_offset;
+    pool_mgr->file_table_size = table_size;
+    pool_mgr->file_log_next = 0;
+    if (!_mem_file_step()) {
+        (void) !ftruncate(fd, (off_t) (header.table_offset + table_size));
+    }
+
+    return ALLOC_OK;
+}
+
+static pool_file_segment_pt _mem_file_read(int fd, pool_file_header_pt header) {
+    // the newer of the two snapshots that is whole
+    pool_file_segment_pt segments = NULL;
+    for (unsigned slot = 0; slot < 2; ++slot) {
+        pool_file_header_t candidate;
+        pool_file_segment_pt candidate_segments = _mem_file_read_slot(fd, slot, &candidate);
+        if ((candidate_segments != NULL) && ((segments == NULL) || (candidate.generation > header->generation))) {
+            free(segments);
+            segments = candidate_segments;
+            *header = candidate;
+        } else {
+            free(candidate_segments);
+        }
+    }
+
+    return segments;
+}
+
+static pool_file_segment_pt _mem_file_read_slot(int fd, unsigned slot, pool_file_header_pt header) {
+    struct stat st;
+    if ((fstat(fd, &st) != 0) ||
+        (pread(fd, header, sizeof(*header), (off_t) (slot * MEM_FILE_SLOT_SIZE)) != (ssize_t) sizeof(*header))) {
+        return NULL;
+    }
+    // a pool file of this version, laid out as _mem_file_write lays it out
+    size_t pages = (header->total_size + MEM_PAGE_SIZE - 1) & ~(MEM_PAGE_SIZE - 1);
+    if ((memcmp(header->magic, MEM_FILE_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->version != MEM_FILE_VERSION) ||
+        !_mem_file_policy((alloc_policy) header->policy) ||
+        (header->generation % 2 != slot) ||
+        (header->total_size == 0) || (pages < header->total_size) ||
+        (header->data_offset != MEM_PAGE_SIZE) ||
+        (header->log_offset != MEM_PAGE_SIZE + pages) ||
+        (header->log_records != MEM_FILE_LOG_RECORDS) ||
+        (header->table_offset < _mem_file_tables(pages)) ||
+        (header->num_segments == 0) || (header->num_segments > header->total_size) ||
+        ((uint64_t) st.st_size < header->table_offset + sizeof(pool_file_segment_t) * header->num_segments)) {
+        return NULL;
+    }
+    size_t table_size = sizeof(pool_file_segment_t) * header->num_segments;
+    pool_file_segment_pt segments = malloc(table_size);
+    if ((segments == NULL) ||
+        (pread(fd, segments, table_size, (off_t) header->table_offset) != (ssize_t) table_size) ||
+        (_mem_file_checksum(header, segments) != header->checksum)) {
+        free(segments);
+        return NULL;
+    }
+    // the segments tile the pool in order, gaps coalesced, and add up to
+    // the counters
+    uint64_t offset = 0, alloc_size = 0, num_allocs = 0, num_gaps = 0;
+    for (uint64_t i = 0; i < header->num_segments; ++i) {
+        const pool_file_segment_t *seg = &segments[i];
+        if ((seg->offset != offset) || (seg->size == 0) || (seg->size > header->total_size - offset) ||
+            (seg->allocated > 1) || ((i > 0) && !seg->allocated && !segments[i - 1].allocated)) {
+            free(segments);
+            return NULL;
+        }
+        offset += seg->size;
+        alloc_size += seg->allocated ? seg->size : 0;
+        num_allocs += seg->allocated;
+        num_gaps += !seg->allocated;
+    }
+    if ((offset != header->total_size) || (alloc_size != header->alloc_size) ||
+        (num_allocs != header->num_allocs) || (num_gaps != header->num_gaps)) {
+        free(segments);
+        return NULL;
+    }
+
+    return segments;
+}
+
+static pool_file_record_pt _mem_file_records(pool_mgr_pt pool_mgr, uint64_t op, void *const allocs[], unsigned n) {
+    // the records of a change, from its nodes as they stand; NULL if there
+    // is no journal, or no memory for them, which _mem_file_append takes
+    // for a snapshot
+    if ((pool_mgr->file_fd < 0) || !pool_mgr->file_journal) {
+        return NULL;
+    }
+    pool_file_record_pt records = malloc(sizeof(pool_file_record_t) * n);
+    if (records == NULL) {
+        return NULL;
+    }
+    for (unsigned i = 0; i < n; ++i) {
+        node_pt node = _mem_handle_node(pool_mgr, allocs[i]);
+        records[i].remaining = n - i;
+        records[i].op = op;
+        records[i].offset = (uint64_t) (node->alloc_record.mem - pool_mgr->pool.mem);
+        records[i].size = node->alloc_record.size;
+    }
+
+    return records;
+}
+
+static void _mem_file_append(pool_mgr_pt pool_mgr, pool_file_record_pt records, unsigned n) {
+    // once the change is made: a snapshot taken in place of the records
+    // has to have it
+    if ((pool_mgr->file_fd < 0) || !pool_mgr->file_journal) {
+        free(records);
+        return;
+    }
+    // a full journal makes way for a snapshot, which has the change already
+    if ((records == NULL) || (n > MEM_FILE_LOG_RECORDS - pool_mgr->file_log_next)) {
+        free(records);
+        _mem_file_write(pool_mgr);
+        return;
+    }
+    for (unsigned i = 0; i < n; ++i) {
+        records[i].generation = pool_mgr->file_generation;
+        records[i].seq = pool_mgr->file_log_next + i;
+        records[i].checksum = 0;
+        records[i].checksum = _mem_file_hash(14695981039346656037ull, &records[i], sizeof(pool_file_record_t));
+    }
+    // to the page cache only: a killed process loses nothing written here,
+    // a lost machine what came after the last snapshot; a journal that
+    // cannot be written leaves a snapshot to try
+    uint64_t at = MEM_PAGE_SIZE + pool_mgr->map_size + sizeof(pool_file_record_t) * pool_mgr->file_log_next;
+    if (_mem_file_pwrite(pool_mgr->file_fd, records, sizeof(pool_file_record_t) * n, at)) {
+        pool_mgr->file_log_next += n;
+    } else {
+        _mem_file_write(pool_mgr);
+    }
+    free(records);
+}
+
+static void _mem_file_replay(pool_mgr_pt pool_mgr) {
+    // the records that follow the snapshot, in order, up to the first that
+    // is torn, stale or does not fit the pool as it stands
+    size_t log_size = sizeof(pool_file_record_t) * MEM_FILE_LOG_RECORDS;
+    pool_file_record_pt records = malloc(log_size);
+    if ((records == NULL) ||
+        (pread(pool_mgr->file_fd, records, log_size, (off_t) (MEM_PAGE_SIZE + pool_mgr->map_size)) !=
+         (ssize_t) log_size)) {
+        free(records);
+        return;
+    }
+    unsigned i = 0;
+    while ((i < MEM_FILE_LOG_RECORDS) && _mem_file_record_ok(pool_mgr, records, i, records[i].remaining)) {
+        // an operation only if all of its records made it
+        unsigned n = (unsigned) records[i].remaining;
+        unsigned k = 1;
+        while ((k < n) && (i + k < MEM_FILE_LOG_RECORDS) && _mem_file_record_ok(pool_mgr, records, i + k, n - k)) {
+            ++k;
+        }
+        if (k < n) {
+            break;
+        }
+        for (k = 0; k < n; ++k) {
+            if (_mem_file_apply(pool_mgr, &records[i + k]) != ALLOC_OK) {
+                free(records);
+                return;
+            }
+        }
+        i += n;
+    }
+    free(records);
+}
+
+static int _mem_file_record_ok(pool_mgr_pt pool_mgr, const pool_file_record_t records[], unsigned i,
+                               uint64_t remaining) {
+    // whole, of this snapshot, in its place
+    pool_file_record_t record = records[i];
+    record.checksum = 0;
+    return (records[i].generation == pool_mgr->file_generation) && (records[i].seq == i) &&
+           (records[i].remaining == remaining) && (remaining > 0) &&
+           (remaining <= MEM_FILE_LOG_RECORDS - i) &&
+           (_mem_file_hash(14695981039346656037ull, &record, sizeof(record)) == records[i].checksum);
+}
+
+static alloc_status _mem_file_apply(pool_mgr_pt pool_mgr, const pool_file_record_t *record) {
+    if ((record->offset >= pool_mgr->pool.total_size) || (record->size == 0) ||
+        (record->size > pool_mgr->pool.total_size - record->offset)) {
+        return ALLOC_FAIL;
+    }
+    char *mem = pool_mgr->pool.mem + record->offset;
+    void *alloc = mem_alloc_at((pool_pt) pool_mgr, (size_t) record->offset);
+
+    if (record->op == MEM_FILE_FREE) {
+        return (alloc != NULL) ? mem_del_alloc((pool_pt) pool_mgr, alloc) : ALLOC_FAIL;
+    }
+    if (record->op == MEM_FILE_RESIZE) {
+        return (alloc != NULL) ? _mem_resize_in_place(pool_mgr, _mem_handle_node(pool_mgr, alloc), (size_t) record->size) :
+               ALLOC_FAIL;
+    }
+    if (record->op != MEM_FILE_ALLOC) {
+        return ALLOC_FAIL;
+    }
+    // the gap the allocation lies in, carved as on the way in
+    node_pt gap = pool_mgr->node_heap;
+    while ((gap != NULL) && (gap->alloc_record.mem + gap->alloc_record.size <= mem)) {
+        gap = gap->next;
+    }
+    if ((gap == NULL) || (gap->allocated != 0) ||
+        ((size_t) (gap->alloc_record.mem + gap->alloc_record.size - mem) < record->size) ||
+        (_mem_reserve_nodes(pool_mgr, 2) != ALLOC_OK)) {
+        return ALLOC_FAIL;
+    }
+    if (mem > gap->alloc_record.mem) {
+        gap = _mem_split_padding(pool_mgr, gap, (size_t) (mem - gap->alloc_record.mem));
+    }
+    _mem_carve_gap(pool_mgr, gap, (size_t) record->size);
+
+    return ALLOC_OK;
+}
+
+static int _mem_file_step(void) {
+    // mem_pool_crash_at: the writes to pool files are counted, and the
+    // process killed at the chosen one, before it happens
+    if ((file_crash_step != 0) && (++file_steps == file_crash_step)) {
+        raise(SIGKILL);
+    }
+    return 0;
+}
+
+static int _mem_file_pwrite(int fd, const void *buf, size_t size, uint64_t offset) {
+    // a write the process is killed in gets halfway: a torn write
+    if ((file_crash_step != 0) && (file_steps + 1 == file_crash_step)) {
+        (void) !pwrite(fd, buf, size / 2, (off_t) offset);
+    }
+    return !_mem_file_step() && (pwrite(fd, buf, size, (off_t) offset) == (ssize_t) size);
+}
+#else
+static alloc_status _mem_file_map(pool_mgr_pt pool_mgr, int fd, size_t size, int create) {
+    (void) pool_mgr;
+    (void) fd;
+    (void) size;
+    (void) create;
+    return ALLOC_FAIL;
+}
+
+static alloc_status _mem_file_write(pool_mgr_pt pool_mgr) {
+    (void) pool_mgr;
+    return ALLOC_FAIL;
+}
+
+static pool_file_record_pt _mem_file_records(pool_mgr_pt pool_mgr, uint64_t op, void *const allocs[], unsigned n) {
+    (void) pool_mgr;
+    (void) op;
+    (void) allocs;
+    (void) n;
+    return NULL;
+}
+
+static void _mem_file_append(pool_mgr_pt pool_mgr, pool_file_record_pt records, unsigned n) {
+    (void) pool_mgr;
+    (void) records;
+    (void) n;
+}
+#endif
+
+static void _mem_file_log(pool_mgr_pt pool_mgr, uint64_t op, void *const allocs[], unsigned n) {
+    // a change already made: journal it straight away
+    _mem_file_append(pool_mgr, _mem_file_records(pool_mgr, op, allocs, n), n);
+}
+
+static alloc_status _mem_file_rebuild(pool_mgr_pt pool_mgr, const pool_file_segment_t *segments, size_t n) {
+    // the pool is one gap; each allocation, in address order, is carved
+    // out of the front of the last gap, after splitting off what lies
+    // before it, which leaves the gaps exactly where they were
+    node_pt gap = pool_mgr->node_heap;
+    for (size_t i = 0; i < n; ++i) {
+        if (!segments[i].allocated) {
+            continue;
+        }
+        if (_mem_reserve_nodes(pool_mgr, 2) != ALLOC_OK) {
+            return ALLOC_FAIL;
+        }
+        size_t pad = (size_t) segments[i].offset - (size_t) (gap->alloc_record.mem - pool_mgr->pool.mem);
+        if (pad > 0) {
+            gap = _mem_split_padding(pool_mgr, gap, pad);
+        }
+        gap = _mem_carve_gap(pool_mgr, gap, segments[i].size)->next;
+    }
+    pool_mgr->next_fit_cursor = pool_mgr->node_heap;
+
+    return ALLOC_OK;
+}
+
+// where the segment tables start, past the pool memory and the journal
+static uint64_t _mem_file_tables(size_t pages) {
+    return (MEM_PAGE_SIZE + pages + sizeof(pool_file_record_t) * MEM_FILE_LOG_RECORDS + MEM_PAGE_SIZE - 1) &
+           ~(uint64_t) (MEM_PAGE_SIZE - 1);
+}
+
+// FNV-1a
+static uint64_t _mem_file_hash(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+// over the header as written and the table
+static uint64_t _mem_file_checksum(const pool_file_header_t *header, const pool_file_segment_t *segments) {
+    pool_file_header_t copy = *header;
+    copy.checksum = 0;
+    uint64_t hash = _mem_file_hash(14695981039346656037ull, &copy, sizeof(copy));
+
+    return _mem_file_hash(hash, segments, sizeof(pool_file_segment_t) * header->num_segments);
+}
+
+static void _mem_free_pool_mgr(pool_mgr_pt pool_mgr) {
+    // free the stripes of a thread-safe pool, which share its memory
+    _mem_stripes_free(pool_mgr);
+    // free memory pool
+    _mem_pool_unmap(pool_mgr);
+    // free the buddy block map, TLSF index or bitmaps, if any
+    free(pool_mgr->buddy_map);
+    free(pool_mgr->tlsf);
+    free(pool_mgr->fixed_map);
+    free(pool_mgr->fixed_lf_next);
+    free(pool_mgr->bitmap_used);
+    free(pool_mgr->bitmap_start);
+    // free node heap (the gap index lives inside it)
+    for (unsigned i = 0; i < pool_mgr->num_chunks; ++i) {
+        free(pool_mgr->node_chunks[i]);
+    }
+    free(pool_mgr->node_chunks);
+    for (unsigned i = 0; i < pool_mgr->num_outgrown_dirs; ++i) {
+        free(pool_mgr->outgrown_dirs[i]);
+    }
+    // free mgr
+    free(pool_mgr);
+}
+
+static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr) {
+    // only when the unused node list has run dry
+    if (pool_mgr->unused_head == MEM_NODE_NONE) {
+        if (_mem_add_node_chunk(pool_mgr) != ALLOC_OK) {
+            return ALLOC_FAIL;
+        }
+        pool_mgr->heap_grows++;
+    }
+
+    return ALLOC_OK;
+}
+
+// make sure the unused node list holds at least count nodes, for
+// operations that take more than one; every node not on the segment
+// list is on the unused list
+static alloc_status _mem_reserve_nodes(pool_mgr_pt pool_mgr, unsigned count) {
+    while (pool_mgr->total_nodes - pool_mgr->used_nodes < count) {
+        if (_mem_add_node_chunk(pool_mgr) != ALLOC_OK) {
+            return ALLOC_FAIL;
+        }
+        pool_mgr->heap_grows++;
+    }
+
+    return ALLOC_OK;
+}
+
+// append one chunk of unused nodes; existing nodes stay where they are,
+// so handles and links into the heap remain valid
+static alloc_status _mem_add_node_chunk(pool_mgr_pt pool_mgr) {
+    // handles have room for this many nodes only
+    if (pool_mgr->total_nodes + MEM_NODE_CHUNK_CAPACITY >= (1u << MEM_HANDLE_INDEX_BITS)) {
+        return ALLOC_FAIL;
+    }
+    // expand the chunk directory, if necessary (pointers only); the old
+    // one stays until the heap goes, as a free from another thread may
+    // still be reading it
+    if (pool_mgr->num_chunks == pool_mgr->node_dir_capacity) {
+        unsigned capacity = pool_mgr->node_dir_capacity * MEM_NODE_DIR_EXPAND_FACTOR;
+        node_pt *chunks = malloc(capacity * sizeof(node_pt));
+        if ((chunks == NULL) || (pool_mgr->num_outgrown_dirs == MEM_NODE_DIR_OUTGROWN)) {
+            free(chunks);
+            return ALLOC_FAIL;
+        }
+        memcpy(chunks, pool_mgr->node_chunks, pool_mgr->num_chunks * sizeof(node_pt));
+        pool_mgr->outgrown_dirs[pool_mgr->num_outgrown_dirs++] = pool_mgr->node_chunks;
+        pool_mgr->node_chunks = chunks;
+        pool_mgr->node_dir_capacity = capacity;
+    }
+
+    node_pt chunk = malloc(MEM_NODE_CHUNK_CAPACITY * sizeof(struct _node));
+    if (chunk == NULL) {
+        return ALLOC_FAIL;
+    }
+
+    // the new nodes become the unused node list, lowest index first
+    unsigned first = pool_mgr->total_nodes;
+    for (unsigned i = 0; i < MEM_NODE_CHUNK_CAPACITY; ++i) {
+        chunk[i].used = 0;
+        chunk[i].allocated = 0;
+        chunk[i].prev = NULL;
+        chunk[i].next = NULL;
+        chunk[i].alloc_record.size = 0;
+        chunk[i].alloc_record.mem = NULL;
+        chunk[i].index = first + i;
+        chunk[i].generation = 0;
+        chunk[i].next_unused = (i + 1 < MEM_NODE_CHUNK_CAPACITY) ? first + i + 1 : pool_mgr->unused_head;
+    }
+    pool_mgr->node_chunks[pool_mgr->num_chunks++] = chunk;
+    pool_mgr->total_nodes += MEM_NODE_CHUNK_CAPACITY;
+    pool_mgr->unused_head = first;
+
+    return ALLOC_OK;
+}
+
+static node_pt _mem_node_at(pool_mgr_pt pool_mgr, unsigned index) {
+    return &pool_mgr->node_chunks[index / MEM_NODE_CHUNK_CAPACITY][index % MEM_NODE_CHUNK_CAPACITY];
+}
+
+// pop the unused node list; O(1), the list is never empty after
+// _mem_resize_node_heap
+static node_pt _mem_get_unused_node(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->unused_head == MEM_NODE_NONE) {
+        return NULL;
+    }
+
+    node_pt node = _mem_node_at(pool_mgr, pool_mgr->unused_head);
+    assert(node->used == 0);
+    pool_mgr->unused_head = node->next_unused;
+    node->next_unused = MEM_NODE_NONE;
+
+    // update metadata (used_nodes)
+    node->used = 1;
+    pool_mgr->used_nodes++;
+    pool_mgr->unused_hits++;
+
+    return node;
+}
+
+// put every node back on the unused node list, lowest index first, as
+// _mem_add_node_chunk leaves them; handles into the heap go stale
+static void _mem_reset_node_heap(pool_mgr_pt pool_mgr) {
+    for (unsigned c = 0; c < pool_mgr->num_chunks; ++c) {
+        node_pt chunk = pool_mgr->node_chunks[c];
+        for (unsigned i = 0; i < MEM_NODE_CHUNK_CAPACITY; ++i) {
+            chunk[i].used = 0;
+            chunk[i].allocated = 0;
+            chunk[i].prev = NULL;
+            chunk[i].next = NULL;
+            chunk[i].alloc_record.size = 0;
+            chunk[i].alloc_record.mem = NULL;
+            chunk[i].next_unused = (chunk[i].index + 1 < pool_mgr->total_nodes) ? chunk[i].index + 1 : MEM_NODE_NONE;
+        }
+    }
+    pool_mgr->unused_head = (pool_mgr->total_nodes > 0) ? 0 : MEM_NODE_NONE;
+    pool_mgr->used_nodes = 0;
+}
+
+// the handle of an allocation: its node's index in the heap, plus one so
+// that no handle is NULL, then the stripe it is in, so that a thread-safe
+// pool finds the stripe without reading the node, and the generation the
+// node is in, all 32 bits of it, so that a handle kept past its free does
+// not name whatever allocation the node is reused for until the node has
+// been reused 2^32 times; the pool's salt on the generation keeps another
+// pool's handles, with the same index, from matching
+static void *_mem_handle(pool_mgr_pt pool_mgr, node_pt node) {
+    return (void *) ((uintptr_t) (node->index + 1) | ((uintptr_t) pool_mgr->stripe_index << MEM_HANDLE_INDEX_BITS) |
+                     ((uintptr_t) (node->generation + pool_mgr->handle_salt)
+                             << (MEM_HANDLE_INDEX_BITS + MEM_HANDLE_STRIPE_BITS)));
+}
+
+// the node a handle names, unchecked; in a thread-safe pool, in the
+// stripe the handle names
+static node_pt _mem_handle_node(pool_mgr_pt pool_mgr, const void *alloc) {
+    uintptr_t handle = (uintptr_t) alloc;
+    if (pool_mgr->num_stripes > 0) {
+        pool_mgr = pool_mgr->stripes[(handle >> MEM_HANDLE_INDEX_BITS) & ((1u << MEM_HANDLE_STRIPE_BITS) - 1)];
+    }
+    return _mem_node_at(pool_mgr, (unsigned) (handle & ((1u << MEM_HANDLE_INDEX_BITS) - 1)) - 1);
+}
+
+// map an allocation handle back to its node in O(1); the handle has to
+// name a node in this pool's heap, checked before the node is read, of
+// the generation it is in, and a live allocation, so foreign, garbage,
+// stale (already freed, maybe reused since), cached and queued handles
+// give NULL
+static node_pt _mem_node_from_handle(pool_mgr_pt pool_mgr, void *alloc) {
+    unsigned index = (unsigned) ((uintptr_t) alloc & ((1u << MEM_HANDLE_INDEX_BITS) - 1));
+    if ((index == 0) || (index > pool_mgr->total_nodes)) {
+        return NULL;
+    }
+
+    node_pt node = _mem_node_at(pool_mgr, index - 1);
+    if ((node->used == 0) | (node->allocated == 0) | (node->allocated == MEM_NODE_CACHED) |
+        (node->allocated == MEM_NODE_QUEUED) | (_mem_handle(pool_mgr, node) != alloc)) {
+        return NULL;
+    }
+
+    return node;
+}
+
+// take a live allocation of this pool out of the allocated state, into
+// to, with no lock needed: of two threads freeing one handle at once,
+// only one gets it. Index, directory and state are read as another
+// thread changes them safely, and a node freed and allocated again
+// between the check and the swap shows it by its generation, bumped
+// before the node is marked allocated, and is handed back
+static node_pt _mem_node_claim(pool_mgr_pt pool_mgr, void *alloc, unsigned to) {
+    unsigned index = (unsigned) ((uintptr_t) alloc & ((1u << MEM_HANDLE_INDEX_BITS) - 1));
+    if ((index == 0) || (index > pool_mgr->total_nodes)) {
+        return NULL;
+    }
+
+    node_pt node = _mem_node_at(pool_mgr, index - 1);
+    unsigned allocated = 1;
+    if ((_mem_handle(pool_mgr, node) != alloc) || !atomic_compare_exchange_strong(&node->allocated, &allocated, to)) {
+        return NULL;
+    }
+    if (_mem_handle(pool_mgr, node) != alloc) {
+        node->allocated = 1;
+        return NULL;
+    }
+
+    return node;
+}
+
+// retire a node that was merged away and push it on the unused node list
+static void _mem_release_node(pool_mgr_pt pool_mgr, node_pt node) {
+    assert(node->used == 1);
+    // a retired node has always been merged into its prev, which is still
+    // linked here, so that's where the NEXT_FIT cursor goes
+    if (pool_mgr->next_fit_cursor == node) {
+        pool_mgr->next_fit_cursor = node->prev;
+    }
+
+    node->used = 0;
+    node->allocated = 0;
+    node->next = NULL;
+    node->prev = NULL;
+    node->next_unused = pool_mgr->unused_head;
+    pool_mgr->unused_head = node->index;
+
+    // update metadata (used_nodes)
+    pool_mgr->used_nodes--;
+}
+
+static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
+                                       size_t size,
+                                       node_pt node) {
+
+    assert(node->allocated == 0);
+    assert(size > 0);
+    assert(node->alloc_record.size == size);
+
+    unsigned fl, sl;
+    switch (pool_mgr->pool.policy) {
+        case SEGREGATED_FIT:
+            // push the node on the list of its size class
+            fl = _mem_size_class(size);
+            _mem_gap_list_push(&pool_mgr->size_classes[fl], node);
+            pool_mgr->size_class_mask |= (uint64_t) 1 << fl;
+            break;
+        case TLSF:
+            // push the node on its list and mark the list in both bitmaps
+            _mem_tlsf_mapping(size, &fl, &sl);
+            _mem_gap_list_push(&pool_mgr->tlsf->lists[fl][sl], node);
+            pool_mgr->tlsf->sl_map[fl] |= (uint32_t) 1 << sl;
+            pool_mgr->tlsf->fl_map |= (uint64_t) 1 << fl;
+            break;
+        default:
+            // insert the node into the tree and rebalance on the way back up
+            pool_mgr->gap_ix = _mem_gap_insert(pool_mgr->gap_ix, node);
+            break;
+    }
+
+    // update metadata (num_gaps)
+    pool_mgr->pool.num_gaps++;
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
+                                            size_t size,
+                                            node_pt node) {
+    assert(size > 0);
+    // the node is keyed on its current size, so it has to be removed
+    // before the size is changed by a split or a merge
+    assert(node->alloc_record.size == size);
+
+    unsigned fl, sl;
+    switch (pool_mgr->pool.policy) {
+        case SEGREGATED_FIT:
+            // unlink the node from the list of its size class
+            fl = _mem_size_class(size);
+            _mem_gap_list_unlink(&pool_mgr->size_classes[fl], node);
+            if (pool_mgr->size_classes[fl] == NULL) {
+                pool_mgr->size_class_mask &= ~((uint64_t) 1 << fl);
+            }
+            break;
+        case TLSF:
+            // unlink the node and clear the bitmaps for lists that run empty
+            _mem_tlsf_mapping(size, &fl, &sl);
+            _mem_gap_list_unlink(&pool_mgr->tlsf->lists[fl][sl], node);
+            if (pool_mgr->tlsf->lists[fl][sl] == NULL) {
+                pool_mgr->tlsf->sl_map[fl] &= ~((uint32_t) 1 << sl);
+                if (pool_mgr->tlsf->sl_map[fl] == 0) {
+                    pool_mgr->tlsf->fl_map &= ~((uint64_t) 1 << fl);
+                }
+            }
+            break;
+        default:
+            pool_mgr->gap_ix = _mem_gap_remove(pool_mgr->gap_ix, node);
+            break;
+    }
+
+    // update metadata (num_gaps)
+    pool_mgr->pool.num_gaps--;
+
+    return ALLOC_OK;
+}
+
+// best fit: the smallest gap that is at least size bytes; among equal
+// sizes the one with the lowest node index (same order as the old
+// sorted array)
+static node_pt _mem_find_in_gap_ix(pool_mgr_pt pool_mgr, size_t size) {
+    node_pt best = NULL;
+    node_pt cur = pool_mgr->gap_ix;
+
+    while (cur != NULL) {
+        if (cur->alloc_record.size >= size) {
+            best = cur;
+            cur = cur->gap_left;
+        } else {
+            cur = cur->gap_right;
+        }
+    }
+
+    return best;
+}
+
+// first fit from the cursor to the end of the list, then from the head
+// back up to the cursor
+static node_pt _mem_find_next_fit(pool_mgr_pt pool_mgr, size_t size, size_t alignment) {
+    node_pt start = pool_mgr->next_fit_cursor;
+    node_pt node = start;
+
+    do {
+        if ((node->allocated == 0) && (node->alloc_record.size >= size) &&
+            (node->alloc_record.size - size >= _mem_align_pad(node->alloc_record.mem, alignment))) {
+            return node;
+        }
+        node = (node->next != NULL) ? node->next : pool_mgr->node_heap;
+    } while (node != start);
+
+    return NULL;
+}
+
+// change the size of an allocation without moving it; ALLOC_FAIL if it
+// has to move
+static alloc_status _mem_resize_in_place(pool_mgr_pt pool_mgr, node_pt node, size_t new_size) {
+    size_t size = node->alloc_record.size;
+
+    // a buddy block stays whole for as long as the request fits in it
+    if (pool_mgr->pool.policy == BUDDY) {
+        return (new_size <= size) ? ALLOC_OK : ALLOC_FAIL;
+    }
+    if (pool_mgr->pool.policy == BITMAP_FIT) {
+        return _mem_bitmap_resize(pool_mgr, node, new_size);
+    }
+    if (new_size == size) {
+        return ALLOC_OK;
+    }
+
+    node_pt next = node->next;
+    int next_is_gap = (next != NULL) && (next->allocated == 0);
+
+    if (new_size > size) {
+        // grow: take the front of the next gap, or all of it
+        size_t grow = new_size - size;
+        if (!next_is_gap || (next->alloc_record.size < grow)) {
+            return ALLOC_FAIL;
+        }
+        alloc_status status = _mem_remove_from_gap_ix(pool_mgr, next->alloc_record.size, next);
+        assert(status == ALLOC_OK);
+        if (next->alloc_record.size == grow) {
+            node->next = next->next;
+            if (next->next != NULL) {
+                next->next->prev = node;
+            }
+            _mem_release_node(pool_mgr, next);
+        } else {
+            next->alloc_record.mem += grow;
+            next->alloc_record.size -= grow;
+            status = _mem_add_to_gap_ix(pool_mgr, next->alloc_record.size, next);
+            assert(status == ALLOC_OK);
+        }
+        (void) status;
+        node->alloc_record.size = new_size;
+        pool_mgr->pool.alloc_size += grow;
+
+        return ALLOC_OK;
+    }
+
+    // shrink: the tail goes to the next gap, or becomes a gap of its own
+    size_t shrink = size - new_size;
+    alloc_status status;
+    if (next_is_gap) {
+        status = _mem_remove_from_gap_ix(pool_mgr, next->alloc_record.size, next);
+        assert(status == ALLOC_OK);
+        next->alloc_record.mem -= shrink;
+        next->alloc_record.size += shrink;
+        status = _mem_add_to_gap_ix(pool_mgr, next->alloc_record.size, next);
+        assert(status == ALLOC_OK);
+    } else {
+        if (_mem_reserve_nodes(pool_mgr, 1) != ALLOC_OK) {
+            return ALLOC_FAIL;
+        }
+        node_pt gap = _mem_get_unused_node(pool_mgr);
+        gap->allocated = 0;
+        gap->alloc_record.mem = node->alloc_record.mem + new_size;
+        gap->alloc_record.size = shrink;
+        gap->prev = node;
+        gap->next = next;
+        if (next != NULL) {
+            next->prev = gap;
+        }
+        node->next = gap;
+        status = _mem_add_to_gap_ix(pool_mgr, gap->alloc_record.size, gap);
+        assert(status == ALLOC_OK);
+    }
+    (void) status;
+    node->alloc_record.size = new_size;
+    pool_mgr->pool.alloc_size -= shrink;
+
+    return ALLOC_OK;
+}
+
+// the gap the policy picks for an allocation, NULL if none fits
+static node_pt _mem_find_gap(pool_mgr_pt pool_mgr, size_t size, size_t alignment) {
+    node_pt node_to_alloc = pool_mgr->node_heap;
+
+    // the indexed searches go by size alone, so they ask for enough to
+    // align anywhere in the gap; the list walks check the padding exactly
+    size_t search_size = size + (alignment - 1);
+
+    switch (pool_mgr->pool.policy) {
+        // if FIRST_FIT, then find the first sufficient node in the node heap
+        case FIRST_FIT:
+            while (node_to_alloc != NULL) {
+                if ((node_to_alloc->allocated == 0) &&
+                    (node_to_alloc->alloc_record.size >= size) &&
+                    (node_to_alloc->alloc_record.size - size >= _mem_align_pad(node_to_alloc->alloc_record.mem, alignment))) {
+                    break;
+                }
+                node_to_alloc = node_to_alloc->next;
+            }
+            break;
+        // if NEXT_FIT, then do the same but start at the cursor and wrap around
+        case NEXT_FIT:
+            node_to_alloc = _mem_find_next_fit(pool_mgr, size, alignment);
+            break;
+        // if SEGREGATED_FIT, then look in the size class lists
+        case SEGREGATED_FIT:
+            node_to_alloc = _mem_find_in_size_classes(pool_mgr, search_size);
+            break;
+        // if TLSF, then take the first gap of the first list that is sure to fit
+        case TLSF:
+            node_to_alloc = _mem_find_in_tlsf(pool_mgr, search_size);
+            break;
+        // if BEST_FIT, then find the smallest sufficient node in the gap index
+        case BEST_FIT:
+        default:
+            node_to_alloc = _mem_find_in_gap_ix(pool_mgr, search_size);
+            break;
+    }
+
+    return node_to_alloc;
+}
+
+// bytes from mem up to the next multiple of alignment
+static size_t _mem_align_pad(const char *mem, size_t alignment) {
+    return (size_t) (-(uintptr_t) mem & (alignment - 1));
+}
+
+// a gap, or an allocation the batch under way is freeing; not one that is
+// allocated, cached or queued
+static int _mem_node_is_free(node_pt node) {
+    return (node->allocated == 0) || (node->allocated == MEM_NODE_FREEING);
+}
+
+// merge the run of gaps and freed nodes around node into its first
+// node: gaps already in the gap index come out of it, and the merged
+// gap goes in, once
+static void _mem_coalesce_run(pool_mgr_pt pool_mgr, node_pt node) {
+    node_pt head = node;
+    while ((head->prev != NULL) && _mem_node_is_free(head->prev)) {
+        head = head->prev;
+    }
+
+    alloc_status status;
+    if (head->allocated == 0) {
+        status = _mem_remove_from_gap_ix(pool_mgr, head->alloc_record.size, head);
+        assert(status == ALLOC_OK);
+    }
+    head->allocated = 0;
+
+    node_pt next = head->next;
+    while ((next != NULL) && _mem_node_is_free(next)) {
+        if (next->allocated == 0) {
+            status = _mem_remove_from_gap_ix(pool_mgr, next->alloc_record.size, next);
+            assert(status == ALLOC_OK);
+        }
+        head->alloc_record.size += next->alloc_record.size;
+        head->next = next->next;
+        if (next->next != NULL) {
+            next->next->prev = head;
+        }
+        _mem_release_node(pool_mgr, next);
+        next = head->next;
+    }
+
+    status = _mem_add_to_gap_ix(pool_mgr, head->alloc_record.size, head);
+    assert(status == ALLOC_OK);
+    (void) status;
+}
+
+// a LINEAR release starts a new epoch; the releases before it at or above
+// its offset are dropped, as any mark they would refuse it refuses too
+static void _mem_linear_release(pool_mgr_pt pool_mgr, size_t offset) {
+    unsigned n = pool_mgr->linear_num_releases;
+    while ((n > 0) && (pool_mgr->linear_releases[n - 1].offset >= offset)) {
+        --n;
+    }
+    // out of room: the oldest goes, and with it the marks it would check
+    if (n == MEM_LINEAR_RELEASES) {
+        pool_mgr->linear_floor = pool_mgr->linear_releases[0].epoch;
+        memmove(pool_mgr->linear_releases, pool_mgr->linear_releases + 1, sizeof(linear_release_t) * --n);
+    }
+    pool_mgr->linear_releases[n].epoch = ++pool_mgr->linear_epoch;
+    pool_mgr->linear_releases[n].offset = offset;
+    pool_mgr->linear_num_releases = n + 1;
+}
+
+// turn the gap into n allocations in a row and whatever is left over;
+// the nodes have been reserved
+static void _mem_carve_batch(pool_mgr_pt pool_mgr, node_pt gap, const size_t sizes[], unsigned n, void *out[]) {
+    size_t gap_size = gap->alloc_record.size;
+    char *mem = gap->alloc_record.mem;
+    node_pt after = gap->next;
+    node_pt last = gap;
+    size_t total = 0;
+
+    alloc_status status = _mem_remove_from_gap_ix(pool_mgr, gap_size, gap);
+    assert(status == ALLOC_OK);
+    for (unsigned i = 0; i < n; ++i) {
+        node_pt node = gap;
+        if (i > 0) {
+            node = _mem_get_unused_node(pool_mgr);
+            assert(node != NULL);
+            node->prev = last;
+            last->next = node;
+        }
+        node->generation++;
+        node->allocated = 1;
+        node->alloc_record.mem = mem + total;
+        node->alloc_record.size = sizes[i];
+        total += sizes[i];
+        out[i] = _mem_handle(pool_mgr, node);
+        last = node;
+    }
+    // the next NEXT_FIT search resumes right after the batch
+    pool_mgr->next_fit_cursor = (after != NULL) ? after : pool_mgr->node_heap;
+
+    if (gap_size > total) {
+        node_pt rest = _mem_get_unused_node(pool_mgr);
+        assert(rest != NULL);
+        rest->allocated = 0;
+        rest->alloc_record.mem = mem + total;
+        rest->alloc_record.size = gap_size - total;
+        rest->prev = last;
+        last->next = rest;
+        last = rest;
+        status = _mem_add_to_gap_ix(pool_mgr, rest->alloc_record.size, rest);
+        assert(status == ALLOC_OK);
+        pool_mgr->next_fit_cursor = rest;
+    }
+    (void) status;
+    last->next = after;
+    if (after != NULL) {
+        after->prev = last;
+    }
+
+    // update metadata (num_allocs, alloc_size)
+    pool_mgr->pool.num_allocs += n;
+    pool_mgr->pool.alloc_size += total;
+    _mem_file_log(pool_mgr, MEM_FILE_ALLOC, out, n);
+}
+
+// shrink a gap to its first pad bytes and return a new gap node for the
+// rest, linked right after it and in the gap index; needs an unused node
+static node_pt _mem_split_padding(pool_mgr_pt pool_mgr, node_pt gap, size_t pad) {
+    node_pt rest = _mem_get_unused_node(pool_mgr);
+    assert(rest != NULL);
+
+    alloc_status status = _mem_remove_from_gap_ix(pool_mgr, gap->alloc_record.size, gap);
+    assert(status == ALLOC_OK);
+    rest->allocated = 0;
+    rest->alloc_record.mem = gap->alloc_record.mem + pad;
+    rest->alloc_record.size = gap->alloc_record.size - pad;
+    gap->alloc_record.size = pad;
+
+    rest->prev = gap;
+    rest->next = gap->next;
+    if (gap->next != NULL) {
+        gap->next->prev = rest;
+    }
+    gap->next = rest;
+
+    status = _mem_add_to_gap_ix(pool_mgr, gap->alloc_record.size, gap);
+    assert(status == ALLOC_OK);
+    status = _mem_add_to_gap_ix(pool_mgr, rest->alloc_record.size, rest);
+    assert(status == ALLOC_OK);
+    (void) status;
+
+    return rest;
+}
+
+// turn the front of a gap into an allocation of size, the rest staying a
+// gap; needs a spare node
+static node_pt _mem_carve_gap(pool_mgr_pt mgr, node_pt node_to_alloc, size_t size) {
+    // check if node found
+    // update metadata (num_allocs, alloc_size)
+    mgr->pool.num_allocs++;
+    size_t old_size = mgr->pool.alloc_size;
+    mgr->pool.alloc_size += size;
+
+
+    size_t remaining_gap_size = 0;
+    // calculate the size of the remaining gap, if any
+
+    remaining_gap_size = node_to_alloc->alloc_record.size - size;
+
+
+    size_t old_remaining_gap_size = mgr->pool.total_size - old_size;
+    // remove node from gap index
+    size_t old_gap_size = node_to_alloc->alloc_record.size;
+    assert(ALLOC_OK == _mem_remove_from_gap_ix(mgr, old_gap_size, node_to_alloc));
+
+    // convert gap_node to an allocation node of given size
+
+    node_to_alloc->alloc_record.size = size;
+
+    node_to_alloc->generation++;
+    node_to_alloc->allocated = 1;
+    // adjust node heap:
+
+    //   if remaining gap, need a new node
+    if (remaining_gap_size > 0) {
+        //   take one off the unused node list
+        node_pt new_gap_node = _mem_get_unused_node(mgr);
+        //   make sure one was found
+        assert(new_gap_node != NULL);
+        //   initialize it to a gap node
+        new_gap_node->next = node_to_alloc->next;
+        if (node_to_alloc->next != NULL) {
+            node_to_alloc->next->prev = new_gap_node;
+        }
+        node_to_alloc->next = new_gap_node;
+        new_gap_node->prev = node_to_alloc;
+
+
+        new_gap_node->alloc_record.size = old_gap_size - node_to_alloc->alloc_record.size;
+        new_gap_node->allocated = 0;
+        new_gap_node->alloc_record.mem = node_to_alloc->alloc_record.mem + size * sizeof(char);
+        assert(_mem_add_to_gap_ix(mgr, new_gap_node->alloc_record.size, new_gap_node) == ALLOC_OK);
+
+
+    }
+
+    //   make sure one was found
+    //   initialize it to a gap node
+    //   update metadata (used_nodes)
+    //   update linked list (new node right after the node for allocation)
+
+    //   add to gap index
+    //   check if successful
+    // the next NEXT_FIT search resumes right after this allocation
+    mgr->next_fit_cursor = (node_to_alloc->next != NULL) ? node_to_alloc->next : mgr->node_heap;
+    _mem_file_log(mgr, MEM_FILE_ALLOC, (void *[]) { _mem_handle(mgr, node_to_alloc) }, 1);
+
+    return node_to_alloc;
+}
+
+// segregated fit: the head of the first non-empty class that is sure to
+// fit, the request rounded up to a power of two, so that finding a gap is
+// O(1) however many gaps too small for it share its own class. A gap of
+// its own class that is large enough is walked for only when there is
+// nothing larger, rather than fail
+static node_pt _mem_find_in_size_classes(pool_mgr_pt pool_mgr, size_t size) {
+    unsigned size_class = _mem_size_class(size);
+    unsigned fit_class = size_class + ((size & (size - 1)) != 0);
+
+    uint64_t fits = (fit_class < MEM_SIZE_CLASSES) ?
+                    pool_mgr->size_class_mask & ~(((uint64_t) 1 << fit_class) - 1) : 0;
+    if (fits != 0) {
+        unsigned k = _mem_ctz64(fits);
+        if (k == fit_class) {
+            pool_mgr->class_hits++;
+        } else {
+            pool_mgr->class_splits++;
+        }
+        return pool_mgr->size_classes[k];
+    }
+
+    for (node_pt node = pool_mgr->size_classes[size_class]; node != NULL; node = node->class_next) {
+        if (node->alloc_record.size >= size) {
+            pool_mgr->class_hits++;
+            return node;
+        }
+    }
+
+    pool_mgr->class_misses++;
+    return NULL;
+}
+
+// floor(log2(size)), with size 0 in class 0
+static unsigned _mem_size_class(size_t size) {
+    return (size > 1) ? (MEM_SIZE_CLASSES - 1) - _mem_clz64(size) : 0;
+}
+
+static void _mem_gap_list_push(node_pt *head, node_pt node) {
+    node->class_prev = NULL;
+    node->class_next = *head;
+    if (*head != NULL) {
+        (*head)->class_prev = node;
+    }
+    *head = node;
+}
+
+static void _mem_gap_list_unlink(node_pt *head, node_pt node) {
+    if (node->class_prev != NULL) {
+        node->class_prev->class_next = node->class_next;
+    } else {
+        *head = node->class_next;
+    }
+    if (node->class_next != NULL) {
+        node->class_next->class_prev = node->class_prev;
+    }
+    node->class_next = NULL;
+    node->class_prev = NULL;
+}
+
+// TLSF: round the request up to the next list boundary, so that every
+// gap of the list found is large enough, then two find-first-sets. O(1),
+// at the price of skipping a gap that would fit in the request's own list
+static node_pt _mem_find_in_tlsf(pool_mgr_pt pool_mgr, size_t size) {
+    tlsf_index_pt tlsf = pool_mgr->tlsf;
+
+    if (size >= MEM_TLSF_SL_COUNT) {
+        size_t round = ((size_t) 1 << (_mem_size_class(size) - MEM_TLSF_SL_LOG2)) - 1;
+        if (size > SIZE_MAX - round) {
+            return NULL;
+        }
+        size += round;
+    }
+
+    unsigned fl, sl;
+    _mem_tlsf_mapping(size, &fl, &sl);
+
+    uint32_t sl_bits = tlsf->sl_map[fl] & (~(uint32_t) 0 << sl);
+    if (sl_bits == 0) {
+        uint64_t fl_bits = (fl + 1 < MEM_TLSF_FL_COUNT) ? tlsf->fl_map & (~(uint64_t) 0 << (fl + 1)) : 0;
+        if (fl_bits == 0) {
+            return NULL;
+        }
+        fl = _mem_ctz64(fl_bits);
+        sl_bits = tlsf->sl_map[fl];
+    }
+    sl = _mem_ctz64(sl_bits);
+
+    return tlsf->lists[fl][sl];
+}
+
+// sizes below MEM_TLSF_SL_COUNT get one list each in first level 0,
+// above that the first level is the power of two and the second level
+// the next MEM_TLSF_SL_LOG2 bits below the leading one
+static void _mem_tlsf_mapping(size_t size, unsigned *fl, unsigned *sl) {
+    if (size < MEM_TLSF_SL_COUNT) {
+        *fl = 0;
+        *sl = (unsigned) size;
+        return;
+    }
+    unsigned log2 = _mem_size_class(size);
+    *fl = log2 - MEM_TLSF_SL_LOG2 + 1;
+    *sl = (unsigned) (size >> (log2 - MEM_TLSF_SL_LOG2)) ^ MEM_TLSF_SL_COUNT;
+}
+
+// the whole pool starts out as one free block of the top order
+static alloc_status _mem_buddy_init(pool_mgr_pt pool_mgr) {
+    size_t units = pool_mgr->pool.total_size >> MEM_BUDDY_MIN_ORDER;
+
+    pool_mgr->buddy_map = calloc(units, 1);
+    if (pool_mgr->buddy_map == NULL) {
+        return ALLOC_FAIL;
+    }
+    for (int i = 0; i < MEM_SIZE_CLASSES; ++i) {
+        pool_mgr->buddy_free[i] = NULL;
+    }
+    pool_mgr->buddy_free_mask = 0;
+    pool_mgr->buddy_max_order = _mem_size_class(pool_mgr->pool.total_size);
+    _mem_buddy_push(pool_mgr, pool_mgr->pool.mem, pool_mgr->buddy_max_order);
+
+    return ALLOC_OK;
+}
+
+// take the smallest free block of at least the needed order and split
+// it down, pushing the upper halves on their free lists
+static void *_mem_buddy_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    unsigned order = (size > 1) ? _mem_size_class(size - 1) + 1 : 0;
+    if (order < MEM_BUDDY_MIN_ORDER) {
+        order = MEM_BUDDY_MIN_ORDER;
+    }
+    if (order > pool_mgr->buddy_max_order) {
+        return NULL;
+    }
+
+    uint64_t fits = pool_mgr->buddy_free_mask & ~(((uint64_t) 1 << order) - 1);
+    if (fits == 0) {
+        return NULL;
+    }
+    unsigned block_order = _mem_ctz64(fits);
+    char *block = (char *) pool_mgr->buddy_free[block_order];
+    _mem_buddy_unlink(pool_mgr, block, block_order);
+
+    while (block_order > order) {
+        --block_order;
+        _mem_buddy_push(pool_mgr, block + ((size_t) 1 << block_order), block_order);
+    }
+    size_t unit = (size_t) (block - pool_mgr->pool.mem) >> MEM_BUDDY_MIN_ORDER;
+    pool_mgr->buddy_map[unit] = MEM_BUDDY_ALLOC | (unsigned char) order;
+
+    // the allocation record is a node that is not on any list
+    node_pt node = _mem_get_unused_node(pool_mgr);
+    assert(node != NULL);
+    node->generation++;
+    node->allocated = 1;
+    node->alloc_record.mem = block;
+    node->alloc_record.size = (size_t) 1 << order;
+
+    // update metadata (num_allocs, alloc_size): the whole block is taken
+    pool_mgr->pool.num_allocs++;
+    pool_mgr->pool.alloc_size += node->alloc_record.size;
+
+    return _mem_handle(pool_mgr, node);
+}
+
+// give the block back and merge with its buddy for as long as the buddy
+// is a free block of the same order
+static void _mem_buddy_free(pool_mgr_pt pool_mgr, node_pt node) {
+    char *block = node->alloc_record.mem;
+    unsigned order = _mem_size_class(node->alloc_record.size);
+
+    // update metadata (num_allocs, alloc_size)
+    pool_mgr->pool.num_allocs--;
+    pool_mgr->pool.alloc_size -= node->alloc_record.size;
+    _mem_release_node(pool_mgr, node);
+
+    size_t offset = (size_t) (block - pool_mgr->pool.mem);
+    pool_mgr->buddy_map[offset >> MEM_BUDDY_MIN_ORDER] = 0;
+    while (order < pool_mgr->buddy_max_order) {
+        size_t buddy = offset ^ ((size_t) 1 << order);
+        if (pool_mgr->buddy_map[buddy >> MEM_BUDDY_MIN_ORDER] != (MEM_BUDDY_FREE | order)) {
+            break;
+        }
+        _mem_buddy_unlink(pool_mgr, pool_mgr->pool.mem + buddy, order);
+        offset &= buddy;
+        ++order;
+    }
+    _mem_buddy_push(pool_mgr, pool_mgr->pool.mem + offset, order);
+}
+
+static void _mem_buddy_push(pool_mgr_pt pool_mgr, char *block, unsigned order) {
+    buddy_link_pt link = (buddy_link_pt) block;
+    buddy_link_pt head = pool_mgr->buddy_free[order];
+
+    link->prev = NULL;
+    link->next = head;
+    if (head != NULL) {
+        head->prev = link;
+    }
+    pool_mgr->buddy_free[order] = link;
+    pool_mgr->buddy_free_mask |= (uint64_t) 1 << order;
+    pool_mgr->buddy_map[(size_t) (block - pool_mgr->pool.mem) >> MEM_BUDDY_MIN_ORDER] =
+            MEM_BUDDY_FREE | (unsigned char) order;
+
+    // update metadata (num_gaps)
+    pool_mgr->pool.num_gaps++;
+}
+
+static void _mem_buddy_unlink(pool_mgr_pt pool_mgr, char *block, unsigned order) {
+    buddy_link_pt link = (buddy_link_pt) block;
+
+    if (link->prev != NULL) {
+        link->prev->next = link->next;
+    } else {
+        pool_mgr->buddy_free[order] = link->next;
+    }
+    if (link->next != NULL) {
+        link->next->prev = link->prev;
+    }
+    if (pool_mgr->buddy_free[order] == NULL) {
+        pool_mgr->buddy_free_mask &= ~((uint64_t) 1 << order);
+    }
+    pool_mgr->buddy_map[(size_t) (block - pool_mgr->pool.mem) >> MEM_BUDDY_MIN_ORDER] = 0;
+
+    // update metadata (num_gaps)
+    pool_mgr->pool.num_gaps--;
+}
+
+// one segment per block, free blocks are not merged even when adjacent
+static void _mem_buddy_inspect(pool_mgr_pt pool_mgr, pool_segment_pt *segments, unsigned *num_segments) {
+    unsigned count = pool_mgr->pool.num_allocs + pool_mgr->pool.num_gaps;
+    pool_segment_pt segs = malloc(sizeof(struct _pool_segment) * count);
+    assert(segs != NULL);
+
+    unsigned index = 0;
+    size_t offset = 0;
+    while (offset < pool_mgr->pool.total_size) {
+        unsigned char state = pool_mgr->buddy_map[offset >> MEM_BUDDY_MIN_ORDER];
+        size_t size = (size_t) 1 << (state & MEM_BUDDY_ORDER_MASK);
+
+        assert(state & (MEM_BUDDY_FREE | MEM_BUDDY_ALLOC));
+        assert(index < count);
+        segs[index].size = size;
+        segs[index].allocated = (state & MEM_BUDDY_ALLOC) ? 1 : 0;
+        ++index;
+        offset += size;
+    }
+
+    *segments = segs;
+    *num_segments = count;
+}
+
+// slots outside the pool count as allocated, so the ends never merge
+static int _mem_fixed_is_free(pool_mgr_pt pool_mgr, unsigned slot) {
+    if (slot >= pool_mgr->fixed_count) {
+        return 0;
+    }
+    return !((atomic_load_explicit(&pool_mgr->fixed_map[slot / 64], memory_order_relaxed) >> (slot % 64)) & 1);
+}
+
+// single-threaded: a plain read and write, no read-modify-write needed
+static void _mem_fixed_mark(pool_mgr_pt pool_mgr, unsigned slot, int allocated) {
+    _Atomic uint64_t *word = &pool_mgr->fixed_map[slot / 64];
+    uint64_t bit = (uint64_t) 1 << (slot % 64);
+    uint64_t bits = atomic_load_explicit(word, memory_order_relaxed);
+    atomic_store_explicit(word, allocated ? (bits | bit) : (bits & ~bit), memory_order_relaxed);
+}
+
+static void *_mem_fixed_alloc_lock_free(pool_mgr_pt pool_mgr) {
+    // pop the free slot stack; the tag goes up with every change of the
+    // head, so a head popped and pushed back in between fails the CAS
+    uint64_t head = atomic_load_explicit(&pool_mgr->fixed_lf_head, memory_order_acquire);
+    unsigned slot = (unsigned) head;
+    while (slot != MEM_NODE_NONE) {
+        unsigned next = atomic_load_explicit(&pool_mgr->fixed_lf_next[slot], memory_order_relaxed);
+        uint64_t popped = (((head >> 32) + 1) << 32) | next;
+        if (atomic_compare_exchange_weak_explicit(&pool_mgr->fixed_lf_head, &head, popped,
+                                                  memory_order_acquire, memory_order_acquire)) {
+            break;
+        }
+        slot = (unsigned) head;
+    }
+    // then a fresh slot, if any are left
+    if (slot == MEM_NODE_NONE) {
+        unsigned fresh = atomic_load_explicit(&pool_mgr->fixed_lf_fresh, memory_order_relaxed);
+        do {
+            if (fresh >= pool_mgr->fixed_count) {
+                return NULL;
+            }
+        } while (!atomic_compare_exchange_weak_explicit(&pool_mgr->fixed_lf_fresh, &fresh, fresh + 1,
+                                                        memory_order_relaxed, memory_order_relaxed));
+        slot = fresh;
+    }
+
+    atomic_fetch_or_explicit(&pool_mgr->fixed_map[slot / 64], (uint64_t) 1 << (slot % 64), memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool_mgr->fixed_lf_live, 1, memory_order_relaxed);
+
+    return pool_mgr->pool.mem + slot * pool_mgr->fixed_slot;
+}
+
+static alloc_status _mem_fixed_free_lock_free(pool_mgr_pt pool_mgr, unsigned slot) {
+    // clearing the bit is the check: of two frees of a slot, one sees it clear
+    uint64_t bit = (uint64_t) 1 << (slot % 64);
+    if (!(atomic_fetch_and_explicit(&pool_mgr->fixed_map[slot / 64], ~bit, memory_order_relaxed) & bit)) {
+        return ALLOC_FAIL;
+    }
+    atomic_fetch_sub_explicit(&pool_mgr->fixed_lf_live, 1, memory_order_relaxed);
+
+    // push the slot; release, so that a thread that pops it sees its link
+    uint64_t head = atomic_load_explicit(&pool_mgr->fixed_lf_head, memory_order_relaxed);
+    uint64_t pushed;
+    do {
+        atomic_store_explicit(&pool_mgr->fixed_lf_next[slot], (unsigned) head, memory_order_relaxed);
+        pushed = (((head >> 32) + 1) << 32) | slot;
+    } while (!atomic_compare_exchange_weak_explicit(&pool_mgr->fixed_lf_head, &head, pushed,
+                                                    memory_order_release, memory_order_relaxed));
+
+    return ALLOC_OK;
+}
+
+static void _mem_fixed_sync(pool_mgr_pt pool_mgr) {
+    // a lock-free pool keeps no gap count, nor pool_t counters that threads
+    // would fight over: work them out, for when the pool is quiet
+    if (!pool_mgr->fixed_lock_free) {
+        return;
+    }
+    unsigned live = atomic_load(&pool_mgr->fixed_lf_live);
+    unsigned gaps = 0;
+    for (unsigned slot = 0; slot < pool_mgr->fixed_count; ++slot) {
+        gaps += _mem_fixed_is_free(pool_mgr, slot) && ((slot == 0) || !_mem_fixed_is_free(pool_mgr, slot - 1));
+    }
+    pool_mgr->pool.num_allocs = live;
+    pool_mgr->pool.alloc_size = live * pool_mgr->fixed_slot;
+    pool_mgr->pool.num_gaps = gaps;
+}
+
+static void _mem_fixed_inspect(pool_mgr_pt pool_mgr, pool_segment_pt *segments, unsigned *num_segments) {
+    _mem_fixed_sync(pool_mgr);
+    unsigned count = pool_mgr->pool.num_allocs + pool_mgr->pool.num_gaps;
+    pool_segment_pt segs = malloc(sizeof(struct _pool_segment) * count);
+    assert(segs != NULL);
+
+    unsigned index = 0;
+    unsigned slot = 0;
+    while (slot < pool_mgr->fixed_count) {
+        assert(index < count);
+        if (!_mem_fixed_is_free(pool_mgr, slot)) {
+            segs[index].size = pool_mgr->fixed_slot;
+            segs[index].allocated = 1;
+            ++slot;
+        } else {
+            unsigned run = slot;
+            while (_mem_fixed_is_free(pool_mgr, slot)) ++slot;
+            segs[index].size = (slot - run) * pool_mgr->fixed_slot;
+            segs[index].allocated = 0;
+        }
+        ++index;
+    }
+
+    *segments = segs;
+    *num_segments = count;
+}
+
+static alloc_status _mem_bitmap_init(pool_mgr_pt pool_mgr) {
+    size_t granules = pool_mgr->pool.total_size >> MEM_GRANULE_SHIFT;
+    size_t words = (granules + 63) / 64;
+
+    words = (words + MEM_BITMAP_BLOCK_WORDS - 1) / MEM_BITMAP_BLOCK_WORDS * MEM_BITMAP_BLOCK_WORDS;
+    pool_mgr->bitmap_used = calloc(words, sizeof(uint64_t));
+    pool_mgr->bitmap_start = calloc(words, sizeof(uint64_t));
+    if ((pool_mgr->bitmap_used == NULL) || (pool_mgr->bitmap_start == NULL)) {
+        free(pool_mgr->bitmap_used);
+        free(pool_mgr->bitmap_start);
+        return ALLOC_FAIL;
+    }
+    pool_mgr->bitmap_words = words;
+    pool_mgr->bitmap_granules = granules;
+
+    // the padding past the last granule looks allocated, so no scan runs off the end
+    _mem_bitmap_set(pool_mgr->bitmap_used, granules, words * 64 - granules, 1);
+    pool_mgr->pool.num_gaps = 1;
+
+    return ALLOC_OK;
+}
+
+// first fit over the granule bitmap: the lowest run of free granules
+// that is long enough
+static void *_mem_bitmap_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    size_t run = (size > 0) ? ((size - 1) >> MEM_GRANULE_SHIFT) + 1 : 1;
+    size_t first = _mem_bitmap_find(pool_mgr->bitmap_used, pool_mgr->bitmap_words, run);
+    if (first == MEM_BITMAP_NONE) {
+        return NULL;
+    }
+
+    // the gap splits in two, shrinks, or disappears, depending on the neighbours
+    int left = _mem_bitmap_is_free(pool_mgr, first - 1);
+    int right = _mem_bitmap_is_free(pool_mgr, first + run);
+    pool_mgr->pool.num_gaps = pool_mgr->pool.num_gaps + (left & right) - (!left & !right);
+
+    _mem_bitmap_set(pool_mgr->bitmap_used, first, run, 1);
+    _mem_bitmap_set(pool_mgr->bitmap_start, first, 1, 1);
+
+    // the allocation record is a node that is not on any list
+    node_pt node = _mem_get_unused_node(pool_mgr);
+    assert(node != NULL);
+    node->generation++;
+    node->allocated = 1;
+    node->alloc_record.mem = pool_mgr->pool.mem + (first << MEM_GRANULE_SHIFT);
+    node->alloc_record.size = run << MEM_GRANULE_SHIFT;
+
+    // update metadata (num_allocs, alloc_size): whole granules are taken
+    pool_mgr->pool.num_allocs++;
+    pool_mgr->pool.alloc_size += node->alloc_record.size;
+
+    return _mem_handle(pool_mgr, node);
+}
+
+static void _mem_bitmap_free(pool_mgr_pt pool_mgr, node_pt node) {
+    size_t first = (size_t) (node->alloc_record.mem - pool_mgr->pool.mem) >> MEM_GRANULE_SHIFT;
+    size_t run = node->alloc_record.size >> MEM_GRANULE_SHIFT;
+
+    // update metadata (num_allocs, alloc_size)
+    pool_mgr->pool.num_allocs--;
+    pool_mgr->pool.alloc_size -= node->alloc_record.size;
+    _mem_release_node(pool_mgr, node);
+
+    _mem_bitmap_set(pool_mgr->bitmap_used, first, run, 0);
+    _mem_bitmap_set(pool_mgr->bitmap_start, first, 1, 0);
+
+    // the opposite of the allocation: gaps merge, grow, or appear
+    int left = _mem_bitmap_is_free(pool_mgr, first - 1);
+    int right = _mem_bitmap_is_free(pool_mgr, first + run);
+    pool_mgr->pool.num_gaps = pool_mgr->pool.num_gaps - (left & right) + (!left & !right);
+}
+
+// grow over the free granules that follow, or free the tail
+static alloc_status _mem_bitmap_resize(pool_mgr_pt pool_mgr, node_pt node, size_t new_size) {
+    size_t first = (size_t) (node->alloc_record.mem - pool_mgr->pool.mem) >> MEM_GRANULE_SHIFT;
+    size_t run = node->alloc_record.size >> MEM_GRANULE_SHIFT;
+    size_t new_run = (new_size > 0) ? ((new_size - 1) >> MEM_GRANULE_SHIFT) + 1 : 1;
+
+    if (new_run > run) {
+        for (size_t g = first + run; g < first + new_run; ++g) {
+            if (!_mem_bitmap_is_free(pool_mgr, g)) {
+                return ALLOC_FAIL;
+            }
+        }
+        _mem_bitmap_set(pool_mgr->bitmap_used, first + run, new_run - run, 1);
+        // the gap disappears if it was taken whole
+        if (!_mem_bitmap_is_free(pool_mgr, first + new_run)) {
+            pool_mgr->pool.num_gaps--;
+        }
+    } else if (new_run < run) {
+        // a new gap unless the tail joins the one after
+        if (!_mem_bitmap_is_free(pool_mgr, first + run)) {
+            pool_mgr->pool.num_gaps++;
+        }
+        _mem_bitmap_set(pool_mgr->bitmap_used, first + new_run, run - new_run, 0);
+    }
+    pool_mgr->pool.alloc_size = pool_mgr->pool.alloc_size - node->alloc_record.size + (new_run << MEM_GRANULE_SHIFT);
+    node->alloc_record.size = new_run << MEM_GRANULE_SHIFT;
+
+    return ALLOC_OK;
+}
+
+// granules outside the pool count as allocated
+static int _mem_bitmap_is_free(pool_mgr_pt pool_mgr, size_t granule) {
+    if (granule >= pool_mgr->bitmap_granules) {
+        return 0;
+    }
+    return !((pool_mgr->bitmap_used[granule / 64] >> (granule % 64)) & 1);
+}
+
+static void _mem_bitmap_set(uint64_t *map, size_t first, size_t count, int value) {
+    while (count > 0) {
+        size_t bit = first % 64;
+        size_t n = (count < 64 - bit) ? count : 64 - bit;
+        uint64_t mask = (n == 64) ? ~(uint64_t) 0 : (((uint64_t) 1 << n) - 1) << bit;
+
+        if (value) {
+            map[first / 64] |= mask;
+        } else {
+            map[first / 64] &= ~mask;
+        }
+        first += n;
+        count -= n;
+    }
+}
+
+static size_t _mem_bitmap_find(const uint64_t *map, size_t words, size_t run) {
+    switch (bitmap_scan_mode) {
+        case BITMAP_SCAN_BIT:
+            return _mem_bitmap_find_bit(map, words, run);
+        case BITMAP_SCAN_WORD:
+            return _mem_bitmap_find_word(map, words, run);
+        case BITMAP_SCAN_SIMD:
+        default:
+            return _mem_bitmap_find_simd(map, words, run);
+    }
+}
+
+// the reference scan, one granule at a time
+static size_t _mem_bitmap_find_bit(const uint64_t *map, size_t words, size_t run) {
+    size_t run_start = 0, run_len = 0;
+
+    for (size_t i = 0; i < words * 64; ++i) {
+        if ((map[i / 64] >> (i % 64)) & 1) {
+            run_len = 0;
+            continue;
+        }
+        if (run_len++ == 0) {
+            run_start = i;
+        }
+        if (run_len >= run) {
+            return run_start;
+        }
+    }
+
+    return MEM_BITMAP_NONE;
+}
+
+static size_t _mem_bitmap_find_word(const uint64_t *map, size_t words, size_t run) {
+    size_t run_start = 0, run_len = 0;
+
+    for (size_t w = 0; w < words; ++w) {
+        if (_mem_bitmap_scan_word(~map[w], w * 64, run, &run_start, &run_len)) {
+            return run_start;
+        }
+    }
+
+    return MEM_BITMAP_NONE;
+}
+
+// whole blocks that are all allocated or all free are settled with one
+// compare; mixed blocks go through the word scan
+static size_t _mem_bitmap_find_simd(const uint64_t *map, size_t words, size_t run) {
+#if defined(__AVX2__)
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    size_t run_start = 0, run_len = 0;
+
+    for (size_t w = 0; w < words; w += 4) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (map + w));
+        if (_mm256_testc_si256(block, ones)) {
+            run_len = 0;
+            continue;
+        }
+        if (_mm256_testz_si256(block, block)) {
+            if (run_len == 0) {
+                run_start = w * 64;
+            }
+            run_len += 256;
+            if (run_len >= run) {
+                return run_start;
+            }
+            continue;
+        }
+        for (size_t i = w; i < w + 4; ++i) {
+            if (_mem_bitmap_scan_word(~map[i], i * 64, run, &run_start, &run_len)) {
+                return run_start;
+            }
+        }
+    }
+
+    return MEM_BITMAP_NONE;
+#elif defined(__SSE2__)
+    const __m128i ones = _mm_set1_epi32(-1);
+    const __m128i zero = _mm_setzero_si128();
+    size_t run_start = 0, run_len = 0;
+
+    for (size_t w = 0; w < words; w += 2) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (map + w));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, ones)) == 0xffff) {
+            run_len = 0;
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero)) == 0xffff) {
+            if (run_len == 0) {
+                run_start = w * 64;
+            }
+            run_len += 128;
+            if (run_len >= run) {
+                return run_start;
+            }
+            continue;
+        }
+        for (size_t i = w; i < w + 2; ++i) {
+            if (_mem_bitmap_scan_word(~map[i], i * 64, run, &run_start, &run_len)) {
+                return run_start;
+            }
+        }
+    }
+
+    return MEM_BITMAP_NONE;
+#else
+    return _mem_bitmap_find_word(map, words, run);
+#endif
+}
+
+// carry the current run of free bits through one word; 1 once a run
+// is long enough, with its first bit in *run_start. Runs that fit in
+// the word are found with shift-and (bit i survives only if bits i to
+// i + run - 1 are free), in log(run) steps whatever the bit pattern
+static int _mem_bitmap_scan_word(uint64_t free_bits, size_t base, size_t run, size_t *run_start, size_t *run_len) {
+    if (free_bits == ~(uint64_t) 0) {
+        if (*run_len == 0) {
+            *run_start = base;
+        }
+        *run_len += 64;
+        return *run_len >= run;
+    }
+
+    // the run carried in ends at the first allocated bit of this word
+    if ((*run_len > 0) && (*run_len + _mem_ctz64(~free_bits) >= run)) {
+        return 1;
+    }
+
+    if (run <= 64) {
+        uint64_t starts = free_bits;
+        for (size_t k = 1; (k < run) && starts; ) {
+            size_t step = (k < run - k) ? k : run - k;
+            starts &= starts >> step;
+            k += step;
+        }
+        if (starts) {
+            *run_start = base + _mem_ctz64(starts);
+            return 1;
+        }
+    }
+
+    // carry the free bits at the top of the word into the next one
+    *run_len = _mem_clz64(~free_bits);
+    *run_start = base + 64 - *run_len;
+
+    return 0;
+}
+
+static void _mem_bitmap_inspect(pool_mgr_pt pool_mgr, pool_segment_pt *segments, unsigned *num_segments) {
+    unsigned count = pool_mgr->pool.num_allocs + pool_mgr->pool.num_gaps;
+    pool_segment_pt segs = malloc(sizeof(struct _pool_segment) * count);
+    assert(segs != NULL);
+
+    unsigned index = 0;
+    size_t granule = 0;
+    while (granule < pool_mgr->bitmap_granules) {
+        size_t first = granule;
+        assert(index < count);
+        if (_mem_bitmap_is_free(pool_mgr, granule)) {
+            while (_mem_bitmap_is_free(pool_mgr, granule)) ++granule;
+            segs[index].allocated = 0;
+        } else {
+            // an allocation runs up to the next start bit or free granule
+            ++granule;
+            while ((granule < pool_mgr->bitmap_granules) && !_mem_bitmap_is_free(pool_mgr, granule) &&
+                   !((pool_mgr->bitmap_start[granule / 64] >> (granule % 64)) & 1)) {
+                ++granule;
+            }
+            segs[index].allocated = 1;
+        }
+        segs[index].size = (granule - first) << MEM_GRANULE_SHIFT;
+        ++index;
+    }
+
+    *segments = segs;
+    *num_segments = count;
+}
+
+// gap index order: by size, then by position in the node heap (the
+// node address order of the old contiguous heap)
+static int _mem_gap_cmp(node_pt a, node_pt b) {
+    if (a->alloc_record.size != b->alloc_record.size) {
+        return (a->alloc_record.size < b->alloc_record.size) ? -1 : 1;
+    }
+    if (a->index != b->index) {
+        return (a->index < b->index) ? -1 : 1;
+    }
+    return 0;
+}
+
+static int _mem_gap_height(node_pt node) {
+    return node ? node->gap_height : 0;
+}
+
+static node_pt _mem_gap_rotate_right(node_pt node) {
+    node_pt left = node->gap_left;
+
+    node->gap_left = left->gap_right;
+    left->gap_right = node;
+    node->gap_height = 1 + MEM_MAX(_mem_gap_height(node->gap_left), _mem_gap_height(node->gap_right));
+    left->gap_height = 1 + MEM_MAX(_mem_gap_height(left->gap_left), _mem_gap_height(left->gap_right));
+
+    return left;
+}
+
+static node_pt _mem_gap_rotate_left(node_pt node) {
+    node_pt right = node->gap_right;
+
+    node->gap_right = right->gap_left;
+    right->gap_left = node;
+    node->gap_height = 1 + MEM_MAX(_mem_gap_height(node->gap_left), _mem_gap_height(node->gap_right));
+    right->gap_height = 1 + MEM_MAX(_mem_gap_height(right->gap_left), _mem_gap_height(right->gap_right));
+
+    return right;
+}
+
+// restore the AVL invariant at node, return the new subtree root
+static node_pt _mem_gap_rebalance(node_pt node) {
+    int balance = _mem_gap_height(node->gap_left) - _mem_gap_height(node->gap_right);
+
+    if (balance > 1) {
+        if (_mem_gap_height(node->gap_left->gap_left) < _mem_gap_height(node->gap_left->gap_right)) {
+            node->gap_left = _mem_gap_rotate_left(node->gap_left);
+        }
+        return _mem_gap_rotate_right(node);
+    }
+    if (balance < -1) {
+        if (_mem_gap_height(node->gap_right->gap_right) < _mem_gap_height(node->gap_right->gap_left)) {
+            node->gap_right = _mem_gap_rotate_right(node->gap_right);
+        }
+        return _mem_gap_rotate_left(node);
+    }
+
+    node->gap_height = 1 + MEM_MAX(_mem_gap_height(node->gap_left), _mem_gap_height(node->gap_right));
+    return node;
+}
+
+static node_pt _mem_gap_insert(node_pt root, node_pt node) {
+    if (root == NULL) {
+        node->gap_left = NULL;
+        node->gap_right = NULL;
+        node->gap_height = 1;
+        return node;
+    }
+
+    int cmp = _mem_gap_cmp(node, root);
+    assert(cmp != 0);
+    if (cmp < 0) {
+        root->gap_left = _mem_gap_insert(root->gap_left, node);
+    } else {
+        root->gap_right = _mem_gap_insert(root->gap_right, node);
+    }
+
+    return _mem_gap_rebalance(root);
+}
+
+// detach the leftmost node of the subtree into *min
+static node_pt _mem_gap_remove_min(node_pt root, node_pt *min) {
+    if (root->gap_left == NULL) {
+        *min = root;
+        return root->gap_right;
+    }
+    root->gap_left = _mem_gap_remove_min(root->gap_left, min);
+
+    return _mem_gap_rebalance(root);
+}
+
+static node_pt _mem_gap_remove(node_pt root, node_pt node) {
+    // the node must be in the index
+    assert(root != NULL);
+
+    int cmp = _mem_gap_cmp(node, root);
+    if (cmp < 0) {
+        root->gap_left = _mem_gap_remove(root->gap_left, node);
+    } else if (cmp > 0) {
+        root->gap_right = _mem_gap_remove(root->gap_right, node);
+    } else {
+        node_pt left = root->gap_left;
+        node_pt right = root->gap_right;
+
+        root->gap_left = NULL;
+        root->gap_right = NULL;
+        root->gap_height = 0;
+        if (right == NULL) {
+            return left;
+        }
+        // replace the removed node with its in-order successor
+        node_pt successor = NULL;
+        right = _mem_gap_remove_min(right, &successor);
+        successor->gap_left = left;
+        successor->gap_right = right;
+        root = successor;
+    }
+
+    return _mem_gap_rebalance(root);
+}
@@ -7,7 +7,31 @@
 
 /* type declarations */
 
-typedef enum _alloc_policy { FIRST_FIT, BEST_FIT } alloc_policy;
+typedef enum _alloc_policy {
+    FIRST_FIT,
+    BEST_FIT,
+    NEXT_FIT,
+    SEGREGATED_FIT,
+    BUDDY, // power-of-two pool size, allocations take power-of-two blocks
+    TLSF, // two-level segregated fit, O(1) allocation and deallocation
+    FIXED_SIZE, // equal-sized objects, only through mem_pool_open_fixed
+    BITMAP_FIT, // first fit over a bitmap of 16-byte granules, pool size a multiple of 16
+    LINEAR // bump pointer through mem_linear_alloc, freed only by mark/release or reset
+} alloc_policy;
+
+typedef enum _bitmap_scan {
+    BITMAP_SCAN_BIT, // one granule at a time, the reference
+    BITMAP_SCAN_WORD, // 64 granules at a time
+    BITMAP_SCAN_SIMD // 128 (SSE2) or 256 (AVX2) granules at a time, else as WORD
+} bitmap_scan;
+
+typedef enum _pool_backing {
+    BACKING_MALLOC, // aligned_alloc
+    BACKING_MMAP, // anonymous mmap, 4K pages
+    BACKING_THP, // anonymous mmap on a huge page boundary, madvise(MADV_HUGEPAGE); else as MMAP
+    BACKING_HUGETLB, // mmap(MAP_HUGETLB) from the reserved huge pages; else as THP
+    BACKING_FILE // a pool file, only through mem_pool_open_file and mem_pool_attach_file
+} pool_backing;
 
 typedef struct _pool {
     char *mem;
@@ -18,11 +42,41 @@ typedef struct _pool {
     unsigned num_gaps;
 } pool_t, *pool_pt;
 
+typedef struct _pool_options {
+    size_t alignment; // of every allocation: a power of two up to 4096, 0 for none
+    unsigned stripes; // thread-safe: a lock per address range, a power of two up to 64; 0 for none. An allocation has to fit in one range, and an empty pool has a gap per range
+    int lock_free; // FIXED_SIZE only: mem_fixed_alloc and mem_fixed_free from any thread, with no locks
+    pool_backing backing; // where the pool memory comes from; on huge pages, allocations of 2M and up are 2M-aligned
+} pool_options_t, *pool_options_pt;
+
 typedef struct _pool_segment {
     size_t size;
     unsigned long allocated; // 1-allocation, 0-gap (note: 8 bytes)
 } pool_segment_t, *pool_segment_pt;
 
+typedef struct _pool_mark {
+    size_t offset; // LINEAR: the bump pointer
+    size_t alloc_size; // and pool_t::alloc_size and num_allocs to go back to
+    unsigned num_allocs;
+    unsigned long epoch; // releases before it, to tell whether one since went below it
+} pool_mark_t;
+
+typedef struct _pool_stats {
+    unsigned total_nodes; // capacity of the node heap
+    unsigned used_nodes; // nodes on the segment list
+    unsigned long unused_node_hits; // nodes taken from the unused node list
+    unsigned long node_heap_grows; // times the node heap had to expand
+    unsigned long size_class_hits; // SEGREGATED_FIT: served from the request's size class
+    unsigned long size_class_splits; // SEGREGATED_FIT: served from a larger size class
+    unsigned long size_class_misses; // SEGREGATED_FIT: no gap was large enough
+    unsigned long remote_frees; // thread-safe: frees queued for the stripe's owner by other threads
+    unsigned long remote_drains; // queues emptied, each as one batch
+    unsigned long remote_drain_ns; // time spent draining, in all
+    unsigned remote_depth; // frees on the queues now
+    unsigned remote_max_drain; // most frees drained at once
+    pool_backing backing; // what the pool memory came from, after any fallback
+} pool_stats_t, *pool_stats_pt;
+
 typedef enum _alloc_status {
     ALLOC_OK,
     ALLOC_FAIL,
@@ -41,15 +95,93 @@ mem_free();
 pool_pt
 mem_pool_open(size_t size, alloc_policy policy);
 
+pool_pt
+mem_pool_open_ex(size_t size, alloc_policy policy, const pool_options_t *options);
+
+pool_pt
+mem_pool_open_sharded(size_t size, alloc_policy policy);
+
+pool_pt
+mem_pool_open_file(const char *path, size_t size, alloc_policy policy);
+
+pool_pt
+mem_pool_attach_file(const char *path);
+
+alloc_status
+mem_pool_sync(pool_pt pool);
+
+void
+mem_pool_crash_at(unsigned long step);
+
 alloc_status
 mem_pool_close(pool_pt pool);
 
+alloc_status
+mem_pool_reset(pool_pt pool);
+
+alloc_status
+mem_pool_close_force(pool_pt pool);
+
 void *
 mem_new_alloc(pool_pt pool, size_t size);
 
+void *
+mem_new_alloc_aligned(pool_pt pool, size_t size, size_t alignment);
+
+alloc_status
+mem_new_alloc_batch(pool_pt pool, const size_t sizes[], unsigned n, void *out[]);
+
 alloc_status
 mem_del_alloc(pool_pt pool, void *alloc);
 
+alloc_status
+mem_del_alloc_batch(pool_pt pool, void *allocs[], unsigned n);
+
+alloc_status
+mem_pool_drain(pool_pt pool);
+
+void *
+mem_alloc_at(pool_pt pool, size_t offset);
+
+void *
+mem_realloc(pool_pt pool, void *alloc, size_t new_size);
+
+void *
+mem_cache_alloc(pool_pt pool, size_t size);
+
+alloc_status
+mem_cache_free(pool_pt pool, void *alloc);
+
+alloc_status
+mem_cache_flush(pool_pt pool);
+
+pool_pt
+mem_pool_open_fixed(size_t obj_size, unsigned count);
+
+pool_pt
+mem_pool_open_fixed_ex(size_t obj_size, unsigned count, const pool_options_t *options);
+
+void *
+mem_fixed_alloc(pool_pt pool);
+
+alloc_status
+mem_fixed_free(pool_pt pool, void *obj);
+
 void
 mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments);
+
+void *
+mem_linear_alloc(pool_pt pool, size_t size);
+
+pool_mark_t
+mem_pool_mark(pool_pt pool);
+
+alloc_status
+mem_pool_release_to(pool_pt pool, pool_mark_t mark);
+
+void
+mem_bitmap_scan_mode(bitmap_scan mode);
+
+void
+mem_pool_stats(pool_pt pool, pool_stats_pt stats);
 #endif //C_MEM_POOL_H
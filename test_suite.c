@@ -4,10 +4,17 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 #include "cmocka.h"
 
 #include "mem_pool.h"
@@ -2391,48 +2398,1919 @@ void test_pool_stresstest0(void **state) {
     assert_int_equal(mem_free(), ALLOC_OK);
 }
 
+#define STRESS_THREADS 8
+#define STRESS_THREAD_POOLS 16
+
+static void *stresstest1_worker(void *arg) {
+    unsigned seed = *(unsigned *) arg;
+    unsigned long failures = 0;
+    pool_pt pools[STRESS_THREAD_POOLS] = { NULL };
+
+    // open and close pools in a pseudo-random order, each pool seeing only
+    // its own allocation; cmocka cannot assert off the main thread, so count
+    for (unsigned round = 0; round < 2000; ++round) {
+        seed = seed * 1103515245 + 12345;
+        unsigned pix = (seed >> 16) % STRESS_THREAD_POOLS;
+        if (pools[pix] == NULL) {
+            pools[pix] = mem_pool_open(1024 + pix, (pix % 2) ? FIRST_FIT : TLSF);
+            void *alloc = pools[pix] ? mem_new_alloc(pools[pix], pix + 1) : NULL;
+            failures += (alloc == NULL) || (pools[pix]->num_allocs != 1) ||
+                        (mem_del_alloc(pools[pix], alloc) != ALLOC_OK);
+        } else {
+            failures += (mem_pool_close(pools[pix]) != ALLOC_OK);
+            pools[pix] = NULL;
+        }
+    }
+    for (unsigned pix = 0; pix < STRESS_THREAD_POOLS; ++pix) {
+        if (pools[pix]) {
+            failures += (mem_pool_close(pools[pix]) != ALLOC_OK);
+        }
+    }
+
+    return (void *) failures;
+}
+
+void test_pool_stresstest1(void **state) {
+    (void) state; /* unused */
+
+    pthread_t threads[STRESS_THREADS];
+    unsigned seeds[STRESS_THREADS];
+
+    /*
+     * Testing the pool store under concurrent open and close:
+     *
+     * 1. 8 threads open and close up to 16 pools each, 2000 times
+     * 2. The store grows from 20 slots while other threads search it
+     * 3. A pool closed once is gone from the store and cannot be closed again
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (unsigned t = 0; t < STRESS_THREADS; ++t) {
+        seeds[t] = t + 1;
+        assert_int_equal(pthread_create(&threads[t], NULL, stresstest1_worker, &seeds[t]), 0);
+    }
+    for (unsigned t = 0; t < STRESS_THREADS; ++t) {
+        void *failures;
+        assert_int_equal(pthread_join(threads[t], &failures), 0);
+        assert_int_equal((unsigned long) failures, 0);
+    }
+
+    // slots freed by the threads are claimed again
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    pool_pt other = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(other);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_close(other), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_FAIL);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
 
 /*******************************************/
-/***         6. DRIVER ROUTINE           ***/
+/***        6. POOL EXTENSIONS           ***/
 /*******************************************/
 
-int run_test_suite() {
-    const struct CMUnitTest tests[] = {
-            // General tests
-            cmocka_unit_test(test_pool_store_smoketest),
-            cmocka_unit_test(test_pool_smoketest),
+static void test_pool_node_stats(void **state) {
+    pool_pt pool = *state;
+    pool_stats_t stats;
 
-            cmocka_unit_test(test_pool_nonempty),
+    /*
+     * Every split takes its gap node off the unused node list, and
+     * every merge puts the retired node back, so the node heap does
+     * not have to grow for a pool that stays small.
+     */
 
-            cmocka_unit_test_setup_teardown(test_pool_ff_metadata, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_bf_metadata, pool_bf_setup, pool_bf_teardown),
+    const unsigned NUM_ALLOCS = 10;
+    void *allocs[NUM_ALLOCS];
 
-            // First-fit tests
-            cmocka_unit_test_setup_teardown(test_pool_scenario00, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario01, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario02, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario03, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario04, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario05, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario06, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario07, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario08, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario09, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario10, pool_ff_setup, pool_ff_teardown),
+    for (int round = 1; round <= 2; ++round) {
+        for (int i = 0; i < NUM_ALLOCS; ++i) {
+            allocs[i] = mem_new_alloc(pool, 100);
+            assert_non_null(allocs[i]);
+        }
 
-            // Best-fit tests
-            cmocka_unit_test_setup_teardown(test_pool_scenario11, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario12, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario13, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario14, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario15, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario16, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario17, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario18, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario19, pool_bf_setup, pool_bf_teardown),
+        mem_pool_stats(pool, &stats);
+        assert_int_equal(stats.used_nodes, NUM_ALLOCS + 1);
+        assert_int_equal(stats.unused_node_hits, round * NUM_ALLOCS);
+        assert_int_equal(stats.node_heap_grows, 0);
+
+        for (int i = 0; i < NUM_ALLOCS; ++i) {
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+        }
+
+        mem_pool_stats(pool, &stats);
+        assert_int_equal(stats.used_nodes, 1);
+    }
+}
+
+static void test_pool_bad_handles(void **state) {
+    pool_pt pool = *state;
+
+    /*
+     * Freeing is O(1) on the handle, which is checked instead of
+     * searched for: stale, foreign and garbage handles are refused, and
+     * a stale handle stays stale when its node is reused, 70000 times.
+     */
+
+    pool_pt other = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(other);
+
+    void * alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    void * alloc1 = mem_new_alloc(other, 100);
+    assert_non_null(alloc1);
+
+    // foreign handle
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(other, alloc0), ALLOC_FAIL);
+
+    // garbage handles
+    int not_a_handle = 0;
+    assert_int_equal(mem_del_alloc(pool, &not_a_handle), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, NULL), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, (char *) alloc0 + 1), ALLOC_FAIL);
+
+    // stale handle
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_FAIL);
+
+    // stale handle, its node taken by the next allocation
+    void * alloc2 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc2);
+    assert_ptr_not_equal(alloc2, alloc0);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_FAIL);
+    assert_int_equal(pool->num_allocs, 1);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+
+    // stale handle, its node reused past any truncated generation
+    for (unsigned i = 0; i < 70000; ++i) {
+        void *again = mem_new_alloc(pool, 100);
+        assert_ptr_not_equal(again, alloc0);
+        assert_int_equal(mem_del_alloc(pool, again), ALLOC_OK);
+    }
+    alloc2 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc2);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+
+    assert_int_equal(pool->num_allocs, 0);
+    assert_int_equal(pool->num_gaps, 1);
+
+    assert_int_equal(mem_del_alloc(other, alloc1), ALLOC_OK);
+    assert_int_equal(mem_pool_close(other), ALLOC_OK);
+}
+
+static void test_pool_next_fit(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * NEXT_FIT resumes where the last allocation ended:
+     *
+     * 1. Allocate 3 x 100, deallocate the first one.
+     * 2. Allocate 50. FIRST_FIT would take the gap at the top, NEXT_FIT
+     *    continues in the gap after the last allocation.
+     * 3. Deallocate everything. The cursor's node is merged away and the
+     *    cursor has to land on a live node.
+     * 4. Allocate 100, which goes to the top of the pool again.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, NEXT_FIT);
+    assert_non_null(pool);
+
+    void * alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    void * alloc1 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc1);
+    void * alloc2 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc2);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+
+    void * alloc3 = mem_new_alloc(pool, 50);
+    assert_non_null(alloc3);
+    pool_segment_t exp0[5] =
+            {
+                    {100, 0},
+                    {100, 1},
+                    {100, 1},
+                    {50, 1},
+                    {pool->total_size - 350, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, NEXT_FIT, POOL_SIZE, 250, 3, 2);
+
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    pool_segment_t exp1[1] =
+            {
+                    {pool->total_size, 0}
+            };
+    check_pool(pool, exp1);
+
+    alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    pool_segment_t exp2[2] =
+            {
+                    {100, 1},
+                    {pool->total_size - 100, 0}
+            };
+    check_pool(pool, exp2);
+
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_segregated_fit(void **state) {
+    (void) state; /* unused */
+    pool_stats_t stats;
+
+    /*
+     * SEGREGATED_FIT keeps a gap list per power-of-two size class:
+     *
+     * 1. Allocate 10 x 64 and 10 x 200. Each one splits the big gap,
+     *    which sits in a larger class.
+     * 2. Deallocate 5 of the 64s. They don't touch, so there are five
+     *    64-byte gaps in class [64, 128).
+     * 3. Allocate 64: served from its own class.
+     * 4. Allocate 100: rounded up to class [128, 256), so the 64-byte
+     *    gaps are never looked at, and the big gap is split.
+     * 5. Allocate more than the big gap: nothing fits.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, SEGREGATED_FIT);
+    assert_non_null(pool);
+
+    const unsigned NUM_ALLOCS = 10;
+    void *small[NUM_ALLOCS], *large[NUM_ALLOCS];
+    for (int i = 0; i < NUM_ALLOCS; ++i) {
+        small[i] = mem_new_alloc(pool, 64);
+        assert_non_null(small[i]);
+        large[i] = mem_new_alloc(pool, 200);
+        assert_non_null(large[i]);
+    }
+    for (int i = 0; i < NUM_ALLOCS; i += 2) {
+        assert_int_equal(mem_del_alloc(pool, small[i]), ALLOC_OK);
+        small[i] = NULL;
+    }
+    check_metadata(pool, SEGREGATED_FIT, POOL_SIZE, 5 * 64 + 10 * 200, 15, 6);
+
+    void * alloc0 = mem_new_alloc(pool, 64);
+    assert_non_null(alloc0);
+    void * alloc1 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc1);
+    size_t big_gap = POOL_SIZE - NUM_ALLOCS * (64 + 200) - 100;
+    assert_null(mem_new_alloc(pool, big_gap + 1));
+
+    mem_pool_stats(pool, &stats);
+    assert_int_equal(stats.size_class_hits, 1);
+    assert_int_equal(stats.size_class_splits, 2 * NUM_ALLOCS + 1);
+    assert_int_equal(stats.size_class_misses, 1);
+    check_metadata(pool, SEGREGATED_FIT, POOL_SIZE, 6 * 64 + 10 * 200 + 100, 17, 5);
+
+    // clean up, coalescing back to one gap
+    for (int i = 0; i < NUM_ALLOCS; ++i) {
+        if (small[i])
+            assert_int_equal(mem_del_alloc(pool, small[i]), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(pool, large[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    check_metadata(pool, SEGREGATED_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_buddy(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * BUDDY pools are a power of two and hand out power-of-two blocks:
+     *
+     * 1. A pool that is not a power of two is refused.
+     * 2. Allocate 100 in a 1024 pool: the pool is split down to a 128
+     *    block, leaving free buddies of 128, 256 and 512.
+     * 3. Allocate 200 and 16: 256 from its free list, 16 by splitting
+     *    the 128.
+     * 4. Deallocate 100 and 16: the two 128s merge into a 256 block.
+     * 5. Deallocate 200: everything merges back into the 1024 block.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    assert_null(mem_pool_open(1000, BUDDY));
+    pool_pt pool = mem_pool_open(1024, BUDDY);
+    assert_non_null(pool);
+    check_metadata(pool, BUDDY, 1024, 0, 0, 1);
+
+    void * alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    pool_segment_t exp0[4] =
+            {
+                    {128, 1},
+                    {128, 0},
+                    {256, 0},
+                    {512, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, BUDDY, 1024, 128, 1, 3);
+
+    void * alloc1 = mem_new_alloc(pool, 200);
+    assert_non_null(alloc1);
+    void * alloc2 = mem_new_alloc(pool, 16);
+    assert_non_null(alloc2);
+    pool_segment_t exp1[7] =
+            {
+                    {128, 1},
+                    {16, 1},
+                    {16, 0},
+                    {32, 0},
+                    {64, 0},
+                    {256, 1},
+                    {512, 0}
+            };
+    check_pool(pool, exp1);
+    check_metadata(pool, BUDDY, 1024, 400, 3, 4);
+
+    // nothing of 512 + 1 fits, even though 624 bytes are free
+    assert_null(mem_new_alloc(pool, 513));
+
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    pool_segment_t exp2[3] =
+            {
+                    {256, 0},
+                    {256, 1},
+                    {512, 0}
+            };
+    check_pool(pool, exp2);
+
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_FAIL);
+    pool_segment_t exp3[1] =
+            {
+                    {1024, 0}
+            };
+    check_pool(pool, exp3);
+    check_metadata(pool, BUDDY, 1024, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_tlsf(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * TLSF picks a good fit in constant time:
+     *
+     * 1. Allocate 10 x 100.
+     * 2. Deallocate 1, 2, 3 (one 300 gap) and 6 (a 100 gap).
+     * 3. Allocate 90: it goes to the 100 gap, not the first gap that fits.
+     * 4. Deallocate everything, merging back to one gap.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, TLSF);
+    assert_non_null(pool);
+
+    const unsigned NUM_ALLOCS = 10;
+    void *allocs[NUM_ALLOCS];
+    for (int i = 0; i < NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK); allocs[1] = NULL;
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK); allocs[3] = NULL;
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK); allocs[2] = NULL;
+    assert_int_equal(mem_del_alloc(pool, allocs[6]), ALLOC_OK); allocs[6] = NULL;
+
+    void * alloc0 = mem_new_alloc(pool, 90);
+    assert_non_null(alloc0);
+    pool_segment_t exp0[10] =
+            {
+                    {100, 1},
+                    {300, 0},
+                    {100, 1},
+                    {100, 1},
+                    {90, 1},
+                    {10, 0},
+                    {100, 1},
+                    {100, 1},
+                    {100, 1},
+                    {pool->total_size - 1000, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, TLSF, POOL_SIZE, 690, 7, 3);
+
+    for (int i = 0; i < NUM_ALLOCS; ++i) {
+        if (allocs[i])
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    check_metadata(pool, TLSF, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_fixed(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * A fixed-size pool hands out equal slots:
+     *
+     * 1. Allocate 5 of 10 objects of 24 bytes, in address order.
+     * 2. Deallocate 1 and 3, and try a double free and a misaligned free.
+     * 3. Allocate 1: it reuses the last freed slot.
+     * 4. Allocate until the pool is full.
+     * 5. Deallocate everything, back to one gap.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open_fixed(24, 10);
+    assert_non_null(pool);
+    check_metadata(pool, FIXED_SIZE, 240, 0, 0, 1);
+
+    const unsigned NUM_OBJS = 10;
+    char *objs[NUM_OBJS];
+    for (int i = 0; i < 5; ++i) {
+        objs[i] = mem_fixed_alloc(pool);
+        assert_ptr_equal(objs[i], pool->mem + i * 24);
+    }
+    assert_int_equal(mem_fixed_free(pool, objs[1]), ALLOC_OK);
+    assert_int_equal(mem_fixed_free(pool, objs[3]), ALLOC_OK);
+    assert_int_equal(mem_fixed_free(pool, objs[3]), ALLOC_FAIL);
+    assert_int_equal(mem_fixed_free(pool, objs[2] + 1), ALLOC_FAIL);
+    assert_null(mem_new_alloc(pool, 24));
+    pool_segment_t exp0[6] =
+            {
+                    {24, 1},
+                    {24, 0},
+                    {24, 1},
+                    {24, 0},
+                    {24, 1},
+                    {120, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, FIXED_SIZE, 240, 72, 3, 3);
+
+    assert_ptr_equal(mem_fixed_alloc(pool), objs[3]);
+    assert_ptr_equal(mem_fixed_alloc(pool), objs[1]);
+    for (int i = 5; i < NUM_OBJS; ++i) {
+        objs[i] = mem_fixed_alloc(pool);
+        assert_non_null(objs[i]);
+    }
+    assert_null(mem_fixed_alloc(pool));
+    check_metadata(pool, FIXED_SIZE, 240, 240, 10, 0);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+
+    for (int i = 0; i < NUM_OBJS; ++i) {
+        assert_int_equal(mem_fixed_free(pool, objs[i]), ALLOC_OK);
+    }
+    check_metadata(pool, FIXED_SIZE, 240, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_bitmap_fit(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * BITMAP_FIT rounds to 16-byte granules and takes the lowest run
+     * that fits:
+     *
+     * 1. Allocate 100, 16, 1 and 200.
+     * 2. Deallocate the 16 and the 1 (one 32 gap).
+     * 3. Allocate 20: it fits the 32 gap.
+     * 4. Allocate 40: it does not, and goes after the 200.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    assert_null(mem_pool_open(1000, BITMAP_FIT));
+    pool_pt pool = mem_pool_open(1024, BITMAP_FIT);
+    assert_non_null(pool);
+
+    void *alloc0 = mem_new_alloc(pool, 100);
+    void *alloc1 = mem_new_alloc(pool, 16);
+    void *alloc2 = mem_new_alloc(pool, 1);
+    void *alloc3 = mem_new_alloc(pool, 200);
+    assert_non_null(alloc3);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_FAIL);
+
+    void *alloc4 = mem_new_alloc(pool, 20);
+    void *alloc5 = mem_new_alloc(pool, 40);
+    assert_non_null(alloc5);
+    pool_segment_t exp0[5] =
+            {
+                    {112, 1},
+                    {32, 1},
+                    {208, 1},
+                    {48, 1},
+                    {624, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, BITMAP_FIT, 1024, 400, 4, 1);
+
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc4), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc5), ALLOC_OK);
+    check_metadata(pool, BITMAP_FIT, 1024, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_bitmap_scan(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * The word and SIMD scans place every allocation where the granule
+     * at a time scan does:
+     *
+     * 1. For each scan mode, run the same random mix of allocations
+     *    and deallocations on a BITMAP_FIT pool, recording the layout
+     *    after every step (and whether the allocation failed).
+     * 2. Compare the layouts.
+     */
+
+    const unsigned NUM_OPS = 5000;
+    const unsigned NUM_LIVE = 200;
+    const bitmap_scan modes[] = { BITMAP_SCAN_BIT, BITMAP_SCAN_WORD, BITMAP_SCAN_SIMD };
+    const unsigned NUM_MODES = sizeof(modes) / sizeof(modes[0]);
+    unsigned long *placed[NUM_MODES];
+    pool_segment_pt segs[NUM_MODES];
+    unsigned num_segs[NUM_MODES];
+
+    for (unsigned m = 0; m < NUM_MODES; ++m) {
+        void *live[NUM_LIVE];
+        unsigned seed = 2463534242u;
+
+        placed[m] = malloc(NUM_OPS * sizeof(unsigned long));
+        assert_non_null(placed[m]);
+        for (unsigned i = 0; i < NUM_LIVE; ++i) live[i] = NULL;
+
+        mem_bitmap_scan_mode(modes[m]);
+        assert_int_equal(mem_init(), ALLOC_OK);
+        pool_pt pool = mem_pool_open(65536, BITMAP_FIT);
+        assert_non_null(pool);
+
+        for (unsigned op = 0; op < NUM_OPS; ++op) {
+            seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+            unsigned i = seed % NUM_LIVE;
+            if (live[i]) {
+                assert_int_equal(mem_del_alloc(pool, live[i]), ALLOC_OK);
+            }
+            live[i] = mem_new_alloc(pool, 1 + (seed >> 8) % 2000);
+
+            // the layout after each step, hashed
+            pool_segment_pt step = NULL;
+            unsigned num_step = 0;
+            unsigned long hash = live[i] ? 1 : 0;
+            mem_inspect_pool(pool, &step, &num_step);
+            for (unsigned u = 0; u < num_step; ++u) {
+                hash = hash * 31 + step[u].size * 2 + step[u].allocated;
+            }
+            free(step);
+            placed[m][op] = hash;
+        }
+        mem_inspect_pool(pool, &segs[m], &num_segs[m]);
+
+        for (unsigned i = 0; i < NUM_LIVE; ++i) {
+            if (live[i]) assert_int_equal(mem_del_alloc(pool, live[i]), ALLOC_OK);
+        }
+        check_metadata(pool, BITMAP_FIT, 65536, 0, 0, 1);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+        assert_int_equal(mem_free(), ALLOC_OK);
+    }
+    mem_bitmap_scan_mode(BITMAP_SCAN_SIMD);
+
+    for (unsigned m = 1; m < NUM_MODES; ++m) {
+        assert_memory_equal(placed[m], placed[0], NUM_OPS * sizeof(unsigned long));
+        assert_int_equal(num_segs[m], num_segs[0]);
+        assert_memory_equal(segs[m], segs[0], num_segs[0] * sizeof(pool_segment_t));
+    }
+    for (unsigned m = 0; m < NUM_MODES; ++m) {
+        free(placed[m]);
+        free(segs[m]);
+    }
+}
+
+static void test_pool_aligned(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Alignment padding becomes a gap that later allocations can use:
+     *
+     * 1. Allocate 10, then 100 aligned to 64 and 1 aligned to 4096.
+     * 2. Allocate 20: it goes into the padding in front of the 100.
+     * 3. Deallocate the 100, merging the padding gaps around it.
+     * 4. In a pool opened with 64-byte alignment, every allocation is
+     *    aligned.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal((size_t) pool->mem % 4096, 0);
+
+    void *alloc0 = mem_new_alloc(pool, 10);
+    void *alloc1 = mem_new_alloc_aligned(pool, 100, 64);
+    void *alloc2 = mem_new_alloc_aligned(pool, 1, 4096);
+    assert_null(mem_new_alloc_aligned(pool, 1, 3));
+    assert_null(mem_new_alloc_aligned(pool, 1, 8192));
+    void *alloc3 = mem_new_alloc(pool, 20);
+    assert_non_null(alloc3);
+    pool_segment_t exp0[7] =
+            {
+                    {10, 1},
+                    {20, 1},
+                    {34, 0},
+                    {100, 1},
+                    {3932, 0},
+                    {1, 1},
+                    {POOL_SIZE - 4097, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 131, 4, 3);
+
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    pool_segment_t exp1[5] =
+            {
+                    {10, 1},
+                    {20, 1},
+                    {4066, 0},
+                    {1, 1},
+                    {POOL_SIZE - 4097, 0}
+            };
+    check_pool(pool, exp1);
+
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool_options_t options = { .alignment = 64 };
+    pool = mem_pool_open_ex(POOL_SIZE, BEST_FIT, &options);
+    assert_non_null(pool);
+
+    void *allocs[3];
+    for (int i = 0; i < 3; ++i) {
+        allocs[i] = mem_new_alloc(pool, 10);
+        assert_non_null(allocs[i]);
+    }
+    pool_segment_t exp2[6] =
+            {
+                    {10, 1},
+                    {54, 0},
+                    {10, 1},
+                    {54, 0},
+                    {10, 1},
+                    {POOL_SIZE - 138, 0}
+            };
+    check_pool(pool, exp2);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 30, 3, 3);
+
+    for (int i = 0; i < 3; ++i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_realloc(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * mem_realloc resizes in place when it can:
+     *
+     * 1. Allocate 100, 100, 100 and deallocate the middle one.
+     * 2. Grow the first to 150: in place, into the gap.
+     * 3. Grow it to 200: in place, the gap is used up.
+     * 4. Shrink it to 50: the tail becomes a gap.
+     * 5. Grow the last to 300 (into the big gap), then the first to
+     *    400: it has to move, past the last.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    void *alloc0 = mem_new_alloc(pool, 100);
+    void *alloc1 = mem_new_alloc(pool, 100);
+    void *alloc2 = mem_new_alloc(pool, 100);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+
+    assert_ptr_equal(mem_realloc(pool, alloc0, 150), alloc0);
+    pool_segment_t exp0[4] =
+            {
+                    {150, 1},
+                    {50, 0},
+                    {100, 1},
+                    {POOL_SIZE - 300, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 250, 2, 2);
+
+    assert_ptr_equal(mem_realloc(pool, alloc0, 200), alloc0);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 300, 2, 1);
+
+    assert_ptr_equal(mem_realloc(pool, alloc0, 50), alloc0);
+    pool_segment_t exp1[4] =
+            {
+                    {50, 1},
+                    {150, 0},
+                    {100, 1},
+                    {POOL_SIZE - 300, 0}
+            };
+    check_pool(pool, exp1);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 150, 2, 2);
+
+    assert_ptr_equal(mem_realloc(pool, alloc2, 300), alloc2);
+    void *moved = mem_realloc(pool, alloc0, 400);
+    assert_non_null(moved);
+    assert_ptr_not_equal(moved, alloc0);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_FAIL);
+    pool_segment_t exp2[4] =
+            {
+                    {200, 0},
+                    {300, 1},
+                    {400, 1},
+                    {POOL_SIZE - 900, 0}
+            };
+    check_pool(pool, exp2);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 700, 2, 2);
+
+    assert_null(mem_realloc(pool, moved, POOL_SIZE));
+    assert_int_equal(mem_del_alloc(pool, moved), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_batch_alloc(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * A batch is carved from one gap when one is large enough:
+     *
+     * 1. Allocate 100 and 50, deallocate the 100.
+     * 2. Allocate a batch of 30, 40, 50: back to back after the 50.
+     * 3. Allocate a batch of 60, 40: it fills the first gap exactly.
+     * 4. Deallocate the 50 and allocate a batch of 50 and the whole
+     *    last gap: no gap fits both, so they are placed one at a time.
+     * 5. Deallocate the 30 and the 50 of the first batch and allocate a
+     *    batch of 40, 40: the second does not fit and the first is
+     *    given back.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    void *alloc0 = mem_new_alloc(pool, 100);
+    void *alloc1 = mem_new_alloc(pool, 50);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+
+    const size_t sizes0[] = { 30, 40, 50 };
+    void *batch0[3];
+    assert_int_equal(mem_new_alloc_batch(pool, sizes0, 3, batch0), ALLOC_OK);
+    pool_segment_t exp0[6] =
+            {
+                    {100, 0},
+                    {50, 1},
+                    {30, 1},
+                    {40, 1},
+                    {50, 1},
+                    {POOL_SIZE - 270, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 170, 4, 2);
+
+    const size_t sizes1[] = { 60, 40 };
+    void *batch1[2];
+    assert_int_equal(mem_new_alloc_batch(pool, sizes1, 2, batch1), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 270, 6, 1);
+
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    const size_t sizes2[] = { 50, POOL_SIZE - 270 };
+    void *batch2[2];
+    assert_int_equal(mem_new_alloc_batch(pool, sizes2, 2, batch2), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, POOL_SIZE, 7, 0);
+
+    assert_int_equal(mem_del_alloc(pool, batch0[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, batch0[2]), ALLOC_OK);
+    const size_t sizes3[] = { 40, 40 };
+    void *batch3[2];
+    assert_int_equal(mem_new_alloc_batch(pool, sizes3, 2, batch3), ALLOC_FAIL);
+    assert_null(batch3[0]);
+    assert_null(batch3[1]);
+    pool_segment_t exp1[7] =
+            {
+                    {60, 1},
+                    {40, 1},
+                    {50, 1},
+                    {30, 0},
+                    {40, 1},
+                    {50, 0},
+                    {POOL_SIZE - 270, 1}
+            };
+    check_pool(pool, exp1);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, POOL_SIZE - 80, 5, 2);
+
+    assert_int_equal(mem_del_alloc(pool, batch0[1]), ALLOC_OK);
+    for (int i = 0; i < 2; ++i) {
+        assert_int_equal(mem_del_alloc(pool, batch1[i]), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(pool, batch2[i]), ALLOC_OK);
+    }
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_batch_free(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * A batch free merges each run of gaps once:
+     *
+     * 1. Allocate 6 x 100 and deallocate 1.
+     * 2. Deallocate 4, 2, 0, 3 as a batch: one gap from 0 to 4.
+     * 3. Deallocate a batch with 5 twice: nothing is freed.
+     * 4. Deallocate 5 as a batch, back to one gap.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+
+    void *allocs[6];
+    for (int i = 0; i < 6; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+
+    void *batch0[4] = { allocs[4], allocs[2], allocs[0], allocs[3] };
+    assert_int_equal(mem_del_alloc_batch(pool, batch0, 4), ALLOC_OK);
+    pool_segment_t exp0[3] =
+            {
+                    {500, 0},
+                    {100, 1},
+                    {POOL_SIZE - 600, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 100, 1, 2);
+
+    void *batch1[2] = { allocs[5], allocs[5] };
+    assert_int_equal(mem_del_alloc_batch(pool, batch1, 2), ALLOC_FAIL);
+    check_pool(pool, exp0);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 100, 1, 2);
+
+    assert_int_equal(mem_del_alloc_batch(pool, batch1, 1), ALLOC_OK);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_reset(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Resetting drops every allocation at once:
+     *
+     * 1. Allocate 3 x 100 in a TLSF pool and deallocate the middle one.
+     * 2. Reset: one gap, and the old handles are no longer valid.
+     * 3. Allocate again, then force-close with the allocation live.
+     * 4. The same for BUDDY and FIXED_SIZE pools.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, TLSF);
+    assert_non_null(pool);
+
+    void *allocs[3];
+    for (int i = 0; i < 3; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    pool_segment_t exp0[1] =
+            {
+                    {POOL_SIZE, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, TLSF, POOL_SIZE, 0, 0, 1);
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_FAIL);
+
+    void *alloc0 = mem_new_alloc(pool, 200);
+    assert_non_null(alloc0);
+    pool_segment_t exp1[2] =
+            {
+                    {200, 1},
+                    {POOL_SIZE - 200, 0}
+            };
+    check_pool(pool, exp1);
+    assert_int_equal(mem_pool_close_force(pool), ALLOC_OK);
+
+    pool = mem_pool_open(1024, BUDDY);
+    assert_non_null(pool);
+    assert_non_null(mem_new_alloc(pool, 100));
+    assert_non_null(mem_new_alloc(pool, 300));
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    check_metadata(pool, BUDDY, 1024, 0, 0, 1);
+    assert_non_null(mem_new_alloc(pool, 1024));
+    assert_int_equal(mem_pool_close_force(pool), ALLOC_OK);
+
+    pool = mem_pool_open_fixed(32, 100);
+    assert_non_null(pool);
+    void *obj0 = mem_fixed_alloc(pool);
+    assert_non_null(mem_fixed_alloc(pool));
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    check_metadata(pool, FIXED_SIZE, 3200, 0, 0, 1);
+    assert_int_equal(mem_fixed_free(pool, obj0), ALLOC_FAIL);
+    assert_ptr_equal(mem_fixed_alloc(pool), obj0);
+    assert_int_equal(mem_pool_close_force(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_linear(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * A LINEAR pool bumps a pointer and frees back to a mark:
+     *
+     * 1. Allocate 100 and 50 back to back, and mark.
+     * 2. Allocate 30 and 20, release to the mark: back to 150.
+     * 3. A mark past the current point cannot be released to.
+     * 4. Release to the start.
+     * 5. Allocate 3 x 100: the first mark, released below, is refused.
+     * 6. With 64-byte alignment, allocations step by 64.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, LINEAR);
+    assert_non_null(pool);
+    pool_mark_t start = mem_pool_mark(pool);
+
+    assert_ptr_equal(mem_linear_alloc(pool, 100), pool->mem);
+    assert_ptr_equal(mem_linear_alloc(pool, 50), pool->mem + 100);
+    pool_mark_t mark0 = mem_pool_mark(pool);
+    assert_non_null(mem_linear_alloc(pool, 30));
+    assert_non_null(mem_linear_alloc(pool, 20));
+    pool_segment_t exp0[2] =
+            {
+                    {200, 1},
+                    {POOL_SIZE - 200, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, LINEAR, POOL_SIZE, 200, 4, 1);
+    assert_null(mem_new_alloc(pool, 10));
+    assert_null(mem_linear_alloc(pool, POOL_SIZE));
+
+    assert_int_equal(mem_pool_release_to(pool, mark0), ALLOC_OK);
+    check_metadata(pool, LINEAR, POOL_SIZE, 150, 2, 1);
+    assert_ptr_equal(mem_linear_alloc(pool, 10), pool->mem + 150);
+    pool_mark_t mark1 = mem_pool_mark(pool);
+    assert_int_equal(mem_pool_release_to(pool, mark0), ALLOC_OK);
+    assert_int_equal(mem_pool_release_to(pool, mark1), ALLOC_FAIL);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+
+    assert_int_equal(mem_pool_release_to(pool, start), ALLOC_OK);
+    check_metadata(pool, LINEAR, POOL_SIZE, 0, 0, 1);
+
+    // mark0 was released below, so it stays refused once allocations
+    // cover it again
+    for (int i = 0; i < 3; ++i) {
+        assert_non_null(mem_linear_alloc(pool, 100));
+    }
+    assert_int_equal(mem_pool_release_to(pool, mark0), ALLOC_FAIL);
+    check_metadata(pool, LINEAR, POOL_SIZE, 300, 3, 1);
+    assert_int_equal(mem_pool_release_to(pool, start), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool_options_t options = { .alignment = 64 };
+    pool = mem_pool_open_ex(POOL_SIZE, LINEAR, &options);
+    assert_non_null(pool);
+    assert_ptr_equal(mem_linear_alloc(pool, 10), pool->mem);
+    assert_ptr_equal(mem_linear_alloc(pool, 10), pool->mem + 64);
+    check_metadata(pool, LINEAR, POOL_SIZE, 20, 2, 1);
+    assert_int_equal(mem_pool_close_force(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void *striped_worker(void *arg) {
+    pool_pt pool = arg;
+    unsigned long failures = 0;
+    void *window[16] = { NULL };
+
+    // keep a window of live allocations, freeing the oldest for each new one
+    for (unsigned i = 0; i < 20000; ++i) {
+        void **slot = &window[i % 16];
+        if (*slot) {
+            failures += (mem_del_alloc(pool, *slot) != ALLOC_OK);
+        }
+        *slot = mem_new_alloc(pool, 16 + (i % 7) * 24);
+        failures += (*slot == NULL);
+    }
+    for (unsigned i = 0; i < 16; ++i) {
+        if (window[i]) {
+            failures += (mem_del_alloc(pool, window[i]) != ALLOC_OK);
+        }
+    }
+
+    return (void *) failures;
+}
+
+static void test_pool_striped(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * A thread-safe pool is a pool per stripe, each behind its own lock:
+     *
+     * 1. Stripes are a power of two, at least a page each, and not LINEAR.
+     * 2. 4 stripes of 8192 are 4 gaps that never merge.
+     * 3. Allocate 4 x 8192, one stripe each, and nothing more fits.
+     * 4. Deallocate 2 as a batch and shrink a third in place; a garbage
+     *    handle is refused.
+     * 5. Reset and close.
+     * 6. 8 threads allocate and deallocate in a TLSF pool of 16 stripes.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_options_t bad0 = { .stripes = 3 };
+    assert_null(mem_pool_open_ex(4 * 8192, FIRST_FIT, &bad0));
+    pool_options_t bad1 = { .stripes = 16 };
+    assert_null(mem_pool_open_ex(8192, FIRST_FIT, &bad1));
+    assert_null(mem_pool_open_ex(POOL_SIZE, LINEAR, &bad1));
+
+    pool_options_t options = { .stripes = 4 };
+    pool_pt pool = mem_pool_open_ex(4 * 8192, FIRST_FIT, &options);
+    assert_non_null(pool);
+    pool_segment_t exp0[4] =
+            {
+                    {8192, 0},
+                    {8192, 0},
+                    {8192, 0},
+                    {8192, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, FIRST_FIT, 4 * 8192, 0, 0, 4);
+
+    void *allocs[4];
+    for (int i = 0; i < 4; ++i) {
+        allocs[i] = mem_new_alloc(pool, 8192);
+        assert_non_null(allocs[i]);
+    }
+    assert_null(mem_new_alloc(pool, 1));
+    check_metadata(pool, FIRST_FIT, 4 * 8192, 4 * 8192, 4, 0);
+
+    void *batch[2] = { allocs[3], allocs[0] };
+    assert_int_equal(mem_del_alloc_batch(pool, batch, 2), ALLOC_OK);
+    assert_ptr_equal(mem_realloc(pool, allocs[1], 100), allocs[1]);
+    check_metadata(pool, FIRST_FIT, 4 * 8192, 8192 + 100, 2, 3);
+    int not_a_handle = 0;
+    void *garbage[1] = { &not_a_handle };
+    assert_null(mem_realloc(pool, &not_a_handle, 100));
+    assert_int_equal(mem_del_alloc_batch(pool, garbage, 1), ALLOC_FAIL);
+    check_metadata(pool, FIRST_FIT, 4 * 8192, 8192 + 100, 2, 3);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    check_pool(pool, exp0);
+    check_metadata(pool, FIRST_FIT, 4 * 8192, 0, 0, 4);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pthread_t threads[8];
+    options.stripes = 16;
+    pool = mem_pool_open_ex(POOL_SIZE, TLSF, &options);
+    assert_non_null(pool);
+    for (unsigned t = 0; t < 8; ++t) {
+        assert_int_equal(pthread_create(&threads[t], NULL, striped_worker, pool), 0);
+    }
+    for (unsigned t = 0; t < 8; ++t) {
+        void *failures;
+        assert_int_equal(pthread_join(threads[t], &failures), 0);
+        assert_int_equal((unsigned long) failures, 0);
+    }
+    check_metadata(pool, TLSF, POOL_SIZE, 0, 0, 16);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void *cache_worker(void *arg) {
+    pool_pt pool = arg;
+    unsigned long failures = 0;
+    void *window[32] = { NULL };
+
+    // as striped_worker, through the thread's cache, which the thread
+    // leaves to be flushed when it exits
+    for (unsigned i = 0; i < 20000; ++i) {
+        void **slot = &window[i % 32];
+        if (*slot) {
+            failures += (mem_cache_free(pool, *slot) != ALLOC_OK);
+        }
+        *slot = mem_cache_alloc(pool, 1 + (i % 13) * 20);
+        failures += (*slot == NULL);
+    }
+    for (unsigned i = 0; i < 32; ++i) {
+        failures += (mem_cache_free(pool, window[i]) != ALLOC_OK);
+    }
+
+    return (void *) failures;
+}
+
+static void test_pool_cache(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * A thread cache keeps freed blocks of up to 256 bytes for reuse:
+     *
+     * 1. Allocate 20 bytes: a batch of 16 x 32 comes from the pool.
+     * 2. Deallocate it, which works once only, and allocate 30: the same
+     *    block, handed out once, and the pool untouched.
+     * 3. 1000 bytes go straight to the pool and back.
+     * 4. Deallocating 200 x 16 keeps at most a bucket's worth.
+     * 5. Flush: the pool is empty again and closes.
+     * 6. After a reset, the cache starts over with a fresh batch.
+     * 7. 8 threads through their caches into a pool of 16 stripes;
+     *    each thread's cache is flushed when it exits.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    void *alloc0 = mem_cache_alloc(pool, 20);
+    assert_non_null(alloc0);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 16 * 32, 16, 1);
+    assert_int_equal(mem_cache_free(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_cache_free(pool, alloc0), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_FAIL);
+    assert_ptr_equal(mem_cache_alloc(pool, 30), alloc0);
+    void *other = mem_cache_alloc(pool, 30);
+    assert_ptr_not_equal(other, alloc0);
+    assert_int_equal(mem_cache_free(pool, other), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 16 * 32, 16, 1);
+
+    void *alloc1 = mem_cache_alloc(pool, 1000);
+    assert_non_null(alloc1);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 16 * 32 + 1000, 17, 1);
+    assert_int_equal(mem_cache_free(pool, alloc1), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 16 * 32, 16, 1);
+
+    void *allocs[200];
+    for (int i = 0; i < 200; ++i) {
+        allocs[i] = mem_cache_alloc(pool, 16);
+        assert_non_null(allocs[i]);
+    }
+    for (int i = 0; i < 200; ++i) {
+        assert_int_equal(mem_cache_free(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_in_range(pool->num_allocs, 16, 16 + 64);
+
+    assert_int_equal(mem_cache_free(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_cache_flush(pool), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_non_null(mem_cache_alloc(pool, 64));
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    assert_non_null(mem_cache_alloc(pool, 64));
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 16 * 64, 16, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_int_equal(mem_pool_close_force(pool), ALLOC_OK);
+
+    pthread_t threads[8];
+    pool_options_t options = { .stripes = 16 };
+    pool = mem_pool_open_ex(POOL_SIZE, TLSF, &options);
+    assert_non_null(pool);
+    for (unsigned t = 0; t < 8; ++t) {
+        assert_int_equal(pthread_create(&threads[t], NULL, cache_worker, pool), 0);
+    }
+    for (unsigned t = 0; t < 8; ++t) {
+        void *failures;
+        assert_int_equal(pthread_join(threads[t], &failures), 0);
+        assert_int_equal((unsigned long) failures, 0);
+    }
+    check_metadata(pool, TLSF, POOL_SIZE, 0, 0, 16);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void *fixed_lock_free_worker(void *arg) {
+    pool_pt pool = ((void **) arg)[0];
+    uintptr_t stamp = (uintptr_t) ((void **) arg)[1];
+    unsigned long failures = 0;
+    uintptr_t *window[32] = { NULL };
+
+    // a slot handed to two threads at once would lose one of the stamps
+    for (unsigned i = 0; i < 50000; ++i) {
+        uintptr_t **slot = &window[i % 32];
+        if (*slot) {
+            failures += (**slot != stamp + i % 32);
+            failures += (mem_fixed_free(pool, *slot) != ALLOC_OK);
+        }
+        *slot = mem_fixed_alloc(pool);
+        failures += (*slot == NULL);
+        if (*slot) {
+            **slot = stamp + i % 32;
+        }
+    }
+    for (unsigned i = 0; i < 32; ++i) {
+        failures += (mem_fixed_free(pool, window[i]) != ALLOC_OK);
+    }
+
+    return (void *) failures;
+}
+
+static void test_pool_fixed_lock_free(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * A lock-free fixed-size pool behaves as a fixed-size pool:
+     *
+     * 1. Allocate 5 of 10, deallocate 1 and 3, try a double free.
+     * 2. Allocate 2: the last freed slot first.
+     * 3. Deallocate everything and close.
+     * 4. 8 threads allocate and deallocate 50000 times each, with no slot
+     *    handed to two threads at once.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_options_t bad = { .alignment = 16 };
+    assert_null(mem_pool_open_fixed_ex(24, 10, &bad));
+    pool_options_t options = { .lock_free = 1 };
+    pool_pt pool = mem_pool_open_fixed_ex(24, 10, &options);
+    assert_non_null(pool);
+
+    char *objs[5];
+    for (int i = 0; i < 5; ++i) {
+        objs[i] = mem_fixed_alloc(pool);
+        assert_ptr_equal(objs[i], pool->mem + i * 24);
+    }
+    assert_int_equal(mem_fixed_free(pool, objs[1]), ALLOC_OK);
+    assert_int_equal(mem_fixed_free(pool, objs[3]), ALLOC_OK);
+    assert_int_equal(mem_fixed_free(pool, objs[3]), ALLOC_FAIL);
+    assert_int_equal(mem_fixed_free(pool, objs[2] + 1), ALLOC_FAIL);
+    pool_segment_t exp0[6] =
+            {
+                    {24, 1},
+                    {24, 0},
+                    {24, 1},
+                    {24, 0},
+                    {24, 1},
+                    {120, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, FIXED_SIZE, 240, 72, 3, 3);
+
+    assert_ptr_equal(mem_fixed_alloc(pool), objs[3]);
+    assert_ptr_equal(mem_fixed_alloc(pool), objs[1]);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    for (int i = 0; i < 5; ++i) {
+        assert_int_equal(mem_fixed_free(pool, objs[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pthread_t threads[8];
+    void *args[8][2];
+    pool = mem_pool_open_fixed_ex(sizeof(uintptr_t), 8 * 32 + 8, &options);
+    assert_non_null(pool);
+    for (unsigned t = 0; t < 8; ++t) {
+        args[t][0] = pool;
+        args[t][1] = (void *) (uintptr_t) (t << 8);
+        assert_int_equal(pthread_create(&threads[t], NULL, fixed_lock_free_worker, args[t]), 0);
+    }
+    for (unsigned t = 0; t < 8; ++t) {
+        void *failures;
+        assert_int_equal(pthread_join(threads[t], &failures), 0);
+        assert_int_equal((unsigned long) failures, 0);
+    }
+    pool_segment_t exp1[1] =
+            {
+                    {(8 * 32 + 8) * sizeof(uintptr_t), 0}
+            };
+    check_pool(pool, exp1);
+    check_metadata(pool, FIXED_SIZE, (8 * 32 + 8) * sizeof(uintptr_t), 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void *remote_owner_worker(void *arg) {
+    pool_pt pool = ((void **) arg)[0];
+    void **allocs = (void **) arg + 1;
+    unsigned long failures = 0;
+
+    // A, B, C and D in this thread's stripe, C and A freed here, and E
+    // into A's place
+    const size_t sizes[4] = { 1000, 100, 50, 100 };
+    for (unsigned i = 0; i < 4; ++i) {
+        allocs[i] = mem_new_alloc(pool, sizes[i]);
+        failures += (allocs[i] == NULL);
+    }
+    failures += (mem_del_alloc(pool, allocs[2]) != ALLOC_OK);
+    failures += (mem_del_alloc(pool, allocs[0]) != ALLOC_OK);
+    allocs[4] = mem_new_alloc(pool, 1000);
+    failures += (allocs[4] == NULL);
+
+    return (void *) failures;
+}
+
+static void *remote_freer_worker(void *arg) {
+    pool_pt pool = ((void **) arg)[0];
+    void **allocs = (void **) arg + 1;
+    unsigned long failures = 0;
+
+    // stale after reuse, double, good, and double again once queued
+    failures += (mem_del_alloc(pool, allocs[0]) != ALLOC_FAIL);
+    failures += (mem_del_alloc(pool, allocs[2]) != ALLOC_FAIL);
+    failures += (mem_del_alloc(pool, allocs[1]) != ALLOC_OK);
+    failures += (mem_del_alloc(pool, allocs[1]) != ALLOC_FAIL);
+
+    return (void *) failures;
+}
+
+static void test_pool_remote_free(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * A thread frees into a stripe other than its own through the stripe's
+     * queue, and the stripe's owner carries the frees out in a batch:
+     *
+     * 1. Allocate 4 x 8192 in 4 stripes, the first from this thread's own.
+     * 2. Deallocate the second: queued, the pool still has 4 allocations.
+     * 3. Allocate 8192: the second stripe drains its queue and has room,
+     *    under a new handle.
+     * 4. Deallocate all and drain the pool: 4 empty stripes.
+     * 5. In a BEST_FIT pool, a thread allocates A (1000), B (100), C (50)
+     *    and D (100), frees C and A, and allocates E (1000) in A's place.
+     * 6. A thread that came after it, so at home in another stripe, frees
+     *    A (stale) and C (freed already): both refused, not queued. B is
+     *    queued, and refused when freed again.
+     * 7. Drain: D and E are left, and free cleanly.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_options_t options = { .stripes = 4 };
+    pool_pt pool = mem_pool_open_ex(4 * 8192, FIRST_FIT, &options);
+    assert_non_null(pool);
+
+    void *allocs[4];
+    for (int i = 0; i < 4; ++i) {
+        allocs[i] = mem_new_alloc(pool, 8192);
+        assert_non_null(allocs[i]);
+    }
+    pool_stats_t stats;
+    mem_pool_stats(pool, &stats);
+    assert_int_equal(stats.remote_frees, 0);
+    assert_int_equal(stats.remote_depth, 0);
+
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+    assert_int_equal(pool->num_allocs, 4);
+    mem_pool_stats(pool, &stats);
+    assert_int_equal(stats.remote_frees, 1);
+    assert_int_equal(stats.remote_depth, 1);
+    assert_int_equal(stats.remote_drains, 0);
+
+    void *again = mem_new_alloc(pool, 8192);
+    assert_non_null(again);
+    assert_ptr_not_equal(again, allocs[1]);
+    allocs[1] = again;
+    mem_pool_stats(pool, &stats);
+    assert_int_equal(stats.remote_depth, 0);
+    assert_int_equal(stats.remote_drains, 1);
+    assert_int_equal(stats.remote_max_drain, 1);
+    check_metadata(pool, FIRST_FIT, 4 * 8192, 4 * 8192, 4, 0);
+
+    for (int i = 0; i < 4; ++i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(pool->num_allocs, 3);
+    assert_int_equal(mem_pool_drain(pool), ALLOC_OK);
+    assert_int_equal(pool->num_allocs, 0);
+    mem_pool_stats(pool, &stats);
+    assert_int_equal(stats.remote_frees, 4);
+    assert_int_equal(stats.remote_depth, 0);
+    assert_int_equal(stats.remote_max_drain, 1);
+    check_metadata(pool, FIRST_FIT, 4 * 8192, 0, 0, 4);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    // homes are handed out to threads in turn, so two threads, one after
+    // the other, are at home in neighbouring stripes
+    void *args[6];
+    args[0] = pool = mem_pool_open_ex(4 * 8192, BEST_FIT, &options);
+    assert_non_null(pool);
+    pthread_t thread;
+    void *failures;
+    assert_int_equal(pthread_create(&thread, NULL, remote_owner_worker, args), 0);
+    assert_int_equal(pthread_join(thread, &failures), 0);
+    assert_int_equal((unsigned long) failures, 0);
+    assert_int_equal(pool->num_allocs, 3);
+
+    assert_int_equal(pthread_create(&thread, NULL, remote_freer_worker, args), 0);
+    assert_int_equal(pthread_join(thread, &failures), 0);
+    assert_int_equal((unsigned long) failures, 0);
+    mem_pool_stats(pool, &stats);
+    assert_int_equal(stats.remote_frees, 1);
+    assert_int_equal(stats.remote_depth, 1);
+
+    assert_int_equal(mem_pool_drain(pool), ALLOC_OK);
+    assert_int_equal(pool->num_allocs, 2);
+    assert_int_equal(pool->alloc_size, 1100);
+    assert_int_equal(mem_del_alloc(pool, args[4]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, args[5]), ALLOC_OK);
+    assert_int_equal(mem_pool_drain(pool), ALLOC_OK);
+    check_metadata(pool, BEST_FIT, 4 * 8192, 0, 0, 4);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_backing(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Pool memory from mmap, on huge pages if there are any:
+     *
+     * 1. An unknown backing fails.
+     * 2. Each backing gives a usable pool, reported by mem_pool_stats.
+     * 3. Huge page pools, whatever they fell back to, start on a 2M
+     *    boundary, and a 2M allocation after a small one skips to the
+     *    next, leaving the padding a gap.
+     * 4. A fixed-size pool on mmap.
+     */
+
+    const size_t huge = (size_t) 2 << 20;
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_options_t bad = { .backing = (pool_backing) 7 };
+    assert_null(mem_pool_open_ex(POOL_SIZE, FIRST_FIT, &bad));
+
+    for (pool_backing backing = BACKING_MALLOC; backing <= BACKING_HUGETLB; ++backing) {
+        pool_options_t options = { .backing = backing };
+        pool_pt pool = mem_pool_open_ex(4 * huge, FIRST_FIT, &options);
+        assert_non_null(pool);
+        pool_stats_t stats;
+        mem_pool_stats(pool, &stats);
+        assert_true(stats.backing <= backing);
+        memset(pool->mem, 0xA5, pool->total_size);
+
+        void *small = mem_new_alloc(pool, 100);
+        void *large = mem_new_alloc(pool, huge);
+        assert_non_null(small);
+        assert_non_null(large);
+        if (backing >= BACKING_THP) {
+            pool_segment_t exp[4] =
+                    {
+                            {100, 1},
+                            {huge - 100, 0},
+                            {huge, 1},
+                            {2 * huge, 0}
+                    };
+            assert_int_equal((size_t) pool->mem % huge, 0);
+            check_pool(pool, exp);
+            check_metadata(pool, FIRST_FIT, 4 * huge, huge + 100, 2, 2);
+        } else {
+            pool_segment_t exp[3] =
+                    {
+                            {100, 1},
+                            {huge, 1},
+                            {3 * huge - 100, 0}
+                    };
+            check_pool(pool, exp);
+            check_metadata(pool, FIRST_FIT, 4 * huge, huge + 100, 2, 1);
+        }
+        assert_int_equal(mem_del_alloc(pool, large), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(pool, small), ALLOC_OK);
+        check_metadata(pool, FIRST_FIT, 4 * huge, 0, 0, 1);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    pool_options_t options = { .backing = BACKING_MMAP };
+    pool_pt pool = mem_pool_open_fixed_ex(64, 1000, &options);
+    assert_non_null(pool);
+    void *obj = mem_fixed_alloc(pool);
+    assert_ptr_equal(obj, pool->mem);
+    assert_int_equal(mem_fixed_free(pool, obj), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_file(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * A pool in a file, closed with its allocations and attached again:
+     *
+     * 1. Only node list policies, and only new files.
+     * 2. Allocate 100, 200, 300, write into the first, deallocate the
+     *    second, and close with 2 allocations.
+     * 3. Attach: the same segments, the same contents, and the handles
+     *    found again by offset.
+     * 4. Deallocate everything, close, attach: one gap.
+     * 5. A file with both snapshot headers damaged is refused.
+     */
+
+    const char *path = "test_pool_file.pool";
+    remove(path);
+    assert_int_equal(mem_init(), ALLOC_OK);
+    assert_null(mem_pool_open_file(path, 65536, BUDDY));
+    pool_pt pool = mem_pool_open_file(path, 65536, BEST_FIT);
+    assert_non_null(pool);
+    assert_null(mem_pool_open_file(path, 65536, BEST_FIT));
+    pool_stats_t stats;
+    mem_pool_stats(pool, &stats);
+    assert_int_equal(stats.backing, BACKING_FILE);
+
+    void *a = mem_new_alloc(pool, 100);
+    void *b = mem_new_alloc(pool, 200);
+    void *c = mem_new_alloc(pool, 300);
+    assert_non_null(a);
+    assert_non_null(b);
+    assert_non_null(c);
+    memset(pool->mem, 'a', 100);
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_OK);
+    assert_int_equal(mem_pool_sync(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_attach_file(path);
+    assert_non_null(pool);
+    pool_segment_t exp[4] =
+            {
+                    {100, 1},
+                    {200, 0},
+                    {300, 1},
+                    {65536 - 600, 0}
+            };
+    check_pool(pool, exp);
+    check_metadata(pool, BEST_FIT, 65536, 400, 2, 2);
+    for (int i = 0; i < 100; ++i) {
+        assert_int_equal(pool->mem[i], 'a');
+    }
+    assert_null(mem_alloc_at(pool, 100));
+    assert_null(mem_alloc_at(pool, 101));
+    c = mem_alloc_at(pool, 300);
+    a = mem_alloc_at(pool, 0);
+    assert_non_null(c);
+    assert_non_null(a);
+    assert_ptr_equal(mem_new_alloc(pool, 200), mem_alloc_at(pool, 100));
+    assert_int_equal(mem_del_alloc(pool, mem_alloc_at(pool, 100)), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, c), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_attach_file(path);
+    assert_non_null(pool);
+    check_metadata(pool, BEST_FIT, 65536, 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    // a flipped byte in the header of each of the two snapshots
+    long offsets[2] = { 16, 2048 + 16 };
+    int bytes[2];
+    FILE *file = fopen(path, "r+b");
+    assert_non_null(file);
+    for (int i = 0; i < 2; ++i) {
+        assert_int_equal(fseek(file, offsets[i], SEEK_SET), 0);
+        bytes[i] = fgetc(file);
+        assert_int_equal(fseek(file, offsets[i], SEEK_SET), 0);
+        fputc(bytes[i] ^ 0x01, file);
+    }
+    fclose(file);
+    assert_null(mem_pool_attach_file(path));
+    file = fopen(path, "r+b");
+    assert_non_null(file);
+    for (int i = 0; i < 2; ++i) {
+        assert_int_equal(fseek(file, offsets[i], SEEK_SET), 0);
+        fputc(bytes[i], file);
+    }
+    fclose(file);
+    pool = mem_pool_attach_file(path);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(remove(path), 0);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+#define CRASH_STATES 16
+#define CRASH_SEGMENTS 16
+
+typedef struct _crash_state {
+    unsigned num_segments;
+    pool_segment_t segments[CRASH_SEGMENTS];
+} crash_state_t;
+
+static void crash_record(pool_pt pool, crash_state_t states[], unsigned *num_states) {
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+
+    if (states != NULL) {
+        mem_inspect_pool(pool, &segs, &num_segs);
+        states[*num_states].num_segments = num_segs;
+        memcpy(states[*num_states].segments, segs, sizeof(pool_segment_t) * num_segs);
+        (*num_states)++;
+        free(segs);
+    }
+}
+
+// every kind of change to a file-backed pool, with its state after each
+// step recorded if states is not NULL; 0 if all went as expected
+static int crash_workload(const char *path, crash_state_t states[], unsigned *num_states) {
+    pool_pt pool = mem_pool_open_file(path, 65536, FIRST_FIT);
+    if (pool == NULL) {
+        return 1;
+    }
+    crash_record(pool, states, num_states);
+
+    void *a = mem_new_alloc(pool, 1000);
+    crash_record(pool, states, num_states);
+    void *b = mem_new_alloc(pool, 2000);
+    crash_record(pool, states, num_states);
+    void *c = mem_new_alloc(pool, 3000);
+    crash_record(pool, states, num_states);
+    int failures = (a == NULL) + (b == NULL) + (c == NULL);
+    failures += (mem_del_alloc(pool, b) != ALLOC_OK);
+    crash_record(pool, states, num_states);
+    failures += (mem_realloc(pool, a, 1500) != a);
+    crash_record(pool, states, num_states);
+    size_t sizes[3] = { 100, 200, 300 };
+    void *batch[3];
+    failures += (mem_new_alloc_batch(pool, sizes, 3, batch) != ALLOC_OK);
+    crash_record(pool, states, num_states);
+    failures += (mem_pool_sync(pool) != ALLOC_OK);
+    void *frees[2] = { c, batch[1] };
+    failures += (mem_del_alloc_batch(pool, frees, 2) != ALLOC_OK);
+    crash_record(pool, states, num_states);
+    failures += (mem_new_alloc(pool, 4000) == NULL);
+    crash_record(pool, states, num_states);
+    failures += (mem_del_alloc(pool, a) != ALLOC_OK);
+    crash_record(pool, states, num_states);
+    failures += (mem_pool_close(pool) != ALLOC_OK);
+
+    return failures;
+}
+
+// a free that finds the journal full, then an allocation into its place
+// as the first record after the snapshot, then the process dies
+static int crash_full_journal(const char *path) {
+    pool_pt pool = mem_pool_open_file(path, 65536, FIRST_FIT);
+    if (pool == NULL) {
+        return 1;
+    }
+    void *x = mem_new_alloc(pool, 100);
+    void *z = mem_new_alloc(pool, 50);
+    int failures = (x == NULL) + (z == NULL);
+    for (unsigned i = 0; i < 1022; ++i) {
+        failures += (mem_realloc(pool, z, (i % 2) ? 50 : 60) != z);
+    }
+    failures += (mem_del_alloc(pool, x) != ALLOC_OK);
+    failures += (mem_new_alloc(pool, 80) == NULL);
+
+    return failures;
+}
+
+static void test_pool_file_crash(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * A file-backed pool attached after the process is killed in any
+     * one of its writes to the file, torn halfway:
+     *
+     * 1. Record the pool after each step of the workload, uninterrupted.
+     * 2. Kill a child running the workload at its first write, then its
+     *    second, and so on, until the workload finishes.
+     * 3. Each time, the pool attaches as one of the recorded states, no
+     *    earlier than the one before, or not at all before the first
+     *    snapshot is written.
+     * 4. A child allocates X (100) and Z (50), resizes Z until the journal
+     *    is full, frees X, allocates 80 in its place and exits: the pool
+     *    attaches with X freed.
+     */
+
+#if defined(__linux__)
+    const char *path = "test_pool_file_crash.pool";
+    crash_state_t states[CRASH_STATES];
+    unsigned num_states = 0;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    remove(path);
+    assert_int_equal(crash_workload(path, states, &num_states), 0);
+    assert_int_equal(remove(path), 0);
+
+    int last = -1;
+    for (unsigned long step = 1; ; ++step) {
+        fflush(stdout);
+        pid_t child = fork();
+        assert_true(child >= 0);
+        if (child == 0) {
+            mem_pool_crash_at(step);
+            _exit(crash_workload(path, NULL, NULL));
+        }
+        int status;
+        assert_int_equal(waitpid(child, &status, 0), child);
+        int killed = WIFSIGNALED(status) && (WTERMSIG(status) == SIGKILL);
+        assert_true(killed || (WIFEXITED(status) && (WEXITSTATUS(status) == 0)));
+
+        pool_pt pool = mem_pool_attach_file(path);
+        if (pool == NULL) {
+            assert_int_equal(last, -1);
+            assert_true(killed);
+        } else {
+            pool_segment_pt segs = NULL;
+            unsigned num_segs = 0;
+            mem_inspect_pool(pool, &segs, &num_segs);
+            int found = -1;
+            for (int i = (last < 0) ? 0 : last; (i < (int) num_states) && (found < 0); ++i) {
+                if ((states[i].num_segments == num_segs) &&
+                    (memcmp(states[i].segments, segs, sizeof(pool_segment_t) * num_segs) == 0)) {
+                    found = i;
+                }
+            }
+            free(segs);
+            assert_true(found >= 0);
+            last = found;
+            assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+        }
+        remove(path);
+        if (!killed) {
+            break;
+        }
+    }
+    assert_int_equal(last, (int) num_states - 1);
+
+    fflush(stdout);
+    pid_t child = fork();
+    assert_true(child >= 0);
+    if (child == 0) {
+        _exit(crash_full_journal(path));
+    }
+    int status;
+    assert_int_equal(waitpid(child, &status, 0), child);
+    assert_true(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+    pool_pt pool = mem_pool_attach_file(path);
+    assert_non_null(pool);
+    pool_segment_t exp0[4] =
+            {
+                    {80, 1},
+                    {20, 0},
+                    {50, 1},
+                    {65536 - 150, 0}
+            };
+    check_pool(pool, exp0);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(remove(path), 0);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+#endif
+}
+
+static void test_pool_sharded(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * A sharded pool is a thread-safe pool with a stripe per CPU:
+     *
+     * 1. At least a page per shard, so a pool of a page has one shard.
+     * 2. A larger pool has a power of two of empty shards.
+     * 3. 8 threads allocate and deallocate, each frees going back to the
+     *    shard it came from.
+     * 4. An allocation larger than any shard fails.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    assert_null(mem_pool_open_sharded(4095, FIRST_FIT));
+    assert_null(mem_pool_open_sharded(POOL_SIZE, LINEAR));
+    pool_pt pool = mem_pool_open_sharded(4096, FIRST_FIT);
+    assert_non_null(pool);
+    check_metadata(pool, FIRST_FIT, 4096, 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_sharded(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    unsigned shards = pool->num_gaps;
+    assert_int_equal(shards & (shards - 1), 0);
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+    size_t total = 0;
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, shards);
+    for (unsigned i = 0; i < num_segs; ++i) {
+        assert_int_equal(segs[i].allocated, 0);
+        total += segs[i].size;
+    }
+    assert_int_equal(total, POOL_SIZE);
+    free(segs);
+
+    pthread_t threads[8];
+    for (unsigned t = 0; t < 8; ++t) {
+        assert_int_equal(pthread_create(&threads[t], NULL, striped_worker, pool), 0);
+    }
+    for (unsigned t = 0; t < 8; ++t) {
+        void *failures;
+        assert_int_equal(pthread_join(threads[t], &failures), 0);
+        assert_int_equal((unsigned long) failures, 0);
+    }
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, shards);
+    if (shards > 1) {
+        assert_null(mem_new_alloc(pool, POOL_SIZE / 2 + 4096));
+    }
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***         7. DRIVER ROUTINE           ***/
+/*******************************************/
+
+int run_test_suite() {
+    const struct CMUnitTest tests[] = {
+            // General tests
+            cmocka_unit_test(test_pool_store_smoketest),
+            cmocka_unit_test(test_pool_smoketest),
+
+            cmocka_unit_test(test_pool_nonempty),
+
+            cmocka_unit_test_setup_teardown(test_pool_ff_metadata, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_bf_metadata, pool_bf_setup, pool_bf_teardown),
+
+            // First-fit tests
+            cmocka_unit_test_setup_teardown(test_pool_scenario00, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario01, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario02, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario03, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario04, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario05, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario06, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario07, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario08, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario09, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario10, pool_ff_setup, pool_ff_teardown),
+
+            // Best-fit tests
+            cmocka_unit_test_setup_teardown(test_pool_scenario11, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario12, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario13, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario14, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario15, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario16, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario17, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario18, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario19, pool_bf_setup, pool_bf_teardown),
+
+            // Extensions
+            cmocka_unit_test_setup_teardown(test_pool_node_stats, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_bad_handles, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test(test_pool_next_fit),
+            cmocka_unit_test(test_pool_segregated_fit),
+            cmocka_unit_test(test_pool_buddy),
+            cmocka_unit_test(test_pool_tlsf),
+            cmocka_unit_test(test_pool_fixed),
+            cmocka_unit_test(test_pool_bitmap_fit),
+            cmocka_unit_test(test_pool_bitmap_scan),
+            cmocka_unit_test(test_pool_aligned),
+            cmocka_unit_test(test_pool_realloc),
+            cmocka_unit_test(test_pool_batch_alloc),
+            cmocka_unit_test(test_pool_batch_free),
+            cmocka_unit_test(test_pool_reset),
+            cmocka_unit_test(test_pool_linear),
+            cmocka_unit_test(test_pool_striped),
+            cmocka_unit_test(test_pool_cache),
+            cmocka_unit_test(test_pool_fixed_lock_free),
+            cmocka_unit_test(test_pool_sharded),
+            cmocka_unit_test(test_pool_remote_free),
+            cmocka_unit_test(test_pool_backing),
+            cmocka_unit_test(test_pool_file),
+            cmocka_unit_test(test_pool_file_crash),
 
             // Stress tests
             cmocka_unit_test(test_pool_stresstest0),
+            cmocka_unit_test(test_pool_stresstest1),
     };
 
     return cmocka_run_group_tests_name("pool_test_suite", tests, NULL, NULL);